@@ -0,0 +1,37 @@
+#!/bin/sh
+# Time a script of test/echo calls run as builtins against the same script
+# calling the external binaries, which costs a spawn per line
+#
+# usage: bench/builtins.sh [MARCEL] [ITERATIONS]
+
+MARCEL=${1:-./marcel}
+ITERATIONS=${2:-10000}
+BUILTIN=$(mktemp)
+EXTERNAL=$(mktemp)
+trap 'rm -f "$BUILTIN" "$EXTERNAL"' EXIT
+
+TEST=/usr/bin/test
+ECHO=/bin/echo
+
+i=0
+while [ $i -lt "$ITERATIONS" ]; do
+    echo 'test -f /etc/passwd'
+    echo "echo line $i"
+    i=$((i + 1))
+done > "$BUILTIN"
+sed -e "s|^test |$TEST |" -e "s|^echo |$ECHO |" "$BUILTIN" > "$EXTERNAL"
+
+now() { date +%s.%N; }
+
+run() {
+    label=$1
+    script=$2
+    start=$(now)
+    "$MARCEL" "$script" > /dev/null 2>&1
+    end=$(now)
+    echo "$label $start $end" | awk -v n="$ITERATIONS" \
+        '{ t = $3 - $2; printf "%-10s %8.3fs %10.0f iterations/s\n", $1, t, n / t }'
+}
+
+run "builtin" "$BUILTIN"
+run "external" "$EXTERNAL"
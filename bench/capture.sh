@@ -0,0 +1,54 @@
+#!/bin/sh
+# Capture the output of a command with $(...) in marcel against bash and dash,
+# for outputs from a few bytes to MAX_SIZE bytes (16 times bigger each step).
+# Each size is captured as many times as it takes to read about 256MiB, at
+# most 200 times, with the output read from a file by cat
+#
+# usage: bench/capture.sh [MARCEL] [MAX_SIZE]
+
+MARCEL=${1:-./marcel}
+MAX_SIZE=${2:-268435456}
+MAX_REPS=200
+TOTAL=268435456
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+now() { date +%s.%N; }
+
+run() {
+    label=$1
+    size=$2
+    reps=$3
+    shift 3
+    start=$(now)
+    "$@" "$dir/script" > /dev/null
+    end=$(now)
+    echo "$label $size $reps $start $end" | awk \
+        '{ t = $5 - $4; printf "%-7s %10d B x %3d %8.3fs %9.1f MB/s %9.1f us/capture\n",
+           $1, $2, $3, t, $2 * $3 / t / 1e6, t / $3 * 1e6 }'
+}
+
+size=16
+while [ "$size" -le "$MAX_SIZE" ]; do
+    yes 'the quick brown fox jumps over the lazy dog' | head -c "$size" \
+        > "$dir/out"
+    reps=$((TOTAL / size))
+    [ "$reps" -gt "$MAX_REPS" ] && reps=$MAX_REPS
+    [ "$reps" -lt 1 ] && reps=1
+    # marcel has no loops, the script repeats the line instead
+    i=0
+    : > "$dir/script"
+    while [ "$i" -lt "$reps" ]; do
+        echo "x=\$(cat $dir/out)" >> "$dir/script"
+        i=$((i + 1))
+    done
+
+    run marcel "$size" "$reps" "$MARCEL"
+    for sh in bash dash; do
+        if command -v "$sh" > /dev/null; then
+            run "$sh" "$size" "$reps" "$sh"
+        fi
+    done
+    size=$((size * 16))
+done
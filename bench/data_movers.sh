@@ -0,0 +1,38 @@
+#!/bin/bash
+# CPU and wall time of moving a large file with the cat/tee builtins against
+# the external binaries (same scripts with cat and tee replaced by full paths)
+#
+# usage: bench/data_movers.sh [MARCEL] [MEGABYTES]
+
+MARCEL=${1:-./marcel}
+MEGABYTES=${2:-1024}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+head -c "${MEGABYTES}M" /dev/zero > "$DIR/in"
+
+cat > "$DIR/builtin" <<EOF
+cat $DIR/in > $DIR/out
+cat $DIR/in | cat > $DIR/out
+cat $DIR/in | tee $DIR/out > $DIR/out2
+EOF
+sed -e "s|cat |$(command -v cat) |g" -e "s|tee |$(command -v tee) |g" \
+    "$DIR/builtin" > "$DIR/external"
+
+TIMEFORMAT='%R %U %S'
+run() {
+    label=$1
+    line=$2
+    sed -n "${line}p" "$DIR/$label" > "$DIR/script"
+    sync
+    t=$( { time "$MARCEL" "$DIR/script" > /dev/null 2>&1; } 2>&1 )
+    echo "$label $t" | awk -v mb="$MEGABYTES" -v what="$3" \
+        '{ printf "%-9s %-14s %7.3fs real %7.3fs user %7.3fs sys %8.0f MB/s\n",
+           $1, what, $2, $3, $4, mb / $2 }'
+}
+
+for mode in builtin external; do
+    run $mode 1 "file>file"
+    run $mode 2 "file|pipe>file"
+    run $mode 3 "tee"
+done
@@ -0,0 +1,104 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Throughput of parameter expansion on long argument lists. Builds a job
+// with N arguments (default 10000), a fifth of them plain words and the
+// rest a mix of $NAME, ${NAME}, ${NAME:-WORD} and ${#NAME}, and expands it
+// ROUNDS times (default 200). The cost of building the job is measured on
+// its own and taken out.
+//
+// usage: bench/expand [N] [ROUNDS]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ds/proc.h"
+#include "ds/vec.h"
+#include "execute.h"
+#include "expand.h"
+#include "variables.h"
+
+int exit_code;
+
+static char *words[] = {
+    "--plain-option",
+    "$HOME",
+    "prefix-${NAME}-suffix",
+    "${UNSET:-fallback}/$NAME",
+    "${#LONG} $LONG",
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static job *build_job(size_t n)
+{
+    job *j = new_job();
+    proc *p = new_proc(j->mem);
+    vec_append(&p, sizeof p, (vec *) &j->procs);
+    for (size_t i = 0; i < n; i++) {
+        char *w = words[i % (sizeof words / sizeof *words)];
+        vec_append(&w, sizeof w, (vec *) &p->argv);
+    }
+    return j;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000;
+    size_t rounds = argc > 2 ? strtoul(argv[2], NULL, 10) : 200;
+    initialize_builtins();
+    initialize_variables();
+    set_var("HOME", "/home/marcel", false);
+    set_var("NAME", "value", false);
+    set_var("LONG", "a somewhat longer value to copy around", false);
+
+    double start = now();
+    for (size_t r = 0; r < rounds; r++) {
+        free_single_job(build_job(n));
+    }
+    double built = now();
+
+    size_t bytes = 0;
+    for (size_t r = 0; r < rounds; r++) {
+        job *j = build_job(n);
+        if (!expand_job(j)) {
+            return 1;
+        }
+        if (!r) {
+            for (char **arg = j->procs[0]->argv; *arg; arg++) {
+                bytes += strlen(*arg) + 1;
+            }
+        }
+        free_single_job(j);
+    }
+    double expanded = now();
+
+    double t = (expanded - built) - (built - start);
+    printf("args          %zu x %zu rounds\n", n, rounds);
+    printf("build         %.3f s\n", built - start);
+    printf("expand        %.3f s (%.1f ns/arg, %.0f MB/s out)\n", t,
+           t / (n * rounds) * 1e9, bytes * rounds / t / 1e6);
+    return 0;
+}
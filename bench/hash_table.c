@@ -0,0 +1,113 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Insert/lookup/delete throughput of hash_table at 10, 1k and 100k keys.
+// Small tables are filled and emptied repeatedly so every size performs
+// roughly the same number of operations.
+//
+// usage: bench/hash_table
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ds/hash_table.h"
+
+#define TOTAL_OPS 2000000
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char **make_keys(size_t n, char const *prefix)
+{
+    char **keys = malloc(n * sizeof *keys);
+    for (size_t i = 0; i < n; i++) {
+        keys[i] = malloc(32);
+        snprintf(keys[i], 32, "%s%zu", prefix, i);
+    }
+    return keys;
+}
+
+static void free_keys(char **keys, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        free(keys[i]);
+    }
+    free(keys);
+}
+
+static void run(size_t n)
+{
+    char **keys = make_keys(n, "cmd-");
+    char **missing = make_keys(n, "nope-");
+    size_t reps = TOTAL_OPS / n;
+    double insert = 0, hit = 0, miss = 0, delete = 0;
+    size_t found = 0;
+
+    for (size_t r = 0; r < reps; r++) {
+        hash_table t = new_table(0);
+
+        double start = now();
+        for (size_t i = 0; i < n; i++) {
+            add_node(keys[i], keys[i], t);
+        }
+        double inserted = now();
+        for (size_t i = 0; i < n; i++) {
+            found += find_node(keys[i], NULL, t) != NULL;
+        }
+        double hits = now();
+        for (size_t i = 0; i < n; i++) {
+            found += find_node(missing[i], NULL, t) != NULL;
+        }
+        double misses = now();
+        for (size_t i = 0; i < n; i++) {
+            delete_node(keys[i], NULL, NULL, t);
+        }
+        double deleted = now();
+
+        insert += inserted - start;
+        hit += hits - inserted;
+        miss += misses - hits;
+        delete += deleted - misses;
+        free_table(t, NULL);
+    }
+
+    double ops = (double) n * reps / 1e9;
+    printf("%-8zu %10.1f %10.1f %10.1f %10.1f\n", n, insert / ops, hit / ops,
+           miss / ops, delete / ops);
+    if (found != n * reps) {
+        printf("error: found %zu of %zu keys\n", found, n * reps);
+    }
+    free_keys(keys, n);
+    free_keys(missing, n);
+}
+
+int main(void)
+{
+    printf("%-8s %10s %10s %10s %10s  (ns/op)\n", "keys", "insert", "hit",
+           "miss", "delete");
+    size_t sizes[] = {10, 1000, 100000};
+    for (size_t i = 0; i < sizeof sizes / sizeof *sizes; i++) {
+        run(sizes[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,100 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Reap latency of the job table with many concurrent background jobs.
+// Forks N children (default 10000) that block until released, registers each
+// as a one-proc job, releases them all at once and then times how long the
+// job table takes to reap and report every one of them.
+//
+// usage: bench/job_table [N]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ds/proc.h"
+#include "ds/vec.h"
+#include "jobs.h"
+
+int exit_code;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000;
+    initialize_job_control(false);
+
+    int gate[2];
+    pipe(gate);
+    proc **procs = malloc(n * sizeof *procs);
+
+    double start = now();
+    for (size_t i = 0; i < n; i++) {
+        job *j = new_job();
+        proc *p = new_proc(j->mem);
+        vec_append(&p, sizeof p, (vec *) &j->procs);
+        j->name = "sleep";
+        register_job(j);
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0) {
+            char c;
+            close(gate[1]);
+            read(gate[0], &c, 1);
+            _exit(0);
+        }
+        p->pid = pid;
+        register_proc(j, p);
+        procs[i] = p;
+    }
+    double launched = now();
+
+    // Let every child exit and wait for them all to become zombies
+    close(gate[1]);
+    sleep(2);
+
+    double reap_start = now();
+    size_t done = 0;
+    while (done < n) {
+        check_job_status();
+        for (; done < n && procs[done]->completed; done++);
+    }
+    double reaped = now();
+    report_job_status();
+    double reported = now();
+
+    printf("jobs          %zu\n", n);
+    printf("launch        %.3f s\n", launched - start);
+    printf("reap          %.3f s (%.2f us/job)\n", reaped - reap_start,
+           (reaped - reap_start) / n * 1e6);
+    printf("report        %.3f s (%.2f us/job)\n", reported - reaped,
+           (reported - reaped) / n * 1e6);
+    free(procs);
+    return 0;
+}
@@ -0,0 +1,58 @@
+#!/bin/sh
+# Loops of ITERATIONS iterations (default 100000) in marcel against dash and
+# bash. Bodies are builtins and assignments, so no time is spent forking and
+# what is measured is the cost of going round the loop: expanding and running
+# the body, which marcel parses once for the whole loop. The same commands are
+# also run as a script of ITERATIONS lines, without a loop.
+#
+# usage: bench/loops.sh [MARCEL] [ITERATIONS]
+
+MARCEL=${1:-./marcel}
+N=${2:-100000}
+SHELLS="$MARCEL dash bash"
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+seq "$N" > "$dir/numbers"
+cat > "$dir/for" <<'SCRIPT'
+for i in $(seq $N); do x=$i; done
+SCRIPT
+cat > "$dir/for-if" <<'SCRIPT'
+for i in $(seq $N); do if test $i = 0; then x=$i; else cd .; fi; done
+SCRIPT
+cat > "$dir/for-case" <<'SCRIPT'
+for i in $(seq $N); do
+    case $i in
+        *0) x=zero ;;
+        *1|*3|*5|*7|*9) x=odd ;;
+        *) x=even ;;
+    esac
+done
+SCRIPT
+cat > "$dir/while-read" <<'SCRIPT'
+while read i; do x=$i; done
+SCRIPT
+awk -v n="$N" 'BEGIN { for (i = 1; i <= n; i++) print "x=" i }' \
+    > "$dir/unrolled"
+
+now() { date +%s.%N; }
+
+run() {
+    label=$1
+    sh=$2
+    script=$3
+    start=$(now)
+    N=$N USER=${USER:-bench} "$sh" "$dir/$script" < "$dir/numbers" \
+        > /dev/null 2>&1
+    end=$(now)
+    echo "$label $(basename "$sh") $start $end" | awk -v n="$N" \
+        '{ t = $4 - $3; printf "%-11s %-7s %8.3fs %9.0f iterations/s\n",
+           $1, $2, t, n / t }'
+}
+
+for script in for for-if for-case while-read unrolled; do
+    for sh in $SHELLS; do
+        run "$script" "$sh" "$script"
+    done
+done
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Fan a command out over many inputs with the parallel builtin against
+# xargs -P (and GNU parallel, if installed), each fed the same inputs on stdin
+#
+# usage: bench/parallel.sh [MARCEL] [INPUTS] [JOBS]
+
+MARCEL=${1:-./marcel}
+INPUTS=${2:-5000}
+JOBS=${3:-4}
+
+now() { date +%s.%N; }
+
+run() {
+    label=$1
+    shift
+    start=$(now)
+    seq "$INPUTS" | "$@" > /dev/null
+    end=$(now)
+    echo "$label $start $end" | awk -v n="$INPUTS" \
+        '{ t = $3 - $2; printf "%-24s %8.3fs %10.0f jobs/s\n", $1, t, n / t }'
+}
+
+for cmd in /bin/true /bin/echo; do
+    name=$(basename "$cmd")
+    run "marcel-parallel/$name" "$MARCEL" -c "parallel -j $JOBS $cmd"
+    run "xargs-P/$name" xargs -P "$JOBS" -n 1 "$cmd"
+    if command -v parallel > /dev/null; then
+        run "gnu-parallel/$name" parallel -j "$JOBS" "$cmd"
+    fi
+done
@@ -0,0 +1,393 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Throughput of the lexer and parser, without the rest of the shell. Generates
+// corpora of about MIB MiB each (default 4): short commands and lists, 1000
+// stage pipelines, words heavy on quotes and escapes, lines of VAR=val
+// assignments, and a script of 4 * MIB MiB mixing all of them. Each corpus is
+// first checked to split into the same tokens with the tokenizer and with
+// flex. Then, with each of them, it is lexed on its own and parsed line by
+// line into jobs the way the shell does, ROUNDS times (default 3) keeping the
+// fastest round.
+//
+// Prints a tab separated table, one row per corpus and lexer, for tracking
+// regressions: lines, tokens, bytes, lex tokens/s, parse seconds, lines/s, tokens/s, MB/s,
+// malloc/calloc/realloc calls per parsed line, and peak RSS while parsing.
+// Allocations are counted by wrapping malloc with the linker (--wrap), so the
+// count covers the lexer, the parser and the job they build, not libc.
+//
+// usage: bench/parse [MIB] [ROUNDS]
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/resource.h>
+
+#include "ds/arena.h"
+#include "ds/proc.h"
+// parser.h first, lexer.h needs YYSTYPE
+#include "parser.h"
+#include "lexer.h"
+#include "tokenizer.h"
+
+// Number of stages of the long pipelines
+#define STAGES 1000
+
+typedef struct corpus {
+    char const *name;
+    char *text; // Lines, each terminated by a NUL rather than a newline
+    size_t len;
+    size_t size;
+    size_t lines;
+} corpus;
+
+static size_t allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    allocs++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size)
+{
+    allocs++;
+    return __real_realloc(p, size);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Forget the peak RSS so far, if the kernel lets us
+static void reset_peak_rss(void)
+{
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+    if (f) {
+        fputs("5", f);
+        fclose(f);
+    }
+}
+
+// Peak RSS in KiB since reset_peak_rss
+static long peak_rss(void)
+{
+    long kb = -1;
+    FILE *f = fopen("/proc/self/status", "r");
+    if (f) {
+        char line[256];
+        while (fgets(line, sizeof line, f)) {
+            if (sscanf(line, "VmHWM: %ld", &kb) == 1) {
+                break;
+            }
+        }
+        fclose(f);
+    }
+    if (kb < 0) {
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        kb = ru.ru_maxrss;
+    }
+    return kb;
+}
+
+// Deterministic so every run parses the same text
+static unsigned long rnd(void)
+{
+    static unsigned long state = 88172645463325252UL;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// Append text to the line being built
+static void put(corpus *c, char const *fmt, ...)
+{
+    for (;;) {
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(c->text + c->len, c->size - c->len, fmt, ap);
+        va_end(ap);
+        if ((size_t) n < c->size - c->len) {
+            c->len += n;
+            return;
+        }
+        c->size = c->size * 2 + n;
+        c->text = realloc(c->text, c->size);
+        if (!c->text) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+}
+
+static void end_line(corpus *c)
+{
+    put(c, "");
+    c->len++;
+    c->lines++;
+}
+
+static void short_line(corpus *c)
+{
+    static char const *cmds[] = {
+        "ls -la /tmp", "cd ..", "echo hello world", "cat notes.txt > copy.txt",
+        "grep -v foo < input.txt", "make -j4 &", "time sleep 1", "git status",
+        "sort -u names >> all-names", "cc -O2 -o prog prog.c 2> errors",
+        "cd build && make || echo failed", "mkdir -p out; cp a b out",
+    };
+    put(c, "%s", cmds[rnd() % (sizeof cmds / sizeof *cmds)]);
+    end_line(c);
+}
+
+static void pipeline_line(corpus *c, size_t stages)
+{
+    for (size_t i = 0; i < stages; i++) {
+        put(c, "%sstage%zu -n %lu", i ? " | " : "", i, rnd() % 100);
+    }
+    end_line(c);
+}
+
+static void quoting_line(corpus *c)
+{
+    unsigned long n = rnd() % 1000;
+    // Where the rules of the lexer meet
+    if (n % 4 == 0) {
+        put(c, "\"a\"b 'c d'e timex time=%lu A= _x=\\$y $(a $(b c) d)e "
+               "$(open \"x\"y\"\" \\\\ 12>g 2>f%lu", n, n);
+        end_line(c);
+        return;
+    }
+    put(c, "printf \"%%s %lu\\n\" \"double quoted $HOME/%lu\" 'single $quoted' "
+           "esc\\ aped\\ word\\ %lu \\$literal a\\\"b\\'c \"$(date +%%s)\" "
+           "x\\|y\\&z\\<w\\>v", n, n, n);
+    end_line(c);
+}
+
+static void assign_line(corpus *c)
+{
+    size_t vars = 1 + rnd() % 20;
+    for (size_t i = 0; i < vars; i++) {
+        put(c, "%sVAR%zu=value_%lu", i ? " " : "", i, rnd() % 10000);
+    }
+    if (rnd() % 2) {
+        put(c, " env");
+    }
+    end_line(c);
+}
+
+static void mixed_line(corpus *c)
+{
+    unsigned long r = rnd() % 100;
+    if (r < 55) {
+        short_line(c);
+    } else if (r < 75) {
+        quoting_line(c);
+    } else if (r < 95) {
+        assign_line(c);
+    } else {
+        pipeline_line(c, 2 + rnd() % 30);
+    }
+}
+
+static corpus generate(char const *name, void (*line)(corpus *), size_t bytes)
+{
+    corpus c = {.name = name, .size = bytes + 4096};
+    c.text = malloc(c.size);
+    while (c.len < bytes) {
+        line(&c);
+    }
+    return c;
+}
+
+static void long_pipeline(corpus *c)
+{
+    pipeline_line(c, STAGES);
+}
+
+// Lex every line of c, returning the number of tokens
+static size_t lex(corpus const *c, tokenizer *t)
+{
+    size_t tokens = 0;
+    for (char const *l = c->text; l < c->text + c->len; l += strlen(l) + 1) {
+        t->mem = new_arena();
+        start_tokenizer(l, t);
+        YYSTYPE val;
+        while (next_token(&val, t)) {
+            tokens++;
+        }
+        stop_tokenizer(t);
+        free_arena(t->mem);
+    }
+    return tokens;
+}
+
+// Parse every line of c into its jobs, returning the number of lines that
+// failed. A line ending with '&' or ';' has nothing after it
+static size_t parse(corpus const *c, tokenizer *t)
+{
+    size_t failed = 0;
+    for (char const *l = c->text; l < c->text + c->len; l += strlen(l) + 1) {
+        start_tokenizer(l, t);
+        unsigned char sep = SEP_END;
+        for (;;) {
+            job *j = new_job();
+            parse_state ps = {.job = j};
+            bool ok = !yyparse(&ps, t) && (j->valid || sep == SEP_SEQ);
+            bool last = !j->valid || j->sep == SEP_END;
+            sep = j->sep;
+            free_single_job(j);
+            if (!ok || last) {
+                failed += !ok;
+                break;
+            }
+        }
+        stop_tokenizer(t);
+    }
+    return failed;
+}
+
+// Check that the tokenizer and flex split every line of c the same way, into
+// the same tokens at the same places
+static bool same_tokens(corpus const *c, tokenizer *tok, tokenizer *flex)
+{
+    bool same = true;
+    for (char const *l = c->text; same && l < c->text + c->len;
+         l += strlen(l) + 1) {
+        arena *a = new_arena();
+        tok->mem = flex->mem = a;
+        start_tokenizer(l, tok);
+        start_tokenizer(l, flex);
+        int token;
+        do {
+            YYSTYPE val = {NULL};
+            YYSTYPE flex_val = {NULL};
+            token = next_token(&val, tok);
+            same = token == next_token(&flex_val, flex)
+                   && tok->token == flex->token
+                   && (val.str == flex_val.str
+                       || (val.str && flex_val.str
+                           && !strcmp(val.str, flex_val.str)));
+        } while (same && token);
+        stop_tokenizer(flex);
+        stop_tokenizer(tok);
+        free_arena(a);
+        if (!same) {
+            fprintf(stderr, "%s: tokens differ from flex on: %.200s\n",
+                    c->name, l);
+        }
+    }
+    return same;
+}
+
+static bool run(corpus const *c, size_t rounds, tokenizer *t)
+{
+    reset_peak_rss();
+    double lex_t = 0;
+    double parse_t = 0;
+    size_t tokens = 0;
+    size_t parse_allocs = 0;
+    for (size_t r = 0; r < rounds; r++) {
+        double start = now();
+        tokens = lex(c, t);
+        double elapsed = now() - start;
+        if (!r || elapsed < lex_t) {
+            lex_t = elapsed;
+        }
+
+        size_t before = allocs;
+        start = now();
+        size_t failed = parse(c, t);
+        elapsed = now() - start;
+        parse_allocs = allocs - before;
+        if (failed) {
+            fprintf(stderr, "%s: %zu lines failed to parse\n", c->name, failed);
+            return false;
+        }
+        if (!r || elapsed < parse_t) {
+            parse_t = elapsed;
+        }
+    }
+    printf("%s\t%s\t%zu\t%zu\t%zu\t%.0f\t%.6f\t%.0f\t%.0f\t%.2f\t%.2f\t%ld\n",
+           c->name, t->flex ? "flex" : "tokenizer", c->lines, tokens, c->len,
+           tokens / lex_t, parse_t, c->lines / parse_t, tokens / parse_t,
+           c->len / parse_t / 1e6, (double) parse_allocs / c->lines,
+           peak_rss());
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t mib = argc > 1 ? strtoul(argv[1], NULL, 10) : 4;
+    size_t rounds = argc > 2 ? strtoul(argv[2], NULL, 10) : 3;
+    size_t bytes = mib << 20;
+    if (!mib || !rounds) {
+        fprintf(stderr, "usage: %s [MIB] [ROUNDS]\n", argv[0]);
+        return 1;
+    }
+
+    tokenizer tok = {.flex = NULL};
+    tokenizer flex = {.flex = NULL};
+    if (yylex_init(&flex.flex)) {
+        perror("yylex_init");
+        return 1;
+    }
+    printf("corpus\tlexer\tlines\ttokens\tbytes\tlex_tokens_per_s\tparse_s\t"
+           "lines_per_s\ttokens_per_s\tmb_per_s\tallocs_per_line\t"
+           "peak_rss_kb\n");
+    struct {
+        char const *name;
+        void (*line)(corpus *);
+        size_t bytes;
+    } corpora[] = {
+        {"short", short_line, bytes},
+        {"pipeline", long_pipeline, bytes},
+        {"quoting", quoting_line, bytes},
+        {"assign", assign_line, bytes},
+        {"script", mixed_line, 4 * bytes},
+    };
+    int ret = 0;
+    for (size_t i = 0; i < sizeof corpora / sizeof *corpora; i++) {
+        corpus c = generate(corpora[i].name, corpora[i].line, corpora[i].bytes);
+        if (!same_tokens(&c, &tok, &flex) || !run(&c, rounds, &flex)
+            || !run(&c, rounds, &tok)) {
+            ret = 1;
+        }
+        free(c.text);
+    }
+    yylex_destroy(flex.flex);
+    return ret;
+}
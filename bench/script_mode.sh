@@ -0,0 +1,52 @@
+#!/bin/sh
+# Lines/second for scripts run through `marcel FILE` and `marcel < FILE`
+# Every line is a builtin so no time is spent forking; only the read, parse
+# and dispatch overhead of the shell is measured. The same commands are also
+# run PACK to a line (default 100), joined by `;` and by `&&`.
+#
+# usage: bench/script_mode.sh [MARCEL] [LINES]
+# Set BASELINE to another marcel binary to also time `cat FILE | $BASELINE`
+# (e.g. a build of the readline-only version)
+
+MARCEL=${1:-./marcel}
+LINES=${2:-100000}
+PACK=${PACK:-100}
+SCRIPT=$(mktemp)
+SEQ_SCRIPT=$(mktemp)
+AND_SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT" "$SEQ_SCRIPT" "$AND_SCRIPT"' EXIT
+
+# Writes LINES times `cd .`, $1 to a line joined by $2. Lines are then
+# counted as the commands they hold
+commands() {
+    awk -v n="$LINES" -v k="$1" -v sep="$2" 'BEGIN {
+        for (i = 1; i <= n; i++) {
+            printf "cd .%s", i % k && i < n ? sep : "\n"
+        }
+    }'
+}
+
+commands 1 > "$SCRIPT"
+commands "$PACK" '; ' > "$SEQ_SCRIPT"
+commands "$PACK" ' && ' > "$AND_SCRIPT"
+
+now() { date +%s.%N; }
+
+run() {
+    label=$1
+    shift
+    start=$(now)
+    "$@" > /dev/null 2>&1
+    end=$(now)
+    echo "$label $start $end" | awk -v n="$LINES" \
+        '{ t = $3 - $2; printf "%-24s %8.3fs %12.0f lines/s\n", $1, t, n / t }'
+}
+
+run "file" "$MARCEL" "$SCRIPT"
+run "stdin" sh -c '"$0" < "$1"' "$MARCEL" "$SCRIPT"
+run "pipe" sh -c 'cat "$1" | "$0"' "$MARCEL" "$SCRIPT"
+run "file-packed-seq" "$MARCEL" "$SEQ_SCRIPT"
+run "file-packed-and" "$MARCEL" "$AND_SCRIPT"
+if [ -n "$BASELINE" ]; then
+    run "baseline-pipe" sh -c 'cat "$1" | USER=${USER:-bench} "$0"' "$BASELINE" "$SCRIPT"
+fi
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Pack many inputs into as few commands as possible with the xargs builtin
+# against the system's xargs, each fed the same inputs on stdin, then the same
+# one input per command at JOBS at a time
+#
+# usage: bench/xargs.sh [MARCEL] [INPUTS] [JOBS]
+
+MARCEL=${1:-./marcel}
+INPUTS=${2:-1000000}
+JOBS=${3:-4}
+
+now() { date +%s.%N; }
+
+run() {
+    label=$1
+    n=$2
+    shift 2
+    start=$(now)
+    execs=$(seq "$n" | "$@" | wc -l)
+    end=$(now)
+    echo "$label $start $end $execs" | awk -v n="$n" \
+        '{ t = $3 - $2; printf "%-22s %8.3fs %10.0f inputs/s %6d execs\n",
+           $1, t, n / t, $4 }'
+}
+
+# Every exec prints a line
+count='echo $#'
+run marcel-xargs "$INPUTS" "$MARCEL" -c "xargs sh -c '$count'"
+run xargs "$INPUTS" xargs sh -c "$count"
+n=$((INPUTS / 200))
+run "marcel-xargs-n1-P$JOBS" "$n" "$MARCEL" -c "xargs -n 1 -P $JOBS /bin/echo"
+run "xargs-n1-P$JOBS" "$n" xargs -n 1 -P "$JOBS" /bin/echo
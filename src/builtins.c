@@ -0,0 +1,1243 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// copy_file_range, splice, tee
+#define _GNU_SOURCE
+
+#include <errno.h> // errno
+#include <stdarg.h> // va_list
+#include <stdio.h> // vsnprintf
+#include <stdlib.h> // malloc, free, strtoll, strtod
+#include <string.h> // strcmp, strlen, strchr, memcpy
+
+#include <fcntl.h> // open, splice, tee
+#include <sys/sendfile.h> // sendfile
+#include <sys/stat.h> // stat, fstat, lstat, S_IS*
+#include <unistd.h> // read, write, lseek, access, getcwd, isatty, copy_file_range
+
+#include "builtins.h"
+#include "execute.h" // FILE_MASK
+#include "macros.h" // Stopif, Assert_alloc, Free, Arr_len
+#include "signals.h" // interrupt_pending
+#include "variables.h" // get_var, set_var
+
+#define OUT_BUF_SIZE 4096
+#define READ_CHUNK 128
+// Bytes moved per kernel-side copy call, between which cat and tee check for
+// signals
+#define COPY_CHUNK (1 << 24)
+// tee(2) duplicates at most a pipe's worth at a time
+#define TEE_CHUNK (1 << 16)
+// Buffer for cat and tee when the kernel cannot move the data itself
+#define COPY_BUF_SIZE (1 << 17)
+
+// Buffered output to a proc's fd. Builtins run inside the shell, so stdio's
+// stdout cannot be used: it is not the proc's fd and may hold data of its own
+typedef struct out_buf {
+    int fd;
+    bool failed; // A write failed, errno was saved in err
+    int err;
+    size_t len;
+    char buf[OUT_BUF_SIZE];
+} out_buf;
+
+static void write_all(char const *s, size_t n, out_buf *o)
+{
+    while (n && !o->failed) {
+        ssize_t w = write(o->fd, s, n);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            o->failed = true;
+            o->err = errno;
+            return;
+        }
+        s += w;
+        n -= w;
+    }
+}
+
+static void out_flush(out_buf *o)
+{
+    write_all(o->buf, o->len, o);
+    o->len = 0;
+}
+
+static void out_write(char const *s, size_t n, out_buf *o)
+{
+    if (n > sizeof o->buf - o->len) {
+        out_flush(o);
+        if (n > sizeof o->buf) {
+            write_all(s, n, o);
+            return;
+        }
+    }
+    memcpy(o->buf + o->len, s, n);
+    o->len += n;
+}
+
+static inline void out_putc(char c, out_buf *o)
+{
+    if (o->len == sizeof o->buf) {
+        out_flush(o);
+    }
+    o->buf[o->len++] = c;
+}
+
+static inline void out_puts(char const *s, out_buf *o)
+{
+    out_write(s, strlen(s), o);
+}
+
+// printf into the buffer
+static void out_printf(out_buf *o, char const *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    size_t space = sizeof o->buf - o->len;
+    int n = vsnprintf(o->buf + o->len, space, fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t) n < space) {
+        o->len += n < 0 ? 0 : n;
+        return;
+    }
+
+    // Did not fit. Format into a buffer of the right size instead
+    char *tmp = malloc(n + 1);
+    Assert_alloc(tmp);
+    va_start(ap, fmt);
+    vsnprintf(tmp, n + 1, fmt, ap);
+    va_end(ap);
+    out_write(tmp, n, o);
+    free(tmp);
+}
+
+// Flush o and report a failed write on behalf of builtin name
+// Returns 0 on success, 1 on failure
+static int out_close(char const *name, out_buf *o)
+{
+    out_flush(o);
+    Stopif(o->failed, return 1, "%s: write error: %s", name, strerror(o->err));
+    return 0;
+}
+
+// Write the character for the escape sequence at s (just past the backslash)
+// to o. zero_octal selects echo's \0NNN form of octal escapes over printf's
+// \NNN. Sets *stop on \c. Returns a pointer past the sequence
+static char const *put_escape(char const *s, bool zero_octal, bool *stop,
+                              out_buf *o)
+{
+    static char const from[] = "abefnrtv\\";
+    static char const to[] = "\a\b\033\f\n\r\t\v\\";
+    char const *c = *s ? strchr(from, *s) : NULL;
+    if (c) {
+        out_putc(to[c - from], o);
+        return s + 1;
+    }
+    if (*s == 'c') {
+        *stop = true;
+        return s + 1;
+    }
+
+    char const *digits = s;
+    if (zero_octal && *s == '0') {
+        digits++;
+    }
+    if (zero_octal ? digits != s : *s >= '0' && *s <= '7') {
+        unsigned val = 0;
+        for (int i = 0; i < 3 && *digits >= '0' && *digits <= '7'; i++) {
+            val = val * 8 + (*digits++ - '0');
+        }
+        out_putc((char) val, o);
+        return digits;
+    }
+
+    // Not an escape sequence, keep it as is
+    out_putc('\\', o);
+    return s;
+}
+
+
+int m_true(proc const *p)
+{
+    (void) p;
+    return 0;
+}
+
+int m_false(proc const *p)
+{
+    (void) p;
+    return 1;
+}
+
+// echo [-neE] [ARG...]
+int m_echo(proc const *p)
+{
+    char **args = p->argv + 1;
+    bool newline = true;
+    bool escapes = false;
+    // Only words made up entirely of option letters are options
+    for (; *args && (*args)[0] == '-' && (*args)[1]; args++) {
+        if ((*args)[strspn(*args + 1, "neE") + 1] != '\0') {
+            break;
+        }
+        for (char *c = *args + 1; *c; c++) {
+            if (*c == 'n') {
+                newline = false;
+            } else {
+                escapes = *c == 'e';
+            }
+        }
+    }
+
+    out_buf o = {.fd = p->fds[1]};
+    bool stop = false;
+    for (char **a = args; *a && !stop; a++) {
+        if (a != args) {
+            out_putc(' ', &o);
+        }
+        if (!escapes) {
+            out_puts(*a, &o);
+            continue;
+        }
+        for (char const *s = *a; *s && !stop;) {
+            if (*s == '\\') {
+                s = put_escape(s + 1, true, &stop, &o);
+            } else {
+                out_putc(*s++, &o);
+            }
+        }
+    }
+    if (newline && !stop) {
+        out_putc('\n', &o);
+    }
+    return out_close("echo", &o);
+}
+
+// pwd [-L|-P]
+// The shell does not track a logical working directory, so both options
+// print the physical one
+int m_pwd(proc const *p)
+{
+    for (char **args = p->argv + 1; *args; args++) {
+        Stopif(strcmp(*args, "-L") && strcmp(*args, "-P"), return 2,
+               "pwd: invalid option: %s", *args);
+    }
+    char *dir = getcwd(NULL, 0);
+    Stopif(!dir, return 1, "pwd: %s", strerror(errno));
+    out_buf o = {.fd = p->fds[1]};
+    out_puts(dir, &o);
+    out_putc('\n', &o);
+    Free(dir);
+    return out_close("pwd", &o);
+}
+
+
+// printf FORMAT [ARG...]
+
+typedef struct printf_args {
+    char **next; // Next unused argument
+    bool err; // An argument was not a valid number
+} printf_args;
+
+static char const *next_arg(printf_args *a)
+{
+    return *a->next ? *a->next++ : "";
+}
+
+// Numeric value of the next argument. A leading quote gives the value of the
+// character after it
+static long long next_int(printf_args *a)
+{
+    char const *s = next_arg(a);
+    if (*s == '\'' || *s == '"') {
+        return (unsigned char) s[1];
+    }
+    char *end;
+    errno = 0;
+    long long val = strtoll(s, &end, 0);
+    Stopif(*s && (*end || errno), a->err = true,
+           "printf: %s: invalid number", s);
+    return val;
+}
+
+static double next_float(printf_args *a)
+{
+    char const *s = next_arg(a);
+    if (*s == '\'' || *s == '"') {
+        return (unsigned char) s[1];
+    }
+    char *end;
+    errno = 0;
+    double val = strtod(s, &end);
+    Stopif(*s && (*end || errno), a->err = true,
+           "printf: %s: invalid number", s);
+    return val;
+}
+
+// Print the conversion starting at the '%' at fmt. Returns a pointer past it
+// or NULL if the output should stop (\c in a %b argument)
+static char const *put_conversion(char const *fmt, printf_args *a, out_buf *o)
+{
+    // Room for "%", flags, two numbers, "ll" and the conversion
+    char spec[64];
+    size_t len = 0;
+    spec[len++] = *fmt++;
+
+    while (*fmt && strchr("-+ #0", *fmt) && len < 8) {
+        spec[len++] = *fmt++;
+    }
+    for (int field = 0; field < 2; field++) {
+        if (field == 1) {
+            if (*fmt != '.') {
+                break;
+            }
+            spec[len++] = *fmt++;
+        }
+        if (*fmt == '*') {
+            fmt++;
+            len += snprintf(spec + len, 24, "%d", (int) next_int(a));
+        } else {
+            for (int i = 0; i < 9 && *fmt >= '0' && *fmt <= '9'; i++) {
+                spec[len++] = *fmt++;
+            }
+        }
+    }
+
+    char conv = *fmt;
+    switch (conv) {
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+        spec[len++] = 'l';
+        spec[len++] = 'l';
+        spec[len++] = conv;
+        spec[len] = '\0';
+        out_printf(o, spec, next_int(a));
+        break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+        spec[len++] = conv;
+        spec[len] = '\0';
+        out_printf(o, spec, next_float(a));
+        break;
+    case 'c': {
+        char const *arg = next_arg(a);
+        spec[len++] = 'c';
+        spec[len] = '\0';
+        if (*arg) {
+            out_printf(o, spec, *arg);
+        }
+        break;
+    }
+    case 's':
+        spec[len++] = 's';
+        spec[len] = '\0';
+        out_printf(o, spec, next_arg(a));
+        break;
+    case 'b': {
+        // Expand the argument into its own buffer so the width applies to it
+        out_buf tmp = {.fd = -1};
+        bool stop = false;
+        // Each step adds at most one character, so this never flushes tmp
+        for (char const *s = next_arg(a);
+                *s && !stop && tmp.len < sizeof tmp.buf - 1;) {
+            if (*s == '\\') {
+                s = put_escape(s + 1, true, &stop, &tmp);
+            } else {
+                out_putc(*s++, &tmp);
+            }
+        }
+        tmp.buf[tmp.len] = '\0';
+        spec[len++] = 's';
+        spec[len] = '\0';
+        out_printf(o, spec, tmp.buf);
+        if (stop) {
+            return NULL;
+        }
+        break;
+    }
+    case '%':
+        out_putc('%', o);
+        break;
+    default:
+        Err_msg("printf: %%%c: invalid conversion", conv ? conv : ' ');
+        a->err = true;
+        return conv ? fmt + 1 : fmt;
+    }
+    return fmt + 1;
+}
+
+int m_printf(proc const *p)
+{
+    char const *fmt = p->argv[1];
+    Stopif(!fmt, return 2, "printf: usage: printf FORMAT [ARG...]");
+
+    out_buf o = {.fd = p->fds[1]};
+    printf_args a = {.next = p->argv + 2};
+    bool stop = false;
+    // Reuse the format for as long as it consumes arguments
+    do {
+        char **start = a.next;
+        for (char const *s = fmt; !stop && *s;) {
+            if (*s == '\\') {
+                s = put_escape(s + 1, false, &stop, &o);
+            } else if (*s == '%') {
+                s = put_conversion(s, &a, &o);
+                stop = !s;
+            } else {
+                out_putc(*s++, &o);
+            }
+        }
+        if (a.next == start) {
+            break;
+        }
+    } while (*a.next && !stop);
+
+    int ret = out_close("printf", &o);
+    return ret ? ret : a.err;
+}
+
+
+// test EXPR, [ EXPR ]
+// Parsed by recursive descent:
+//   expr    := and ("-o" and)*
+//   and     := not ("-a" not)*
+//   not     := "!" not | primary
+//   primary := "(" expr ")" | WORD BINOP WORD | UNOP WORD | WORD
+// A binary operator is looked for first, which gives the POSIX results for
+// every expression of up to four arguments
+
+typedef struct test_state {
+    char **argv;
+    size_t pos, argc;
+    bool err;
+} test_state;
+
+static bool test_or(test_state *t);
+
+static inline char const *peek(size_t ahead, test_state *t)
+{
+    return t->pos + ahead < t->argc ? t->argv[t->pos + ahead] : NULL;
+}
+
+static bool is_binop(char const *s)
+{
+    static char const *ops[] = {
+        "=", "!=", "-eq", "-ne", "-gt", "-ge", "-lt", "-le", "-nt", "-ot", "-ef",
+    };
+    for (size_t i = 0; s && i < Arr_len(ops); i++) {
+        if (strcmp(s, ops[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static long long test_int(char const *s, test_state *t)
+{
+    char *end;
+    errno = 0;
+    long long val = strtoll(s, &end, 10);
+    while (*end == ' ' || *end == '\t') {
+        end++;
+    }
+    Stopif(!*s || *end || errno, t->err = true,
+           "test: %s: integer expression expected", s);
+    return val;
+}
+
+static bool test_binary(char const *l, char const *op, char const *r,
+                        test_state *t)
+{
+    if (strcmp(op, "=") == 0) {
+        return strcmp(l, r) == 0;
+    }
+    if (strcmp(op, "!=") == 0) {
+        return strcmp(l, r) != 0;
+    }
+
+    if (op[1] == 'e' && op[2] == 'f') {
+        struct stat a, b;
+        return stat(l, &a) == 0 && stat(r, &b) == 0
+               && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+    }
+    if (op[2] == 't' && (op[1] == 'n' || op[1] == 'o')) {
+        // A missing file is older than any existing one
+        struct stat a, b;
+        bool has_a = stat(l, &a) == 0, has_b = stat(r, &b) == 0;
+        if (!has_a || !has_b) {
+            return op[1] == 'n' ? has_a : has_b;
+        }
+        if (a.st_mtim.tv_sec != b.st_mtim.tv_sec) {
+            return (a.st_mtim.tv_sec > b.st_mtim.tv_sec) == (op[1] == 'n');
+        }
+        if (a.st_mtim.tv_nsec == b.st_mtim.tv_nsec) {
+            return false;
+        }
+        return (a.st_mtim.tv_nsec > b.st_mtim.tv_nsec) == (op[1] == 'n');
+    }
+
+    long long a = test_int(l, t), b = test_int(r, t);
+    switch (op[1] << 8 | op[2]) {
+    case 'e' << 8 | 'q': return a == b;
+    case 'n' << 8 | 'e': return a != b;
+    case 'g' << 8 | 't': return a > b;
+    case 'g' << 8 | 'e': return a >= b;
+    case 'l' << 8 | 't': return a < b;
+    default: return a <= b;
+    }
+}
+
+// Evaluate unary operator op on arg. Sets *known to false if op is not one
+static bool test_unary(char op, char const *arg, bool *known, test_state *t)
+{
+    struct stat st;
+    switch (op) {
+    case 'n': return *arg;
+    case 'z': return !*arg;
+    case 't': return isatty((int) test_int(arg, t));
+    case 'r': return access(arg, R_OK) == 0;
+    case 'w': return access(arg, W_OK) == 0;
+    case 'x': return access(arg, X_OK) == 0;
+    case 'h': case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    }
+
+    if (!strchr("bcdefgpsSuk", op)) {
+        *known = false;
+        return false;
+    }
+    if (stat(arg, &st) != 0) {
+        return false;
+    }
+    switch (op) {
+    case 'b': return S_ISBLK(st.st_mode);
+    case 'c': return S_ISCHR(st.st_mode);
+    case 'd': return S_ISDIR(st.st_mode);
+    case 'f': return S_ISREG(st.st_mode);
+    case 'g': return st.st_mode & S_ISGID;
+    case 'k': return st.st_mode & S_ISVTX;
+    case 'p': return S_ISFIFO(st.st_mode);
+    case 's': return st.st_size > 0;
+    case 'S': return S_ISSOCK(st.st_mode);
+    case 'u': return st.st_mode & S_ISUID;
+    default: return true; // -e
+    }
+}
+
+static bool test_primary(test_state *t)
+{
+    char const *arg = peek(0, t);
+    if (!arg) {
+        Err_msg("test: argument expected");
+        t->err = true;
+        return false;
+    }
+
+    if (peek(2, t) && is_binop(peek(1, t))) {
+        t->pos += 3;
+        return test_binary(arg, t->argv[t->pos - 2], t->argv[t->pos - 1], t);
+    }
+    if (strcmp(arg, "(") == 0 && peek(1, t)) {
+        t->pos++;
+        bool ret = test_or(t);
+        Stopif(!peek(0, t) || strcmp(peek(0, t), ")"), t->err = true;
+               return false, "test: missing ')'");
+        t->pos++;
+        return ret;
+    }
+    if (arg[0] == '-' && arg[1] && !arg[2] && peek(1, t)) {
+        bool known = true;
+        bool ret = test_unary(arg[1], peek(1, t), &known, t);
+        if (known) {
+            t->pos += 2;
+            return ret;
+        }
+    }
+    // Any other word is true if it is not empty
+    t->pos++;
+    return *arg;
+}
+
+static bool test_not(test_state *t)
+{
+    char const *arg = peek(0, t);
+    if (arg && strcmp(arg, "!") == 0 && peek(1, t)) {
+        t->pos++;
+        return !test_not(t);
+    }
+    return test_primary(t);
+}
+
+static bool test_and(test_state *t)
+{
+    bool ret = test_not(t);
+    while (!t->err && peek(0, t) && strcmp(peek(0, t), "-a") == 0) {
+        t->pos++;
+        // Evaluate both sides so that errors are always reported
+        ret = test_not(t) && ret;
+    }
+    return ret;
+}
+
+static bool test_or(test_state *t)
+{
+    bool ret = test_and(t);
+    while (!t->err && peek(0, t) && strcmp(peek(0, t), "-o") == 0) {
+        t->pos++;
+        ret = test_and(t) || ret;
+    }
+    return ret;
+}
+
+int m_test(proc const *p)
+{
+    test_state t = {.argv = p->argv + 1};
+    for (char **a = t.argv; *a; a++, t.argc++);
+
+    if (strcmp(p->argv[0], "[") == 0) {
+        Stopif(!t.argc || strcmp(t.argv[t.argc - 1], "]"), return 2,
+               "[: missing ']'");
+        t.argc--;
+    }
+    if (!t.argc) {
+        return 1;
+    }
+
+    bool ret = test_or(&t);
+    Stopif(!t.err && t.pos != t.argc, return 2,
+           "test: %s: unexpected argument", t.argv[t.pos]);
+    return t.err ? 2 : !ret;
+}
+
+
+// read [-r] [NAME...]
+// Reads a line from the proc's input and splits it on IFS into the named
+// shell variables, the last taking the rest of the line. With no names
+// the whole line goes to REPLY
+
+// Growable buffer for the line being read
+typedef struct line_buf {
+    char *s;
+    size_t len, cap;
+} line_buf;
+
+static void line_append(char const *s, size_t n, line_buf *l)
+{
+    if (l->len + n + 1 > l->cap) {
+        l->cap = (l->len + n + 1) * 2;
+        char *tmp = realloc(l->s, l->cap);
+        Assert_alloc(tmp);
+        l->s = tmp;
+    }
+    memcpy(l->s + l->len, s, n);
+    l->len += n;
+    l->s[l->len] = '\0';
+}
+
+// Read up to and including the next newline of fd into l, without consuming
+// anything past it: unseekable input is read a byte at a time, seekable input
+// in chunks with the surplus seeked back over.
+// Returns 1 if a newline was read, 0 on end of file and -1 on error
+static int read_line(int fd, line_buf *l)
+{
+    bool seekable = lseek(fd, 0, SEEK_CUR) != -1;
+    char chunk[READ_CHUNK];
+    for (;;) {
+        ssize_t n = read(fd, chunk, seekable ? sizeof chunk : 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n;
+        }
+        char *nl = memchr(chunk, '\n', n);
+        if (nl) {
+            line_append(chunk, nl - chunk + 1, l);
+            if (seekable && nl - chunk + 1 < n) {
+                lseek(fd, (nl - chunk + 1) - n, SEEK_CUR);
+            }
+            return 1;
+        }
+        line_append(chunk, n, l);
+    }
+}
+
+// Set variable name to the field s[0, len), removing backslashes unless raw
+static void set_field(char const *name, char *s, size_t len, bool raw)
+{
+    size_t j = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (!raw && s[i] == '\\' && i + 1 < len) {
+            i++;
+        }
+        s[j++] = s[i];
+    }
+    s[j] = '\0';
+    Stopif(!set_var(name, s, false), return, "read: %s: not a valid name",
+           name);
+}
+
+int m_read(proc const *p)
+{
+    char **names = p->argv + 1;
+    bool raw = false;
+    if (*names && strcmp(*names, "-r") == 0) {
+        raw = true;
+        names++;
+    }
+
+    line_buf l = {NULL, 0, 0};
+    int status;
+    // Without -r a backslash before the newline continues the line
+    while ((status = read_line(p->fds[0], &l)) == 1) {
+        l.s[--l.len] = '\0';
+        size_t bs = 0;
+        while (bs < l.len && l.s[l.len - bs - 1] == '\\') {
+            bs++;
+        }
+        if (raw || bs % 2 == 0) {
+            break;
+        }
+        l.s[--l.len] = '\0';
+    }
+    Stopif(status < 0, Free(l.s); return 1, "read: %s", strerror(errno));
+    if (!l.s) {
+        line_append("", 0, &l);
+    }
+
+    if (!*names) {
+        // REPLY gets the whole line, unsplit
+        set_field("REPLY", l.s, l.len, raw);
+        Free(l.s);
+        return status == 0;
+    }
+
+    char const *ifs = get_var("IFS");
+    if (!ifs) {
+        ifs = " \t\n";
+    }
+    char *s = l.s, *end = l.s + l.len;
+#define Is_ifs_space(C) ((C) && strchr(ifs, (C)) && strchr(" \t\n", (C)))
+#define Is_ifs(C) ((C) && strchr(ifs, (C)))
+
+    while (s < end && Is_ifs_space(*s)) {
+        s++;
+    }
+    for (; *names; names++) {
+        if (!names[1]) {
+            // The last name takes the rest of the line minus trailing IFS
+            // whitespace
+            char *e = end;
+            while (e > s && Is_ifs_space(e[-1])
+                   && (raw || e - 1 == s || e[-2] != '\\')) {
+                e--;
+            }
+            set_field(*names, s, e - s, raw);
+            break;
+        }
+        char *f = s;
+        while (s < end && !Is_ifs(*s)) {
+            s += !raw && *s == '\\' && s + 1 < end ? 2 : 1;
+        }
+        char *f_end = s;
+        // Skip the delimiter: surrounding IFS whitespace and at most one
+        // other IFS character
+        while (s < end && Is_ifs_space(*s)) {
+            s++;
+        }
+        if (s < end && Is_ifs(*s) && !Is_ifs_space(*s)) {
+            s++;
+            while (s < end && Is_ifs_space(*s)) {
+                s++;
+            }
+        }
+        set_field(*names, f, f_end - f, raw);
+    }
+#undef Is_ifs_space
+#undef Is_ifs
+
+    // Hitting end of file fails even if part of a line was read
+    int ret = status == 0;
+    Free(l.s);
+    return ret;
+}
+
+
+// cat [-u] [FILE...], tee [-a] [FILE...]
+// Data is moved inside the kernel where the file types allow it: with
+// copy_file_range between regular files, splice when either side is a pipe
+// and sendfile from a regular file to anything else. tee duplicates pipe
+// input with tee(2). Everything else goes through a read/write loop.
+// Given any other option, the external cat or tee runs instead
+
+enum copy_method {
+    COPY_RANGE,
+    COPY_SPLICE,
+    COPY_SENDFILE,
+    COPY_READ_WRITE,
+};
+
+// Whether err from a kernel-side copy means the fds do not support it
+static inline bool unsupported(int err)
+{
+    return err == EINVAL || err == EXDEV || err == ENOSYS
+           || err == EOPNOTSUPP || err == EBADF;
+}
+
+// Write all n bytes of s to fd. Returns 0 on success, -1 on failure
+static int write_fd(int fd, char const *s, size_t n)
+{
+    while (n) {
+        ssize_t w = write(fd, s, n);
+        if (w < 0) {
+            if (errno == EINTR && !interrupt_pending()) {
+                continue;
+            }
+            return -1;
+        }
+        s += w;
+        n -= w;
+    }
+    return 0;
+}
+
+// Read from fd into buf, retrying interrupted reads unless a signal is waiting
+// to be handled
+static ssize_t read_fd(int fd, char *buf, size_t n)
+{
+    ssize_t r;
+    while ((r = read(fd, buf, n)) < 0 && errno == EINTR && !interrupt_pending());
+    return r;
+}
+
+static inline enum copy_method pick_method(struct stat const *in,
+                                           struct stat const *out)
+{
+    // Files such as those in /proc report a size of 0 but are not empty and
+    // only work with read
+    bool in_file = S_ISREG(in->st_mode) && in->st_size > 0;
+    if (in_file && S_ISREG(out->st_mode)) {
+        return COPY_RANGE;
+    }
+    if (S_ISFIFO(in->st_mode) || S_ISFIFO(out->st_mode)) {
+        return COPY_SPLICE;
+    }
+    if (in_file) {
+        return COPY_SENDFILE;
+    }
+    return COPY_READ_WRITE;
+}
+
+// Copy everything from in to out. buf holds COPY_BUF_SIZE bytes, allocated on
+// first use. Returns 0 on success, -1 on failure with errno set
+static int copy_fd(int in, int out, char **buf)
+{
+    struct stat in_st, out_st;
+    if (fstat(in, &in_st) == -1 || fstat(out, &out_st) == -1) {
+        return -1;
+    }
+    enum copy_method method = pick_method(&in_st, &out_st);
+    bool moved = false;
+
+    for (;;) {
+        if (interrupt_pending()) {
+            errno = EINTR;
+            return -1;
+        }
+        ssize_t n;
+        switch (method) {
+        case COPY_RANGE:
+            n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0);
+            break;
+        case COPY_SPLICE:
+            n = splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE);
+            break;
+        case COPY_SENDFILE:
+            n = sendfile(out, in, NULL, COPY_CHUNK);
+            break;
+        default:
+            if (!*buf) {
+                *buf = malloc(COPY_BUF_SIZE);
+                Assert_alloc(*buf);
+            }
+            n = read_fd(in, *buf, COPY_BUF_SIZE);
+            if (n > 0 && write_fd(out, *buf, n) == -1) {
+                return -1;
+            }
+        }
+
+        if (n > 0) {
+            moved = true;
+        } else if (n == 0) {
+            return 0;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (!moved && method != COPY_READ_WRITE && unsupported(errno)) {
+            // Try a more general method. Nothing has been moved so the file
+            // offsets are untouched
+            method = method == COPY_RANGE ? COPY_SENDFILE : COPY_READ_WRITE;
+        } else {
+            return -1;
+        }
+    }
+}
+
+// Whether every option in args (up to "--") is one of the letters in opts.
+// Like the utilities they stand in for, the builtins take options anywhere
+// among the operands
+static bool only_options(char **args, char const *opts)
+{
+    for (; *args && strcmp(*args, "--") != 0; args++) {
+        if (**args == '-' && (*args)[1]
+                && (*args)[1 + strspn(*args + 1, opts)] != '\0') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Whether arg, met before any "--" if *ended is false, is an option or the
+// "--" ending them rather than an operand
+static bool skip_option(char const *arg, bool *ended)
+{
+    if (*ended) {
+        return false;
+    }
+    if (strcmp(arg, "--") == 0) {
+        *ended = true;
+        return true;
+    }
+    return arg[0] == '-' && arg[1];
+}
+
+// Whether m_cat knows all of p's options. Only -u is, the external cat runs
+// for the others
+bool cat_takes(proc const *p)
+{
+    return only_options(p->argv + 1, "u");
+}
+
+int m_cat(proc const *p)
+{
+    // Output is never buffered anyway, so -u changes nothing
+    char **args = p->argv + 1;
+    bool ended = false;
+    size_t operands = 0;
+    for (char **a = args; *a; a++) {
+        operands += !skip_option(*a, &ended);
+    }
+    static char *std_in[] = {"-", NULL};
+    if (!operands) {
+        args = std_in;
+    }
+
+    struct stat out_st;
+    bool check_same = fstat(p->fds[1], &out_st) == 0 && S_ISREG(out_st.st_mode);
+    char *buf = NULL;
+    int ret = 0;
+    ended = false;
+    for (; *args; args++) {
+        if (skip_option(*args, &ended)) {
+            continue;
+        }
+        bool is_stdin = strcmp(*args, "-") == 0;
+        int fd = is_stdin ? p->fds[0] : open(*args, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            Err_msg("cat: %s: %s", *args, strerror(errno));
+            ret = 1;
+            continue;
+        }
+
+        struct stat st;
+        if (check_same && fstat(fd, &st) == 0 && st.st_dev == out_st.st_dev
+                && st.st_ino == out_st.st_ino) {
+            Err_msg("cat: %s: input file is output file", *args);
+            ret = 1;
+        } else if (copy_fd(fd, p->fds[1], &buf) == -1) {
+            Err_msg("cat: %s: %s", *args, strerror(errno));
+            ret = 1;
+        }
+        if (!is_stdin) {
+            close(fd);
+        }
+        if (interrupt_pending()) {
+            break;
+        }
+    }
+    Free(buf);
+    return ret;
+}
+
+// How tee gets data to an output
+enum tee_mode {
+    TEE_PIPE, // tee(2) straight into it
+    TEE_SPLICE, // tee(2) into the scratch pipe, then splice from there
+    TEE_COPY, // write from a buffer
+};
+
+typedef struct tee_out {
+    char const *name;
+    int fd;
+    enum tee_mode mode;
+    bool failed;
+} tee_out;
+
+static void tee_fail(tee_out *o)
+{
+    Err_msg("tee: %s: %s", o->name, strerror(errno));
+    o->failed = true;
+}
+
+// Copy in to every output with read and write
+// Returns 0 at end of input, -1 if reading failed
+static int tee_read_write(int in, tee_out *outs, size_t n_outs, char *buf)
+{
+    ssize_t n;
+    while ((n = read_fd(in, buf, COPY_BUF_SIZE)) > 0) {
+        for (size_t i = 0; i < n_outs; i++) {
+            if (!outs[i].failed && write_fd(outs[i].fd, buf, n) == -1) {
+                tee_fail(outs + i);
+            }
+        }
+    }
+    return n;
+}
+
+// Move up to n bytes from pipe in to out with splice
+// Returns the number of bytes moved, less than n on failure (with errno set)
+static size_t splice_all(int in, int out, size_t n)
+{
+    size_t moved = 0;
+    while (moved < n) {
+        ssize_t m = splice(in, NULL, out, NULL, n - moved, SPLICE_F_MOVE);
+        if (m < 0 && errno == EINTR) {
+            continue;
+        }
+        if (m <= 0) {
+            break;
+        }
+        moved += m;
+    }
+    return moved;
+}
+
+// Read and drop n bytes from in
+static int drain(int in, size_t n, char *buf)
+{
+    while (n) {
+        ssize_t m = read_fd(in, buf, n < COPY_BUF_SIZE ? n : COPY_BUF_SIZE);
+        if (m <= 0) {
+            return -1;
+        }
+        n -= m;
+    }
+    return 0;
+}
+
+// Copy the pipe in to every output without copying through user space. Each
+// round tee(2)s the data waiting in the pipe to every output that allows it
+// and then drops it from in by splicing it to /dev/null. Outputs that could
+// only take part of a round (or none, like O_APPEND files) are filled in by
+// reading the round and writing it.
+// Returns 0 at end of input, -1 on failure and 1 if the rest should be copied
+// by tee_read_write
+static int tee_splice(int in, tee_out *outs, size_t n_outs, char *buf)
+{
+    int scratch[2] = {-1, -1};
+    int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (null == -1 || pipe2(scratch, O_CLOEXEC) == -1) {
+        if (null != -1) {
+            close(null);
+        }
+        return 1;
+    }
+    size_t *done = malloc(n_outs * sizeof *done);
+    Assert_alloc(done);
+
+    bool moved = false;
+    int ret = 0;
+    for (;;) {
+        if (interrupt_pending()) {
+            errno = EINTR;
+            ret = -1;
+            goto done;
+        }
+        ssize_t len = -1;
+        bool live = false;
+        for (size_t i = 0; i < n_outs; i++) {
+            done[i] = 0;
+            live |= !outs[i].failed;
+            if (outs[i].failed || outs[i].mode == TEE_COPY) {
+                continue;
+            }
+
+            int target = outs[i].mode == TEE_PIPE ? outs[i].fd : scratch[1];
+            size_t want = len < 0 ? TEE_CHUNK : (size_t) len;
+            ssize_t n;
+            while ((n = tee(in, target, want, 0)) < 0 && errno == EINTR
+                   && !interrupt_pending());
+            if (n < 0 && errno == EINTR) {
+                ret = -1;
+                goto done;
+            } else if (n < 0 && len < 0 && !moved && unsupported(errno)) {
+                ret = 1;
+                goto done;
+            } else if (n < 0) {
+                tee_fail(outs + i);
+                continue;
+            }
+            if (len < 0) {
+                if (n == 0) {
+                    goto done; // End of input
+                }
+                len = n;
+            }
+
+            done[i] = n;
+            if (outs[i].mode == TEE_SPLICE) {
+                done[i] = splice_all(scratch[0], outs[i].fd, n);
+                if (done[i] < (size_t) n) {
+                    int err = errno;
+                    drain(scratch[0], n - done[i], buf);
+                    // Files that cannot be spliced to get written instead
+                    errno = err;
+                    if (unsupported(err)) {
+                        outs[i].mode = TEE_COPY;
+                    } else {
+                        tee_fail(outs + i);
+                    }
+                }
+            }
+        }
+        if (len < 0) {
+            // No output is left to tee(2) to. Copy to the rest, if any
+            ret = live ? 1 : 0;
+            goto done;
+        }
+        moved = true;
+
+        bool complete = true;
+        for (size_t i = 0; i < n_outs; i++) {
+            complete &= outs[i].failed || done[i] == (size_t) len;
+        }
+        if (complete) {
+            if (splice_all(in, null, len) < (size_t) len
+                    && drain(in, len, buf) == -1) {
+                ret = -1;
+                goto done;
+            }
+            continue;
+        }
+        // Someone only got part of the round. Read it and fill in the rest
+        size_t got = 0;
+        while (got < (size_t) len) {
+            ssize_t m = read_fd(in, buf + got, len - got);
+            if (m <= 0) {
+                ret = -1;
+                goto done;
+            }
+            got += m;
+        }
+        for (size_t i = 0; i < n_outs; i++) {
+            if (!outs[i].failed && done[i] < (size_t) len
+                    && write_fd(outs[i].fd, buf + done[i], len - done[i])) {
+                tee_fail(outs + i);
+            }
+        }
+    }
+
+done:
+    Free(done);
+    close(null);
+    close(scratch[0]);
+    close(scratch[1]);
+    return ret;
+}
+
+// Whether m_tee knows all of p's options. Only -a is, the external tee runs
+// for the others
+bool tee_takes(proc const *p)
+{
+    return only_options(p->argv + 1, "a");
+}
+
+int m_tee(proc const *p)
+{
+    char **args = p->argv + 1;
+    int oflag = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    bool ended = false;
+    for (char **a = args; *a; a++) {
+        if (skip_option(*a, &ended) && !ended) {
+            oflag = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+        }
+    }
+
+    size_t n_args = 0;
+    for (char **a = args; *a; a++, n_args++);
+    tee_out *outs = malloc((n_args + 1) * sizeof *outs);
+    Assert_alloc(outs);
+
+    int ret = 0;
+    size_t n_outs = 0;
+    outs[n_outs++] = (tee_out) {.name = "standard output", .fd = p->fds[1]};
+    ended = false;
+    for (; *args; args++) {
+        if (skip_option(*args, &ended)) {
+            continue;
+        }
+        int fd = open(*args, oflag, FILE_MASK);
+        if (fd == -1) {
+            Err_msg("tee: %s: %s", *args, strerror(errno));
+            ret = 1;
+        } else {
+            outs[n_outs++] = (tee_out) {.name = *args, .fd = fd};
+        }
+    }
+    for (size_t i = 0; i < n_outs; i++) {
+        // splice cannot write to files opened for appending
+        struct stat st;
+        int fl = fcntl(outs[i].fd, F_GETFL);
+        bool ok = fstat(outs[i].fd, &st) == 0 && fl != -1;
+        outs[i].mode = !ok ? TEE_COPY
+                       : S_ISFIFO(st.st_mode) ? TEE_PIPE
+                       : S_ISREG(st.st_mode) && !(fl & O_APPEND) ? TEE_SPLICE
+                       : TEE_COPY;
+    }
+
+    // Both tee(2) and the copy fallback need the buffer
+    char *buf = malloc(COPY_BUF_SIZE);
+    Assert_alloc(buf);
+    struct stat in_st;
+    int status = 1;
+    if (fstat(p->fds[0], &in_st) == 0 && S_ISFIFO(in_st.st_mode)) {
+        status = tee_splice(p->fds[0], outs, n_outs, buf);
+    }
+    if (status == 1) {
+        status = tee_read_write(p->fds[0], outs, n_outs, buf);
+    }
+    Stopif(status == -1, ret = 1, "tee: %s", strerror(errno));
+
+    for (size_t i = 0; i < n_outs; i++) {
+        ret |= outs[i].failed;
+        if (i) {
+            close(outs[i].fd);
+        }
+    }
+    Free(buf);
+    Free(outs);
+    return ret;
+}
@@ -0,0 +1,41 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MARCEL_BUILTINS_H
+#define MARCEL_BUILTINS_H
+
+#include <stdbool.h>
+
+#include "ds/proc.h" // proc
+
+// Utility builtins that stand in for the external commands of the same name.
+// They read p->fds[0] and write p->fds[1] rather than the shell's own streams
+int m_cat(proc const *p);
+int m_echo(proc const *p);
+int m_false(proc const *p);
+int m_printf(proc const *p);
+int m_pwd(proc const *p);
+int m_read(proc const *p);
+int m_tee(proc const *p);
+int m_test(proc const *p);
+int m_true(proc const *p);
+
+bool cat_takes(proc const *p);
+bool tee_takes(proc const *p);
+
+#endif
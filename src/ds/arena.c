@@ -0,0 +1,106 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h> // uintptr_t
+#include <stdlib.h> // malloc, free
+#include <string.h> // memcpy, strlen
+
+#include "arena.h"
+#include "../macros.h" // Assert_alloc
+
+// Every allocation is aligned as strictly as malloc would align it
+typedef union arena_align {
+    long double ld;
+    long long ll;
+    void *p;
+    void (*fp)(void);
+} arena_align;
+
+#define ALIGN sizeof (arena_align)
+#define Round_up(N) (((N) + ALIGN - 1) & ~(ALIGN - 1))
+// Block headers are padded so the data following them stays aligned
+#define BLOCK_HDR Round_up(sizeof (arena_block))
+#define Block_data(B) ((char *) (B) + BLOCK_HDR)
+
+static arena_block *new_block(size_t size, arena_block *prev)
+{
+    arena_block *b = malloc(BLOCK_HDR + size);
+    Assert_alloc(b);
+    *b = (arena_block) {.prev = prev, .size = size, .used = 0};
+    return b;
+}
+
+// Create an empty arena. The arena header lives in its own first block so
+// a small job costs a single malloc. Panics on allocation failure
+arena *new_arena(void)
+{
+    arena_block *first = new_block(ARENA_INIT_SIZE, NULL);
+    arena *a = (arena *) Block_data(first);
+    first->used = Round_up(sizeof *a);
+    a->head = first;
+    return a;
+}
+
+// Return size bytes of uninitialized memory that lives until the arena is
+// freed. Panics on allocation failure
+__attribute__((malloc))
+void *arena_alloc(size_t size, arena *a)
+{
+    size = Round_up(size);
+    arena_block *b = a->head;
+    if (b->size - b->used < size) {
+        // Blocks double in size so the number of blocks stays logarithmic
+        size_t block_size = b->size * 2;
+        if (block_size < size) {
+            block_size = size;
+        }
+        b = a->head = new_block(block_size, b);
+    }
+    void *ret = Block_data(b) + b->used;
+    b->used += size;
+    return ret;
+}
+
+// Copy at most n bytes of s into the arena, always null terminating the copy
+char *arena_strndup(char const *s, size_t n, arena *a)
+{
+    size_t len = strnlen(s, n);
+    char *ret = arena_alloc(len + 1, a);
+    memcpy(ret, s, len);
+    ret[len] = '\0';
+    return ret;
+}
+
+char *arena_strdup(char const *s, arena *a)
+{
+    return arena_strndup(s, SIZE_MAX, a);
+}
+
+// Release every allocation made from the arena (including the arena itself)
+void free_arena(arena *a)
+{
+    if (!a) {
+        return;
+    }
+    arena_block *b = a->head;
+    while (b) {
+        arena_block *prev = b->prev;
+        free(b);
+        b = prev;
+    }
+}
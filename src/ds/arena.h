@@ -0,0 +1,45 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef M_ARENA_H
+#define M_ARENA_H
+
+// Usable size of the first block of an arena, enough for a typical command
+#define ARENA_INIT_SIZE 1024
+
+#include <stddef.h>
+
+typedef struct arena_block {
+    struct arena_block *prev; // Previously filled block
+    size_t size; // Usable bytes in block
+    size_t used; // Bytes handed out so far
+} arena_block;
+
+// Bump allocator. Memory is handed out from a list of blocks and can only be
+// released all at once with free_arena
+typedef struct arena {
+    arena_block *head; // Block currently being allocated from
+} arena;
+
+arena *new_arena(void);
+void *arena_alloc(size_t size, arena *a);
+char *arena_strdup(char const *s, arena *a);
+char *arena_strndup(char const *s, size_t n, arena *a);
+void free_arena(arena *a);
+
+#endif
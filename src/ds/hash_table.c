@@ -16,37 +16,82 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <stdint.h> // uint64_t
 #include <stdlib.h> // malloc
 #include <string.h> // strcmp
 
 #include "hash_table.h" // hash_table, node
 #include "../macros.h" // Free
 
-#ifndef SIZE_MAX
-#define SIZE_MAX ((size_t) -1)
-#endif
+// Grow past 7/10 full, shrink below 1/8 full
+#define Too_full(LEN, CAP) ((LEN) * 10 > (CAP) * 7)
+#define Too_empty(LEN, CAP) ((LEN) * 8 < (CAP) && (CAP) > TABLE_INIT_SIZE)
 
-static unsigned long get_index(char const *key, size_t size);
+static size_t hash_key(char const *key);
 
+static node *new_slots(size_t cap)
+{
+    node *slots = calloc(cap, sizeof *slots);
+    Assert_alloc(slots);
+    return slots;
+}
+
+// Create a table with room for at least nmemb entries. Panics on allocation
+// failure
 hash_table new_table(size_t nmemb)
 {
-    return vec_alloc(nmemb * sizeof (node *));
+    size_t cap = TABLE_INIT_SIZE;
+    while (Too_full(nmemb, cap)) {
+        cap *= 2;
+    }
+    hash_table t = malloc(sizeof *t);
+    Assert_alloc(t);
+    *t = (struct table) {.slots = new_slots(cap), .cap = cap, .len = 0};
+    return t;
 }
 
-void delete_node(char const *k, hash_table t)
+size_t table_len(hash_table t)
 {
-    node *crawler = t[get_index(k, vec_capacity(t) / sizeof *t)];
-    node *prev = NULL;
-    while (crawler) {
-        if (strcmp(k, crawler->key) == 0) {
-            if (prev) {
-                prev->next = crawler->next;
-            }
-            Free(crawler);
-            return;
+    return t ? t->len : 0;
+}
+
+// Place n in the first free slot of its probe sequence
+static void insert(node n, hash_table t)
+{
+    size_t mask = t->cap - 1;
+    size_t i = n.hash & mask;
+    while (t->slots[i].key) {
+        i = (i + 1) & mask;
+    }
+    t->slots[i] = n;
+    t->len++;
+}
+
+// Move every node into a new array of cap slots
+static void resize(size_t cap, hash_table t)
+{
+    node *old = t->slots;
+    size_t old_cap = t->cap;
+    t->slots = new_slots(cap);
+    t->cap = cap;
+    t->len = 0;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].key) {
+            insert(old[i], t);
         }
-        prev = crawler;
-        crawler = crawler->next;
+    }
+    free(old);
+}
+
+// Shrink the table while it is mostly empty
+static void maybe_shrink(hash_table t)
+{
+    size_t cap = t->cap;
+    while (Too_empty(t->len, cap)) {
+        cap /= 2;
+    }
+    if (cap != t->cap) {
+        resize(cap, t);
     }
 }
 
@@ -55,68 +100,160 @@ int add_node(char const *k, void *v, hash_table t)
     if (!t) {
         return -1;
     }
-
-    node *new = malloc(sizeof (node));
-    Assert_alloc(new);
-
-    new->key = k;
-    new->value = v;
-    unsigned long i = get_index(k, vec_capacity(t) / sizeof *t);
-    new->next = t[i];
-
-    t[i] = new;
+    if (Too_full(t->len + 1, t->cap)) {
+        resize(t->cap * 2, t);
+    }
+    insert((node) {.key = k, .value = v, .hash = hash_key(k)}, t);
     return 0;
 }
 
+// Return the slot of the first node with key k whose value passes filter (if
+// given), or NULL if there is none
+static node *find_slot(char const *k, bool (*filter)(void *), hash_table t)
+{
+    size_t mask = t->cap - 1;
+    size_t hash = hash_key(k);
+    for (size_t i = hash & mask; t->slots[i].key; i = (i + 1) & mask) {
+        node *n = &t->slots[i];
+        if (n->hash == hash && strcmp(n->key, k) == 0
+                && (!filter || filter(n->value))) {
+            return n;
+        }
+    }
+    return NULL;
+}
+
 void *find_node(char const *k, bool (*filter)(void *), hash_table t)
 {
     if (!t) {
         return NULL;
     }
-    node *crawler = t[get_index(k, vec_capacity(t) / sizeof *t)];
-    while (crawler) {
-        if (strcmp(crawler->key, k) == 0) {
-            bool end = filter ? filter(crawler->value) : 1;
-            if (end) {
-                return crawler->value;
-            } else {
-                continue;
+    node *n = find_slot(k, filter, t);
+    return n ? n->value : NULL;
+}
+
+// Empty the slot at index hole. Nodes later in the same probe run are shifted
+// back into it, so no tombstones are needed
+static void remove_slot(size_t hole, hash_table t)
+{
+    size_t mask = t->cap - 1;
+    for (size_t i = (hole + 1) & mask; t->slots[i].key; i = (i + 1) & mask) {
+        size_t home = t->slots[i].hash & mask;
+        // Node can fill the hole unless its home lies cyclically in (hole, i]
+        bool stays = (hole < i) ? (hole < home && home <= i)
+                                : (hole < home || home <= i);
+        if (!stays) {
+            t->slots[hole] = t->slots[i];
+            hole = i;
+        }
+    }
+    t->slots[hole] = (node) {0};
+    t->len--;
+}
+
+// Remove the first node with key k whose value passes filter (if given),
+// calling destructor (if given) on it first
+void delete_node(char const *k, bool (*filter)(void *),
+                 void (*destructor)(node *), hash_table t)
+{
+    if (!t) {
+        return;
+    }
+    node *n = find_slot(k, filter, t);
+    if (!n) {
+        return;
+    }
+    if (destructor) {
+        destructor(n);
+    }
+    remove_slot(n - t->slots, t);
+    maybe_shrink(t);
+}
+
+// Remove every node whose value passes filter. The survivors are rehashed
+// into a fresh array, so removal never disturbs the scan
+void delete_nodes(bool (*filter)(void *), void (*destructor)(node *),
+                  hash_table t)
+{
+    if (!t) {
+        return;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < t->cap; i++) {
+        node *n = &t->slots[i];
+        if (!n->key) {
+            continue;
+        }
+        if (filter(n->value)) {
+            if (destructor) {
+                destructor(n);
             }
+            *n = (node) {0};
+        } else {
+            kept++;
+        }
+    }
+    if (kept == t->len) {
+        return;
+    }
+    size_t cap = t->cap;
+    while (Too_empty(kept, cap)) {
+        cap /= 2;
+    }
+    resize(cap, t);
+}
+
+// Iterate over the table. *pos must start at 0; each call returns the next
+// node whose value passes filter (if given) or NULL once there are no more.
+// The table must not be modified while iterating
+node *next_node(size_t *pos, bool (*filter)(void *), hash_table t)
+{
+    if (!t) {
+        return NULL;
+    }
+    while (*pos < t->cap) {
+        node *n = &t->slots[(*pos)++];
+        if (n->key && (!filter || filter(n->value))) {
+            return n;
         }
-        crawler = crawler->next;
     }
     return NULL;
 }
 
+// Call f on every node whose value passes filter (if given)
+void foreach_node(bool (*filter)(void *), void (*f)(node *, void *),
+                  void *data, hash_table t)
+{
+    size_t pos = 0;
+    for (node *n; (n = next_node(&pos, filter, t));) {
+        f(n, data);
+    }
+}
+
 void free_table(hash_table t, void (*destructor)(node *))
 {
     if (!t) {
         return;
     }
-    size_t table_cap = vec_capacity(t) / sizeof *t;
-    // Free contents
-    for (size_t i = 0; i < table_cap; i++) {
-        node *crawler = t[i];
-        while (crawler) {
-            if (destructor) {
-                destructor(crawler);
+    if (destructor) {
+        for (size_t i = 0; i < t->cap; i++) {
+            if (t->slots[i].key) {
+                destructor(&t->slots[i]);
             }
-            node *next = crawler->next;
-            Free(crawler);
-            crawler = next;
         }
     }
-    vec_free(t);
+    Free(t->slots);
+    Free(t);
 }
 
 
-// Modified djb2
-// Requires key to be a valid string ending in '\0'
-static unsigned long get_index(char const *key, size_t size)
+// 64 bit FNV-1a. Requires key to be a valid string ending in '\0'
+static size_t hash_key(char const *key)
 {
-    unsigned long hash = 5381;
-    while (*key++) {
-        hash = ((hash << 5) + hash) + *key;
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char const *c = (unsigned char const *) key; *c; c++) {
+        hash ^= *c;
+        hash *= 1099511628211ULL;
     }
-    return hash & (size - 1);
+    return hash;
 }
@@ -19,24 +19,39 @@
 #ifndef MARCEL_HASH_H
 #define MARCEL_HASH_H
 
-#define TABLE_INIT_SIZE 1024
+// Smallest number of slots a table has. Must be a power of 2
+#define TABLE_INIT_SIZE 16
 
 #include <stdbool.h>
-#include "vec.h"
+#include <stddef.h>
 
 
 typedef struct node {
+    char const* key; // Name of function (or alias), NULL for an empty slot
     void *value; // Pointer to builtin function (or alias)
-    char const* key; // Name of function (or alias)
-    struct node *next; // Pointer to next node (in case of conflicts)
+    size_t hash; // Cached hash of key
 } node;
 
-typedef node** hash_table;
+// Open addressing (linear probing) table. Nodes are stored inline and the
+// table grows and shrinks with its load factor. Keys may appear more than once
+// (e.g. with values of different types told apart by a filter)
+typedef struct table {
+    node *slots;
+    size_t cap; // Number of slots, always a power of 2
+    size_t len; // Number of occupied slots
+} *hash_table;
 
 hash_table new_table(size_t size);
+size_t table_len(hash_table t);
 int add_node(char const *k, void *v, hash_table t);
 void *find_node(char const *k, bool (*filter)(void *), hash_table t);
-void delete_node(char const *k, hash_table t);
+void delete_node(char const *k, bool (*filter)(void *),
+                 void (*destructor)(node *), hash_table t);
+void delete_nodes(bool (*filter)(void *), void (*destructor)(node *),
+                  hash_table t);
+node *next_node(size_t *pos, bool (*filter)(void *), hash_table t);
+void foreach_node(bool (*filter)(void *), void (*f)(node *, void *),
+                  void *data, hash_table t);
 void free_table(hash_table t, void (*destructor)(node*));
 
 #endif
@@ -0,0 +1,107 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h> // calloc, free
+
+#include "pid_table.h"
+#include "../macros.h" // Assert_alloc, Free
+
+// Home slot of pid. Pids are mostly sequential, multiplying by an odd
+// constant spreads them over the table
+static inline size_t pid_slot(pid_t pid, size_t cap)
+{
+    return ((size_t) pid * 2654435761u) & (cap - 1);
+}
+
+// Allocate an empty table of size slots (a power of 2). Panics on allocation
+// failure
+pid_table new_pid_table(size_t size)
+{
+    pid_entry *slots = calloc(size, sizeof *slots);
+    Assert_alloc(slots);
+    return (pid_table) {.slots = slots, .cap = size, .len = 0};
+}
+
+static void insert(pid_entry e, pid_table *t)
+{
+    size_t mask = t->cap - 1;
+    size_t i = pid_slot(e.pid, t->cap);
+    while (t->slots[i].pid) {
+        i = (i + 1) & mask;
+    }
+    t->slots[i] = e;
+    t->len++;
+}
+
+// Add pid to the table, doubling it once it is half full
+void pid_table_add(pid_t pid, job *j, proc *p, pid_table *t)
+{
+    if ((t->len + 1) * 2 > t->cap) {
+        pid_table bigger = new_pid_table(t->cap * 2);
+        for (size_t i = 0; i < t->cap; i++) {
+            if (t->slots[i].pid) {
+                insert(t->slots[i], &bigger);
+            }
+        }
+        free(t->slots);
+        *t = bigger;
+    }
+    insert((pid_entry) {.pid = pid, .job = j, .proc = p}, t);
+}
+
+// Return the entry for pid or NULL if it isn't in the table
+pid_entry *pid_table_find(pid_t pid, pid_table const *t)
+{
+    size_t mask = t->cap - 1;
+    for (size_t i = pid_slot(pid, t->cap); t->slots[i].pid; i = (i + 1) & mask) {
+        if (t->slots[i].pid == pid) {
+            return &t->slots[i];
+        }
+    }
+    return NULL;
+}
+
+// Remove pid from the table. Entries after it in the same probe run are
+// shifted back, so no tombstones are needed
+void pid_table_delete(pid_t pid, pid_table *t)
+{
+    pid_entry *e = pid_table_find(pid, t);
+    if (!e) {
+        return;
+    }
+    size_t mask = t->cap - 1;
+    size_t hole = e - t->slots;
+    for (size_t i = (hole + 1) & mask; t->slots[i].pid; i = (i + 1) & mask) {
+        size_t home = pid_slot(t->slots[i].pid, t->cap);
+        // Entry can fill the hole unless its home lies cyclically in (hole, i]
+        bool stays = (hole < i) ? (hole < home && home <= i)
+                                : (hole < home || home <= i);
+        if (!stays) {
+            t->slots[hole] = t->slots[i];
+            hole = i;
+        }
+    }
+    t->slots[hole] = (pid_entry) {0};
+    t->len--;
+}
+
+void free_pid_table(pid_table *t)
+{
+    Free(t->slots);
+    t->cap = t->len = 0;
+}
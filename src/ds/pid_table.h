@@ -0,0 +1,47 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef M_PID_TABLE_H
+#define M_PID_TABLE_H
+
+// Must be a power of 2
+#define PID_TABLE_INIT_SIZE 64
+
+#include <sys/types.h>
+#include "proc.h"
+
+typedef struct pid_entry {
+    pid_t pid; // Pid of proc, 0 marks an empty slot
+    job *job; // Job proc belongs to
+    proc *proc;
+} pid_entry;
+
+// Open addressing (linear probing) table mapping pids to their procs
+typedef struct pid_table {
+    pid_entry *slots;
+    size_t cap; // Number of slots, always a power of 2
+    size_t len; // Number of occupied slots
+} pid_table;
+
+pid_table new_pid_table(size_t size);
+void pid_table_add(pid_t pid, job *j, proc *p, pid_table *t);
+pid_entry *pid_table_find(pid_t pid, pid_table const *t);
+void pid_table_delete(pid_t pid, pid_table *t);
+void free_pid_table(pid_table *t);
+
+#endif
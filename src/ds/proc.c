@@ -18,17 +18,19 @@
 
 #include <stdlib.h>
 
+#include "arena.h" // arena_alloc, arena_strdup, arena_strndup
 #include "proc.h"
 #include "../macros.h"
-// Should be more than enough
-#define INITIAL_PROC_CAP 32
+// Most jobs are a single command, pipelines grow the vector as needed
+#define INITIAL_PROC_CAP 4
 
-proc *new_proc(void)
+// Allocate new proc in arena a. Panics on allocation failure
+proc *new_proc(arena *a)
 {
-    proc *ret = calloc(1, sizeof *ret);
-    Assert_alloc(ret);
-    ret->argv = vec_alloc(ARGV_INIT_SIZE * sizeof *ret->argv);
-    ret->env =  vec_alloc(ARGV_INIT_SIZE * sizeof *ret->env);
+    proc *ret = arena_alloc(sizeof *ret, a);
+    *ret = (proc) {.pidfd = -1};
+    ret->argv = vec_arena_alloc(ARGV_INIT_SIZE * sizeof *ret->argv, a);
+    ret->env =  vec_arena_alloc(ARGV_INIT_SIZE * sizeof *ret->env, a);
 
     for (size_t i = 0; i < Arr_len(ret->fds); i++) {
         ret->fds[i] = i;
@@ -36,46 +38,151 @@ proc *new_proc(void)
     return ret;
 }
 
-// Frees proc and dynamically allocated members.
-// TODO: Make less ugly.
-void free_proc(proc *p)
+// Allocate new job in arena a with all fields initialized to 0
+static job *alloc_job(arena *a)
 {
-    char ***a[] = {&p->argv, &p->env};
-    for (size_t i = 0 ; i < Arr_len(a); i++) {
-        size_t len = vec_len(*a[i]);
-        for (size_t j = 0; j < len; j++) {
-            Free((*a[i])[j]);
-        }
-        vec_free(*a[i]);
-    }
-    Free(p);
+    job *ret = arena_alloc(sizeof *ret, a);
+    *ret = (job) {0};
+    ret->mem = a;
+    ret->procs = vec_arena_alloc(INITIAL_PROC_CAP * sizeof *ret->procs, a);
+    return ret;
 }
 
-// Allocate new job with all fields initialized to 0. Panics on allocation
-// failure
+// Allocate new job, in an arena of its own, with all fields initialized to 0.
+// Panics on allocation failure
 job *new_job(void)
 {
-    job *ret = calloc(1, sizeof *ret);
-    Assert_alloc(ret);
-    ret->procs = vec_alloc(INITIAL_PROC_CAP * sizeof *ret->procs);
-    return ret;
+    return alloc_job(new_arena());
+}
+
+// Allocate new job for a compound command of outer, in the arena of outer.
+// It is freed along with outer, never on its own
+job *new_inner_job(job const *outer)
+{
+    return alloc_job(outer->mem);
+}
+
+// Name j after the text from start to end, without the blanks around it
+void name_job_text(job *j, char const *start, char const *end)
+{
+    while (start != end && (*start == ' ' || *start == '\t')) {
+        start++;
+    }
+    while (end != start && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+    j->name = arena_strndup(start, end - start, j->mem);
 }
 
-// Free all dynamically allocated fields in job and job itself
+// Free job along with everything allocated from its arena
 void free_single_job(job *j)
 {
     if (!j) {
         return;
     }
+    free_arena(j->mem);
+}
+
+// Free j and the jobs after it on its line
+void free_job_list(job *j)
+{
+    while (j) {
+        job *next = j->next;
+        free_single_job(j);
+        j = next;
+    }
+}
+
+// Append copies of the words of vec src (NULL ones included) to vec *dst
+static void copy_words(char **src, char ***dst, arena *a)
+{
+    size_t n = vec_len(src);
+    for (size_t i = 0; i < n; i++) {
+        char *w = src[i] ? arena_strdup(src[i], a) : NULL;
+        vec_append(&w, sizeof w, (vec *) dst);
+    }
+}
+
+static job *copy_into(job const *j, job *ret);
+
+// Copy the jobs of list into jobs allocated from arena a
+static job *copy_inner_list(job const *list, arena *a)
+{
+    job *ret = NULL;
+    job **tail = &ret;
+    for (; list; list = list->next) {
+        *tail = copy_into(list, alloc_job(a));
+        tail = &(*tail)->next;
+    }
+    return ret;
+}
+
+// Copy c, and the jobs it holds, into arena a
+static compound *copy_compound(compound const *c, arena *a)
+{
+    compound *ret = arena_alloc(sizeof *ret, a);
+    *ret = (compound) {.type = c->type};
+    ret->cond = copy_inner_list(c->cond, a);
+    ret->body = copy_inner_list(c->body, a);
+    ret->alt = copy_inner_list(c->alt, a);
+    ret->var = c->var ? arena_strdup(c->var, a) : NULL;
+    ret->words = c->words ? copy_into(c->words, alloc_job(a)) : NULL;
+    if (c->items) {
+        size_t n = vec_len(c->items);
+        ret->items = vec_arena_alloc((n + 1) * sizeof *ret->items, a);
+        for (size_t i = 0; i < n; i++) {
+            case_item *item = arena_alloc(sizeof *item, a);
+            item->patterns = copy_into(c->items[i]->patterns, alloc_job(a));
+            item->body = copy_inner_list(c->items[i]->body, a);
+            vec_append(&item, sizeof item, (vec *) &ret->items);
+        }
+    }
+    return ret;
+}
+
+// Copy the parsed parts of j into ret, allocating from the arena of ret
+static job *copy_into(job const *j, job *ret)
+{
+    arena *a = ret->mem;
+    ret->name = j->name ? arena_strdup(j->name, a) : NULL;
+    ret->bkg = j->bkg;
+    ret->valid = j->valid;
+    ret->timed = j->timed;
+    ret->sep = j->sep;
     for (size_t i = 0; i < Arr_len(j->io); i++) {
-        Free(j->io[i].path);
+        ret->io[i] = j->io[i];
+        if (j->io[i].path) {
+            ret->io[i].path = arena_strdup(j->io[i].path, a);
+        }
+    }
+    size_t n_procs = vec_len(j->procs);
+    for (size_t i = 0; i < n_procs; i++) {
+        proc *p = new_proc(a);
+        copy_words(j->procs[i]->argv, &p->argv, a);
+        copy_words(j->procs[i]->env, &p->env, a);
+        vec_append(&p, sizeof p, (vec *) &ret->procs);
     }
-    Free(j->name);
-    proc **proc_end = j->procs + vec_len(j->procs);
-    for (proc **p_p = j->procs; p_p != proc_end; p_p++) {
-        Cleanup(*p_p, free_proc);
+    if (j->cmd) {
+        ret->cmd = copy_compound(j->cmd, a);
     }
-    vec_free(j->procs);
-    Free(j);
+    return ret;
 }
 
+// Copy the parsed parts of j (which has not been expanded or launched) into a
+// new job of its own. Panics on allocation failure
+job *copy_job(job const *j)
+{
+    return copy_into(j, new_job());
+}
+
+// Copy j and the jobs after it on its line, see copy_job
+job *copy_job_list(job const *j)
+{
+    job *ret = NULL;
+    job **tail = &ret;
+    for (; j; j = j->next) {
+        *tail = copy_job(j);
+        tail = &(*tail)->next;
+    }
+    return ret;
+}
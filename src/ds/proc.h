@@ -19,11 +19,14 @@
 #ifndef M_proc_H
 #define M_proc_H
 
-#define ARGV_INIT_SIZE 1024
+#define ARGV_INIT_SIZE 8
 
 #include <stdbool.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <termios.h>
+#include <time.h>
+#include "arena.h"
 #include "vec.h"
 
 // Struct to model a single command (process)
@@ -31,24 +34,41 @@ typedef struct proc {
     char **argv; // Vec of arguments to be passed to execvp
     char **env; // Vec of environment variables in the form "VAR=VALUE"
     pid_t pid; // Pid of command
+    int pidfd; // Handle on the process until it is reaped, -1 if none
     int fds[3]; // File descriptors for input, output, error
     bool completed; // Command has finished executing
     bool stopped; // Command has been stopped
     int exit_code; // Status code proc exited with
+    struct timespec started; // CLOCK_MONOTONIC time the proc was launched at
+    struct timespec finished; // CLOCK_MONOTONIC time it was seen to complete
+    struct rusage usage; // Resources used, filled in once completed
 } proc;
 
-proc *new_proc(void);
-void free_proc(proc *c);
+proc *new_proc(arena *a);
 
 
 typedef struct proc_io {
     char *path;
     int oflag;
+    int fd; // Open descriptor (owned by the job) used if there is no path
 } proc_io;
 
+// What ends a job on its line, which decides whether the next one runs
+enum {
+    SEP_END, // End of the line
+    SEP_SEQ, // ';' or '&', the next job runs anyway
+    SEP_AND, // '&&', the next job runs if this one succeeds
+    SEP_OR, // '||', the next job runs if this one fails
+};
+
+// A job and everything parsed for it (procs, argv/env vectors, strings) live in
+// the job's arena and are freed together by free_single_job
 typedef struct job {
+    arena *mem; // Arena owning the job
     char *name; // Name of command
     size_t index; // Index in job table
+    size_t live_index; // Index in list of live jobs
+    size_t seq; // Order in which job was registered
     proc **procs; // Vec of procs
     proc_io io[3]; // stdin, stdout and stderr
     pid_t pgid; // Proc group ID for job
@@ -56,11 +76,54 @@ typedef struct job {
         bool notified  : 1; // User has been notified of state change
         bool bkg       : 1; // Job should execute in background
         bool valid     : 1; // Should job be sent to launch_job
+        bool queued    : 1; // Job is waiting for its status to be reported
+        bool timed     : 1; // Report times of procs when job completes
+        bool kept      : 1; // Completed in the background, kept for wait
+        bool waited    : 1; // Collected by wait, free once reported
+        bool waiting   : 1; // Held back by the scheduler until a slot frees
+        bool quiet     : 1; // Started by a builtin that reports on it itself
     };
+    unsigned char slot; // Run slot held, one of the SLOT_* of scheduler.h
+    unsigned char sep; // What ends the job on its line, one of the SEP_*
+    struct job *next; // Next job of the same line, until it is run
+    struct compound *cmd; // Compound command run instead of procs, or NULL
     struct termios tmodes; // Terminal modes for job
 } job;
 
+// Kind of compound command
+enum {
+    CMD_IF,
+    CMD_WHILE,
+    CMD_FOR,
+    CMD_CASE,
+};
+
+// Branch of a case command
+typedef struct case_item {
+    job *patterns; // Single command whose arguments are the patterns
+    job *body; // Jobs run if one of them matches, NULL for none
+} case_item;
+
+// Compound command, run by the shell itself rather than launched. Its jobs
+// are templates, copied each time they run, and live in the arena of the job
+// it belongs to (like the jobs of the compound commands it holds)
+typedef struct compound {
+    unsigned char type; // One of the CMD_*
+    job *cond; // Jobs whose status decides on body (if, while)
+    job *body; // Jobs run if cond succeeds, or for each word (for)
+    job *alt; // Jobs run if cond fails (an elif is an if of its own)
+    char *var; // Variable set to each word (for)
+    job *words; // Single command whose arguments are the words to loop over
+                // (for) or the word to match (case)
+    case_item **items; // Vec of branches (case)
+} compound;
+
 job *new_job(void);
+job *new_inner_job(job const *outer);
+job *copy_job(job const *j);
+job *copy_job_list(job const *j);
+void name_job_text(job *j, char const *start, char const *end);
 void free_single_job(job *j);
+void free_job_list(job *j);
 
 #endif
@@ -25,6 +25,7 @@
 typedef struct vec_meta {
     size_t cap;  // Allocated size in bytes
     size_t len;  // Length of vector
+    arena *mem;  // Arena the vector lives in (NULL if it was malloc'd)
 } vec_meta;
 
 #pragma GCC diagnostic push
@@ -42,13 +43,28 @@ vec vec_alloc(size_t size)
     return memset(ret, 0, size);
 }
 
+// Same as vec_alloc, but the vector (and all later growth) lives in arena `a`
+// and is released along with it. vec_free is a no-op on such vectors
+__attribute__((malloc))
+vec vec_arena_alloc(size_t size, arena *a)
+{
+    vec_meta data = { .cap = size, .len = 0, .mem = a };
+    vec ret = arena_alloc(sizeof data + size, a);
+    memcpy(ret, &data, sizeof data);
+    ret = ((uintptr_t) ret) + sizeof data;
+    return memset(ret, 0, size);
+}
+
 // NOTE: All the below functions REQUIRE that they be passed a vector. Their
 // behavior is undefined otherwise
 
 // Free vector
 void vec_free(vec v)
 {
-    free((uintptr_t) v - sizeof (vec_meta));
+    vec_meta *data = (uintptr_t) v - sizeof *data;
+    if (!data->mem) {
+        free(data);
+    }
 }
 
 // Return the allocated size of the vector in bytes
@@ -101,8 +117,16 @@ int vec_grow(vec *v)
     } else {
         return 1;
     }
-    ret = realloc(ret, sizeof (vec_meta) + bytes);
-    Assert_alloc(ret);
+    arena *mem = ((vec_meta*) ret)->mem;
+    if (mem) {
+        // Arena memory can't be resized, the old copy is left to the arena
+        vec old = ret;
+        ret = arena_alloc(sizeof (vec_meta) + bytes, mem);
+        memcpy(ret, old, sizeof (vec_meta) + ((vec_meta*) old)->cap);
+    } else {
+        ret = realloc(ret, sizeof (vec_meta) + bytes);
+        Assert_alloc(ret);
+    }
 
     size_t *cap = &((vec_meta*) ret)->cap;
     memset(sizeof (vec_meta) + (uintptr_t) ret + *cap , 0, bytes - *cap);
@@ -20,10 +20,12 @@
 #define M_VEC_H
 
 #include <stddef.h>
+#include "arena.h"
 
 typedef void* vec;
 
 vec vec_alloc(size_t size);
+vec vec_arena_alloc(size_t size, arena *a);
 void vec_free(vec v);
 size_t vec_capacity(vec v);
 size_t vec_len(vec v);
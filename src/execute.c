@@ -16,83 +16,138 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+// posix_spawn_file_actions_addtcsetpgrp_np, pipe2
+#define _GNU_SOURCE
+
 #include <errno.h> // errno
 #include <stdio.h> // close
 #include <stdlib.h> // calloc, exit, putenv
 #include <string.h> // strerror
 
-#include <fcntl.h> // open, close
+#include <fcntl.h> // open, close, O_CLOEXEC
+#include <spawn.h> // posix_spawn, posix_spawnattr_*, posix_spawn_file_actions_*
+#include <sys/resource.h> // getrusage, rusage
+#include <sys/stat.h> // stat, S_ISREG
+#include <sys/time.h> // timersub
 #include <sys/types.h> // pid_t
-#include <unistd.h> // close, dup, getpid, setpgid, tcsetpgrp
+#include <time.h> // clock_gettime
+#include <unistd.h> // access, close, confstr, dup, setpgid, tcsetpgrp, environ
 #include <linux/limits.h> // PATH_MAX
 
-#include "signals.h" // reset_signals
+#include "builtin_hash.h" // builtin_hash, builtin_slots, BUILTIN_*_LEN
+#include "builtins.h" // m_echo, m_printf, m_test, cat_takes...
+#include "signals.h" // reset_ignored_signals, sig_default
 #include "ds/proc.h" // proc, job
 #include "ds/hash_table.h" // hash_table, add_node, find_node, free_table
 #include "execute.h" // proc_func
 #include "jobs.h" // interactive, shell_term, wait_for_job, put_job_in_*...
+#include "parallel.h" // m_parallel, m_xargs
 #include "macros.h" // Stopif, Free, Arr_len
+#include "scheduler.h" // detach_scheduler
+#include "variables.h" // get_var, proc_envp, m_export, m_unset...
+
+// Seconds for which a failed PATH search is remembered
+#define NOT_FOUND_TTL 5
 
-// Default mode with which to create files
-#define FILE_MASK 0666
+// glibc >= 2.35 can give the terminal to the child from inside posix_spawn.
+// Without it, interactive foreground jobs have to fork so the child can claim
+// the terminal before it execs
+#if defined(__GLIBC__) \
+    && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+#define HAVE_SPAWN_TCSETPGRP
+#endif
 
 static void cleanup_builtins(void);
-static void exec_proc(proc const *p);
+static char *command_path(proc const *p);
+static pid_t spawn_proc(job const *j, proc const *p, char const *path);
+static void exec_proc(proc const *p, char const *path);
 static int m_cd(proc const *p);
 static int m_exit(proc const *p);
+static int m_hash(proc const *p);
 static int m_help(proc const *p);
 
 // Names of shell builtins
 static char const *builtin_names[] = {
-    "cd",
-    "exit",
-    "help",
+#define BUILTIN(NAME, FUNC) NAME,
+#include "builtins.def"
+#undef BUILTIN
+};
+
+// Lengths of builtin names
+static size_t const builtin_lens[] = {
+#define BUILTIN(NAME, FUNC) sizeof NAME - 1,
+#include "builtins.def"
+#undef BUILTIN
 };
 
 // Functions associated with shell builtins
 static proc_func const builtin_funcs[] = {
-    m_cd,
-    m_exit,
-    m_help,
+#define BUILTIN(NAME, FUNC) FUNC,
+#include "builtins.def"
+#undef BUILTIN
 };
 
-static char oldpwd[PATH_MAX];
+// Whether this process is a child forked to run a builtin in a pipeline
+static bool builtin_child;
 
-// Hash table for shell builtins
+// Value of PATH that the hashed commands were found with
+static char *hashed_path;
+
+// Hash table for names defined at runtime (shell builtins are found through
+// the generated perfect hash instead)
 hash_table lookup_table;
 
-// Create hashtable of shell builtins
+// Create hashtable for runtime names
 // Returns true on success, false on failure
 bool initialize_builtins(void)
 {
-    lookup_table = new_table(TABLE_INIT_SIZE);
-    // NOTE: We are mixing data pointers and function pointers here. ISO C
-    // forbids this but it's fine in POSIX
-    for (size_t i = 0; i < Arr_len(builtin_names); i++) {
-        builtin *b = malloc(sizeof *b);
-        Assert_alloc(b);
-        b->type=CMD;
-        b->cmd = builtin_funcs[i];
-        if (add_node(builtin_names[i], b, lookup_table) != 0) {
-            return 0;
-        }
-    }
-
+    lookup_table = new_table(0);
     if (atexit(cleanup_builtins)) {
         return false;
     }
     return true;
 }
 
+// Return the shell builtin to run p, NULL if there is none. cat and tee leave
+// the options they don't know to the external utilities
+static proc_func find_builtin(proc const *p)
+{
+    char const *name = p->argv[0];
+    size_t len = strlen(name);
+    if (len < BUILTIN_MIN_LEN || len > BUILTIN_MAX_LEN) {
+        return NULL;
+    }
+    int i = builtin_slots[builtin_hash(name, len)];
+    if (i < 0 || builtin_lens[i] != len
+            || memcmp(builtin_names[i], name, len) != 0) {
+        return NULL;
+    }
+    proc_func f = builtin_funcs[i];
+    if ((f == m_cat && !cat_takes(p)) || (f == m_tee && !tee_takes(p))) {
+        return NULL;
+    }
+    return f;
+}
+
 static inline void builtin_destructor(node *n)
 {
-    free(n->value);
+    builtin *b = n->value;
+    if (b->type == HASHED) {
+        // Hashed commands and variables own their key
+        free((char *) n->key);
+        free(b->path);
+    } else if (b->type == VAR) {
+        free((char *) n->key);
+        free(b->var);
+    }
+    free(b);
 }
 
 // Wrapper around free_table so it can be passed to atexit
 static void cleanup_builtins(void)
 {
     free_table(lookup_table, builtin_destructor);
+    Free(hashed_path);
 }
 
 static void fd_cleanup(int *fd_arr, size_t n)
@@ -104,6 +159,16 @@ static void fd_cleanup(int *fd_arr, size_t n)
     }
 }
 
+// Close the descriptors j owns for its streams from first on, which go unused
+static void close_job_fds(job const *j, size_t first)
+{
+    for (size_t i = first; i < Arr_len(j->io); i++) {
+        if (!j->io[i].path && j->io[i].fd) {
+            close(j->io[i].fd);
+        }
+    }
+}
+
 // Set process group for process and give pgid to term
 // Needs to be done in both parent and child to
 // avoid race condition. Macro prevents code duplication and preserves
@@ -118,22 +183,248 @@ static void fd_cleanup(int *fd_arr, size_t n)
         }                                       \
     } while (0)
 
-static inline bool filter_command(void *val)
+static inline bool filter_hashed(void *val)
 {
     builtin *b = val;
-    return b->type == CMD;
+    return b->type == HASHED;
+}
+
+static time_t monotonic_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+// Search the directories in path for an executable named name. Returns a
+// newly allocated path to it or NULL if there is none
+static char *search_path(char const *name, char const *path)
+{
+    char default_path[PATH_MAX];
+    if (!path) {
+        // Same default as execvp
+        confstr(_CS_PATH, default_path, sizeof default_path);
+        path = default_path;
+    }
+
+    size_t name_len = strlen(name);
+    char buf[PATH_MAX];
+    while (true) {
+        char const *end = strchrnul(path, ':');
+        size_t dir_len = end - path;
+        // An empty entry means the current directory
+        if (!dir_len) {
+            path = ".";
+            dir_len = 1;
+        }
+        if (dir_len + name_len + 2 <= sizeof buf) {
+            memcpy(buf, path, dir_len);
+            buf[dir_len] = '/';
+            memcpy(buf + dir_len + 1, name, name_len + 1);
+            struct stat st;
+            if (access(buf, X_OK) == 0 && stat(buf, &st) == 0
+                    && S_ISREG(st.st_mode)) {
+                char *ret = strdup(buf);
+                Assert_alloc(ret);
+                return ret;
+            }
+        }
+        if (!*end) {
+            return NULL;
+        }
+        path = end + 1;
+    }
+}
+
+// Forget every hashed command
+static void clear_hash(void)
+{
+    delete_nodes(filter_hashed, builtin_destructor, lookup_table);
+}
+
+// Hashed commands are only valid for the PATH they were found with
+static void check_hashed_path(void)
+{
+    char const *path = get_var("PATH");
+    if (hashed_path && path && strcmp(hashed_path, path) == 0) {
+        return;
+    }
+    if (!hashed_path && !path) {
+        return;
+    }
+    clear_hash();
+    Free(hashed_path);
+    if (path) {
+        hashed_path = strdup(path);
+        Assert_alloc(hashed_path);
+    }
+}
+
+// Look up name in PATH, going through the hash table. Returns the cached path
+// (owned by the table) or NULL if name is not in PATH
+static char const *hash_command(char const *name)
+{
+    check_hashed_path();
+    builtin *b = find_node(name, filter_hashed, lookup_table);
+    if (b && (b->path || monotonic_seconds() < b->expires)) {
+        return b->path;
+    }
+
+    char *path = search_path(name, hashed_path);
+    if (!b) {
+        b = malloc(sizeof *b);
+        Assert_alloc(b);
+        b->type = HASHED;
+        char *key = strdup(name);
+        Assert_alloc(key);
+        add_node(key, b, lookup_table);
+    }
+    b->path = path;
+    b->expires = path ? 0 : monotonic_seconds() + NOT_FOUND_TTL;
+    return path;
+}
+
+// Drop name from the hash table, e.g. because its path stopped working
+static void unhash_command(char const *name)
+{
+    delete_node(name, filter_hashed, builtin_destructor, lookup_table);
+}
+
+// Return the newly allocated path of the executable p runs (or NULL if it
+// can't be found). Names containing a slash are used as is, and a PATH
+// assigned for just this command bypasses the hash table
+static char *command_path(proc const *p)
+{
+    char *name = *p->argv;
+    if (strchr(name, '/')) {
+        char *ret = strdup(name);
+        Assert_alloc(ret);
+        return ret;
+    }
+
+    char **env_end = p->env + vec_len(p->env);
+    for (char **e_p = p->env; e_p != env_end; e_p++) {
+        if (strncmp(*e_p, "PATH=", sizeof "PATH=" - 1) == 0) {
+            return search_path(name, *e_p + sizeof "PATH=" - 1);
+        }
+    }
+
+    char const *path = hash_command(name);
+    char *ret = NULL;
+    if (path) {
+        ret = strdup(path);
+        Assert_alloc(ret);
+    }
+    return ret;
+}
+
+// Spawn p, searching PATH again if its hashed path stopped working.
+// Returns the pid of the child or -1 on failure (with errno set)
+static pid_t spawn_command(job const *j, proc const *p)
+{
+    char *path = command_path(p);
+    pid_t pid = spawn_proc(j, p, path);
+    if (pid < 0 && path && (errno == ENOENT || errno == ENOEXEC)) {
+        int err = errno;
+        unhash_command(*p->argv);
+        if (err == ENOENT && !strchr(*p->argv, '/')) {
+            Free(path);
+            path = command_path(p);
+            pid = spawn_proc(j, p, path);
+        } else {
+            errno = err;
+        }
+    }
+    Free(path);
+    return pid;
+}
+
+// Whether the procs of j can be started with posix_spawn rather than fork
+static inline bool can_spawn(job const *j)
+{
+#ifdef HAVE_SPAWN_TCSETPGRP
+    (void) j;
+    return true;
+#else
+    return !interactive || j->bkg;
+#endif
+}
+
+// Run builtin for p in the shell itself, recording the time it took and the
+// resources it used like the reaping of a child would. CPU time of children
+// reaped meanwhile (e.g. the jobs of parallel) counts as the builtin's
+static void run_builtin(proc *p, proc_func builtin)
+{
+    struct rusage before;
+    struct rusage children_before;
+    getrusage(RUSAGE_SELF, &before);
+    getrusage(RUSAGE_CHILDREN, &children_before);
+    p->exit_code = builtin(p);
+    p->completed = true;
+    clock_gettime(CLOCK_MONOTONIC, &p->finished);
+
+    // Peak RSS is the shell's, everything else is what the builtin added
+    struct rusage *u = &p->usage;
+    struct rusage children;
+    getrusage(RUSAGE_SELF, u);
+    getrusage(RUSAGE_CHILDREN, &children);
+    timersub(&u->ru_utime, &before.ru_utime, &u->ru_utime);
+    timersub(&u->ru_stime, &before.ru_stime, &u->ru_stime);
+    timersub(&children.ru_utime, &children_before.ru_utime, &children.ru_utime);
+    timersub(&children.ru_stime, &children_before.ru_stime, &children.ru_stime);
+    timeradd(&u->ru_utime, &children.ru_utime, &u->ru_utime);
+    timeradd(&u->ru_stime, &children.ru_stime, &u->ru_stime);
+    u->ru_nvcsw -= before.ru_nvcsw;
+    u->ru_nivcsw -= before.ru_nivcsw;
+    u->ru_inblock -= before.ru_inblock;
+    u->ru_oublock -= before.ru_oublock;
+}
+
+// Run builtin for p in a child so that it runs concurrently with the rest of
+// the job (or with the shell, for background jobs). next_in is the read end
+// of p's pipe (-1 if there is none), which the child must not hold open or it
+// would never see the reader go away.
+// Returns the pid of the child or -1 on failure
+static pid_t fork_builtin(job *j, proc const *p, proc_func builtin, int next_in)
+{
+    pid_t pid = fork();
+    if (pid == 0) { // Child
+        Set_proc_group(j, pid, j->pgid);
+        reset_ignored_signals();
+        sig_default(SIGINT);
+        if (next_in != -1) {
+            close(next_in);
+        }
+        detach_job_table();
+        detach_scheduler();
+        builtin_child = true;
+        // Skip the shell's atexit handlers
+        _exit(builtin(p));
+    }
+    return pid;
 }
 
 // Takes a job and returns the exit status of its last process
 int launch_job(job *j)
 {
     int io_fd[] = {0, 1, 2};
-    // Open IO fds
+    // Without job control, background jobs must not compete with the shell
+    // (which may be reading its script from stdin) for input. Jobs the shell
+    // starts for itself (quiet ones) set up their own
+    if (!interactive && j->bkg && !j->quiet && !j->io[STDIN_FILENO].path) {
+        j->io[STDIN_FILENO] = (proc_io) {.path = "/dev/null",
+                                         .oflag = O_RDONLY};
+    }
+    // Open IO fds. Every fd the shell opens for a job is close-on-exec; each
+    // child only keeps the ones it dup2s onto its standard streams
     for (size_t i = 0; i < Arr_len(j->io); i++) {
         if (j->io[i].path) {
-            io_fd[i] = open(j->io[i].path, j->io[i].oflag, FILE_MASK);
+            io_fd[i] = open(j->io[i].path, j->io[i].oflag | O_CLOEXEC,
+                            FILE_MASK);
+        } else if (j->io[i].fd) {
+            io_fd[i] = j->io[i].fd;
         }
-        Stopif(io_fd[i] == -1, fd_cleanup(io_fd, i);
+        Stopif(io_fd[i] == -1, fd_cleanup(io_fd, i); close_job_fds(j, i + 1);
                return M_FAILED_IO, "%s", strerror(errno));
     }
     proc **proc_end = j->procs + vec_len(j->procs);
@@ -150,38 +441,71 @@ int launch_job(job *j)
         if (p_p != proc_end - 1) {
             proc *p_next = *(p_p+1);
             int fd[2];
-            pipe(fd);
+            Stopif(pipe2(fd, O_CLOEXEC) == -1, return M_FAILED_IO,
+                   "Could not create pipe: %s", strerror(errno));
             p->fds[1] = fd[1];
             p_next->fds[0] = fd[0];
         }
 
-        builtin *b = find_node(p->argv[0],filter_command, lookup_table);
-
-        if (b) { // Builtin found
-            p->exit_code = b->cmd(p);
-            p->completed = 1;
+        proc_func builtin = find_builtin(p);
+        clock_gettime(CLOCK_MONOTONIC, &p->started);
+
+        if (builtin && p_p == proc_end - 1 && !j->bkg) {
+            // Only the last builtin of a foreground job runs in the shell
+            // itself, so that e.g. cd affects it
+            run_builtin(p, builtin);
+        } else if (builtin) {
+            int next_in = p_p == proc_end - 1 ? -1 : (*(p_p+1))->fds[0];
+            pid_t pid = fork_builtin(j, p, builtin, next_in);
+            Stopif(pid < 0, return M_FAILED_EXEC,
+                   "Could not fork process: %s", strerror(errno));
+            Set_proc_group(j, pid, j->pgid);
+            p->pid = pid;
+            register_proc(j, p);
+        } else if (can_spawn(j)) {
+            pid_t pid = spawn_command(j, p);
+            if (pid < 0) {
+                Err_msg("%s: %s", strerror(errno), *p->argv);
+                p->exit_code = M_FAILED_EXEC;
+                p->completed = true;
+                p->finished = p->started;
+            } else {
+                Set_proc_group(j, pid, j->pgid);
+                p->pid = pid;
+                register_proc(j, p);
+            }
         } else {
+            char *path = command_path(p);
             pid_t pid = fork();
-            Stopif(pid < 0, return M_FAILED_EXEC, "Could not fork process: %s",
-                   strerror(errno));
+            Stopif(pid < 0, Free(path); return M_FAILED_EXEC,
+                   "Could not fork process: %s", strerror(errno));
             if (pid == 0) { // Child
                 Set_proc_group(j, pid, j->pgid);
                 reset_ignored_signals();
-                exec_proc(p);
+                exec_proc(p, path);
             } else { // Parent
                 Set_proc_group(j, pid, j->pgid);
                 p->pid = pid;
+                register_proc(j, p);
             }
+            Free(path);
         }
 
         fd_cleanup(p->fds, Arr_len(io_fd));
     }
 
-    if (!interactive) {
-        wait_for_job(j);
-    } else if (j->bkg) {
+    if (j->bkg) {
+        // Jobs started by builtins aren't the user's
+        if (!j->quiet) {
+            last_bkg_pid = proc_end[-1]->pid;
+        }
+        // Reaped through the job table whenever its status is checked
         send_to_background(j, false);
-        format_job_info(j, "launched");
+        if (interactive && !j->quiet) {
+            format_job_info(j, "launched");
+        }
+    } else if (!interactive) {
+        wait_for_job(j);
     } else {
         send_to_foreground(j, false);
     }
@@ -190,43 +514,98 @@ int launch_job(job *j)
 }
 
 
-static void exec_proc(proc const *p)
+// Start p (running the executable at path) without forking the shell. The
+// child is put in the job's process group (and given the terminal if the job
+// is in the foreground) and has its signals and standard streams set up
+// before it execs.
+// Returns the pid of the child or -1 on failure (with errno set)
+static pid_t spawn_proc(job const *j, proc const *p, char const *path)
 {
-    char **env_end = p->env + vec_len(p->env);
-    for (char **e_p = p->env; e_p != env_end; e_p++) {
-        char *e = *e_p;
-        char *value = e + strlen(e) + 1;
-        unsetenv(e);
-        Stopif(setenv(e, value, 1) == -1, /* No action */,
-               "Could not set the following variable %s to %s", e, value);
+    if (!path) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_init(&attr);
+    posix_spawn_file_actions_init(&actions);
+
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+    sigset_t def = ignored_signal_set();
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigdefault(&attr, &def);
+    posix_spawnattr_setsigmask(&attr, &mask);
+
+    if (interactive) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, j->pgid);
+#ifdef HAVE_SPAWN_TCSETPGRP
+        if (!j->bkg) {
+            posix_spawn_file_actions_addtcsetpgrp_np(&actions, SHELL_TERM);
+        }
+#endif
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    for (size_t i = 0; i < Arr_len(p->fds); i++) {
+        if (p->fds[i] != (int) i) {
+            posix_spawn_file_actions_adddup2(&actions, p->fds[i], i);
+        }
     }
 
+    char **envp = proc_envp(p);
+    pid_t pid;
+    int err = posix_spawn(&pid, path, &actions, &attr, p->argv, envp);
+    free_proc_envp(envp);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+// Fallback for when the child has to run code of its own before exec
+static void exec_proc(proc const *p, char const *path)
+{
     for (size_t i = 0;  i < Arr_len(p->fds); i++) {
         dup2(p->fds[i], i);
     }
 
     // _Exit is used because cleanup_jobs is executed when `exit` is run and we
     // don't want to kill our other processes
-    Stopif(execvp(*p->argv, p->argv) == -1, _Exit(M_FAILED_EXEC),"%s: %s",
-           strerror(errno), *p->argv);
+    if (!path) {
+        errno = ENOENT;
+    } else {
+        execve(path, p->argv, proc_envp(p));
+    }
+    Stopif(true, _Exit(M_FAILED_EXEC), "%s: %s", strerror(errno), *p->argv);
 }
 
 
 static int m_cd(proc const *p)
 {
     // cd to homedir if no directory specified
-    char *dir = p->argv[1] ? p->argv[1] : getenv("HOME");
-    bool old = strcmp(dir, "-") == 0;
-    if (old) {
-        // Hackish check for running "cd -" on first execution until we get
-        // variable handling
-        Stopif(!oldpwd[0], return 1, "OLDPWD not set"); 
-        dir = strdup(oldpwd);
-        Assert_alloc(dir);
-    }
-    getcwd(oldpwd, PATH_MAX);
+    char const *dir = p->argv[1] ? p->argv[1] : get_var("HOME");
+    Stopif(!dir, return 1, "HOME not set");
+    if (strcmp(dir, "-") == 0) {
+        dir = get_var("OLDPWD");
+        Stopif(!dir, return 1, "OLDPWD not set");
+    }
+    char cwd[PATH_MAX];
+    bool have_cwd = getcwd(cwd, sizeof cwd);
+    // dir may point into OLDPWD, so it is only replaced once dir is used
     Stopif(chdir(dir) == -1, return 1, "%s", strerror(errno));
-    if (old) Free(dir);
+    if (have_cwd) {
+        set_var("OLDPWD", cwd, false);
+    }
+    if (getcwd(cwd, sizeof cwd)) {
+        set_var("PWD", cwd, false);
+    }
     return 0;
 }
 
@@ -234,15 +613,52 @@ static int m_exit(proc const *p)
 {
     // Silence warnings about not using p
     (void) p;
+    if (builtin_child) {
+        // Only leave the pipeline stage, not the shell
+        _exit(exit_code);
+    }
     exit(exit_code);
 }
 
+static void print_hashed(node *n, void *data)
+{
+    builtin *b = n->value;
+    int const *fd = data;
+    if (b->path) {
+        dprintf(*fd, "%s\t%s\n", n->key, b->path);
+    }
+}
+
+// hash: list hashed commands, -r: forget them, hash NAME...: look NAMEs up
+static int m_hash(proc const *p)
+{
+    char **args = p->argv + 1;
+    if (!*args) {
+        check_hashed_path();
+        foreach_node(filter_hashed, print_hashed, (void *) &p->fds[1],
+                     lookup_table);
+        return 0;
+    }
+    if (strcmp(*args, "-r") == 0) {
+        clear_hash();
+        return 0;
+    }
+
+    int ret = 0;
+    for (; *args; args++) {
+        // Make sure we search again rather than report a stale entry
+        unhash_command(*args);
+        Stopif(!hash_command(*args), ret = 1, "%s: not found", *args);
+    }
+    return ret;
+}
+
 static int m_help(proc const *p)
 {
     char help_msg[] = "Marcel the Shell (with shoes on) v. " VERSION "\n"
                       "Written by Chad Sharp\n"
                       "\n"
                       "This shell only fights when provoked.\n";
-    write(p->fds[1], help_msg, sizeof help_msg / sizeof (char));
+    write(p->fds[1], help_msg, sizeof help_msg - 1);
     return 0;
 }
@@ -20,9 +20,13 @@
 #define MARCEL_EXEC_H
 
 #include <stdbool.h>
+#include <time.h> // time_t
 #include "ds/hash_table.h"
 #include "ds/proc.h" // proc
 
+// Default mode with which to create files
+#define FILE_MASK 0666
+
 // Builtin function
 typedef int (*proc_func)(proc const*);
 
@@ -34,7 +38,15 @@ bool initialize_builtins(void);
 typedef struct builtin {
     union {
         proc_func cmd;
-        char *var;
+        struct {
+            char *var; // "NAME=VALUE", NULL if exported but not set
+            size_t env_index; // Index of var in the envp of the shell
+            bool exported;
+        };
+        struct {
+            char *path; // Resolved path of command, NULL if not in PATH
+            time_t expires; // Time at which a NULL path is searched again
+        };
     };
     int type;
 } builtin;
@@ -42,6 +54,7 @@ typedef struct builtin {
 enum {
     CMD,
     VAR,
+    HASHED, // Cached result of a PATH search
 };
 
 extern hash_table lookup_table;
@@ -0,0 +1,641 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Parameter expansion and command substitution, done on the words of a job
+// right before it is scheduled: $NAME, ${NAME}, the special parameters $?,
+// $$ and $!, the forms ${NAME:-WORD}, ${NAME-WORD} and ${#NAME}, and
+// $(COMMAND).
+//
+// Words without a '$' are left alone. The others are expanded one after the
+// other into a single buffer, kept from job to job, and copied into the job's
+// arena all at once at the end. The lexer marks the quoted parts of these
+// words. Parameter expansions stay within their word (there is no field
+// splitting of them), but the output of a command substitution outside quotes
+// in an argument is split on IFS into several, and an argument without quotes
+// that expands to nothing is dropped. Variable lookups go through a small
+// cache that is only valid until a variable changes.
+//
+// The command of a $(...) is parsed, expanded and launched as a job of its
+// own, with its stdout on a pipe the shell reads straight into the buffer
+
+#define _GNU_SOURCE // pipe2
+
+#include <errno.h> // errno
+#include <limits.h> // UCHAR_MAX
+#include <signal.h> // SIGCONT
+#include <stdint.h> // SIZE_MAX
+#include <stdio.h> // snprintf
+#include <stdlib.h> // realloc
+#include <string.h> // strchr, strlen, strndup, memchr, memcpy, memcmp...
+
+#include <fcntl.h> // O_CLOEXEC
+#include <unistd.h> // getpid, pipe2, read, close
+
+#include "ds/arena.h" // arena_alloc
+#include "ds/proc.h" // job, free_single_job, free_job_list, SEP_*
+#include "ds/vec.h" // vec_alloc, vec_append, vec_len, vec_setlen
+#include "execute.h" // launch_job
+#include "expand.h" // CTL_ESC, CTL_QUOTED
+#include "jobs.h" // last_bkg_pid, interactive, register_job, reap_job...
+#include "macros.h" // Stopif, Err_msg, Assert_alloc, Arr_len, Cleanup, Free
+#include "marcel.h" // exit_code, M_SIGINT
+#include "parse_cache.h" // parse_line
+#include "tokenizer.h" // subst_end
+#include "variables.h" // get_var, get_var_n, var_generation
+
+#define OUT_INIT_SIZE 4096
+#define PENDING_INIT_SIZE 64
+#define ARGS_INIT_SIZE 64
+// Number of entries of the lookup cache. Must be a power of 2
+#define CACHE_SIZE 64
+// Longest variable name that is cached
+#define CACHED_NAME_MAX 31
+// Least room left in out for each read of a command's output
+#define CAPTURE_READ_MIN (64 * 1024)
+#define DEFAULT_IFS " \t\n"
+// arg.off of an argument left as is
+#define NO_OFF SIZE_MAX
+
+// Expanded word waiting to be copied into the job's arena: the slot its
+// pointer goes in and its offset in out
+typedef struct pending {
+    char **dst;
+    size_t off;
+} pending;
+
+// Argument of a proc being expanded: a word left as is (off is NO_OFF) or the
+// offset in out of an expansion. The arguments of each proc end with an entry
+// that is neither
+typedef struct arg {
+    char *word;
+    size_t off;
+} arg;
+
+typedef struct cached_var {
+    char name[CACHED_NAME_MAX + 1];
+    size_t name_len;
+    char const *value; // NULL if the variable is not set
+    size_t value_len;
+    size_t generation; // var_generation the entry is for, 0 if unused
+} cached_var;
+
+// Expansions of the job being expanded, back to back, NUL terminated
+static char *out;
+static size_t out_len;
+static size_t out_cap;
+static pending *pendings;
+static arg *args;
+// Whether the word being expanded is an argument, whose fields are split
+static bool split_fields;
+// Whether the part of the word being expanded is quoted
+static bool in_quotes;
+static cached_var cache[CACHE_SIZE];
+
+// Exit status of the last command substitution of the job expanded last, 0 if
+// it had none
+int subst_status;
+
+static bool expand_range(char const *s, char const *end);
+
+// Make room for n more characters in out
+static void reserve(size_t n)
+{
+    if (out_len + n > out_cap) {
+        out_cap = out_cap ? out_cap : OUT_INIT_SIZE;
+        while (out_len + n > out_cap) {
+            out_cap *= 2;
+        }
+        out = realloc(out, out_cap);
+        Assert_alloc(out);
+    }
+}
+
+static void put(char const *s, size_t n)
+{
+    reserve(n);
+    memcpy(out + out_len, s, n);
+    out_len += n;
+}
+
+static inline bool is_name_start(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static inline bool is_name_char(char c)
+{
+    return is_name_start(c) || (c >= '0' && c <= '9');
+}
+
+// Look up the variable named by the first len characters of name, through
+// the cache. Returns false if it is not set
+static bool lookup(char const *name, size_t len, char const **value,
+                   size_t *value_len)
+{
+    if (len > CACHED_NAME_MAX) {
+        *value = get_var_n(name, len);
+        *value_len = *value ? strlen(*value) : 0;
+        return *value;
+    }
+    // Cheap rather than good: the entry is checked anyway, and scripts only
+    // use a handful of variables at a time
+    size_t hash = len * 31 + (unsigned char) name[0] * 7
+                  + (unsigned char) name[len - 1];
+    cached_var *c = &cache[hash & (CACHE_SIZE - 1)];
+    if (c->generation != var_generation || c->name_len != len
+            || memcmp(c->name, name, len) != 0) {
+        memcpy(c->name, name, len);
+        c->name_len = len;
+        c->value = get_var_n(name, len);
+        c->value_len = c->value ? strlen(c->value) : 0;
+        c->generation = var_generation;
+    }
+    *value = c->value;
+    *value_len = c->value_len;
+    return c->value;
+}
+
+// Value of the parameter named by the first len characters of name: a
+// special parameter or a variable. Special parameters are formatted into num.
+// Returns false, with an empty value, if it is not set
+static bool param(char const *name, size_t len, char num[static 24],
+                  char const **value, size_t *value_len)
+{
+    static pid_t shell_pid;
+    long n;
+    *value = NULL;
+    *value_len = 0;
+    if (len != 1 || is_name_start(*name)) {
+        return lookup(name, len, value, value_len);
+    } else if (*name == '?') {
+        n = (unsigned char) exit_code;
+    } else if (*name == '$') {
+        if (!shell_pid) {
+            shell_pid = getpid();
+        }
+        n = shell_pid;
+    } else if (*name == '!' && last_bkg_pid) {
+        n = last_bkg_pid;
+    } else {
+        return false;
+    }
+    *value_len = snprintf(num, 24, "%ld", n);
+    *value = num;
+    return true;
+}
+
+// Length of the special parameter or variable name at the start of s,
+// 0 if there is none
+static size_t name_len(char const *s, char const *end)
+{
+    if (s == end) {
+        return 0;
+    }
+    if (*s == '?' || *s == '$' || *s == '!') {
+        return 1;
+    }
+    if (!is_name_start(*s)) {
+        return 0;
+    }
+    size_t len = 1;
+    while (s + len != end && is_name_char(s[len])) {
+        len++;
+    }
+    return len;
+}
+
+// Return the '}' closing the ${ whose contents start at s, NULL if there is
+// none before end. Braces inside quotes don't count
+static char const *closing_brace(char const *s, char const *end)
+{
+    size_t depth = 1;
+    bool quoted = false;
+    for (; s != end; s++) {
+        if (*s == CTL_ESC && s + 1 != end) {
+            s++;
+        } else if (*s == CTL_QUOTED) {
+            quoted = !quoted;
+        } else if (quoted) {
+            continue;
+        } else if (*s == '$' && s + 1 != end && s[1] == '{') {
+            depth++;
+            s++;
+        } else if (*s == '}' && !--depth) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+// Expand the contents of ${...}, from s to end (the closing brace)
+static bool expand_braces(char const *s, char const *end)
+{
+    char num[24];
+    char const *value;
+    size_t value_len;
+    bool length = *s == '#' && s + 1 != end;
+    char const *name = s + length;
+    size_t len = name_len(name, end);
+    char const *op = name + len;
+    if (!len || (length && op != end)) {
+        Err_msg("${%.*s}: bad substitution", (int) (end - s), s);
+        return false;
+    }
+    bool set = param(name, len, num, &value, &value_len);
+
+    if (length) {
+        value_len = snprintf(num, sizeof num, "%zu", value_len);
+        put(num, value_len);
+        return true;
+    }
+    if (op == end) {
+        put(value, value_len);
+        return true;
+    }
+    // ${NAME:-WORD} also uses WORD if NAME is empty, ${NAME-WORD} only if it
+    // is not set
+    bool colon = *op == ':';
+    if (op[colon] != '-' || op + colon == end) {
+        Err_msg("${%.*s}: bad substitution", (int) (end - s), s);
+        return false;
+    }
+    if (set && (value_len || !colon)) {
+        put(value, value_len);
+        return true;
+    }
+    return expand_range(op + colon + 1, end);
+}
+
+// Tidy up the output of a command, put into out from start: drop its
+// trailing newlines and any NUL (which can't be part of a word), and if it is
+// split, turn each run of IFS characters into a single NUL
+static void trim_output(size_t start, bool split)
+{
+    char *s = out + start;
+    size_t len = out_len - start;
+    while (len && s[len - 1] == '\n') {
+        len--;
+    }
+    bool sep[UCHAR_MAX + 1] = {false};
+    if (split) {
+        char const *ifs = get_var("IFS");
+        for (ifs = ifs ? ifs : DEFAULT_IFS; *ifs; ifs++) {
+            sep[(unsigned char) *ifs] = true;
+        }
+    }
+    if (split || memchr(s, '\0', len)) {
+        size_t n = 0;
+        for (size_t i = 0; i < len; i++) {
+            unsigned char c = s[i];
+            if (sep[c]) {
+                if (!n || s[n - 1]) {
+                    s[n++] = '\0';
+                }
+            } else if (c) {
+                s[n++] = c;
+            }
+        }
+        len = n;
+    }
+    out_len = start + len;
+}
+
+// Run j with its output appended to out. Returns false if it can't be run or
+// was interrupted, and sets *status to its exit status
+static bool capture(job *j, int *status)
+{
+    *status = 1;
+    Stopif(j->cmd, free_single_job(j); return false,
+           "$(%s): compound commands aren't supported in $(...)", j->name);
+    if (!expand_job(j)) {
+        free_single_job(j);
+        return false;
+    }
+    // Nothing to run for assignments alone (which other shells run in a
+    // subshell, so they would have no effect either)
+    if (!j->procs[0]->argv[0]) {
+        free_single_job(j);
+        *status = 0;
+        return true;
+    }
+
+    int fds[2];
+    Stopif(pipe2(fds, O_CLOEXEC) == -1, free_single_job(j); return false,
+           "$(%s): %s", j->name, strerror(errno));
+    // A redirection of the command's own stdout wins
+    if (j->io[STDOUT_FILENO].path) {
+        close(fds[1]);
+    } else {
+        j->io[STDOUT_FILENO].fd = fds[1];
+    }
+    // Launched in the background so that its output is read as it comes, but
+    // given the terminal like a job in the foreground
+    j->bkg = true;
+    j->quiet = true;
+    register_job(j);
+    launch_job(j);
+    if (interactive) {
+        give_terminal(j, false);
+        // Wake up the procs that stopped reading the terminal before that
+        signal_job(j, SIGCONT);
+    }
+
+    while (true) {
+        reserve(CAPTURE_READ_MIN);
+        ssize_t n = read(fds[0], out + out_len, out_cap - out_len);
+        if (n > 0) {
+            out_len += n;
+        } else if (n == 0 || errno != EINTR) {
+            break;
+        }
+    }
+    close(fds[0]);
+    wait_for_job(j);
+    if (interactive) {
+        take_terminal(j);
+    }
+    *status = reap_job(j);
+    // ^C (which only reaches the job, it has the terminal) cancels the line
+    return *status != M_SIGINT || !interactive;
+}
+
+// Run the commands of a $(...), the len characters at cmd, and put their
+// output into out. Returns false if they can't be run or were interrupted
+static bool substitute(char const *cmd, size_t len)
+{
+    bool split = split_fields && !in_quotes;
+    char *line = strndup(cmd, len);
+    Assert_alloc(line);
+    job *j = parse_line(line, NULL);
+    Free(line);
+    if (!j) {
+        return false;
+    }
+    // Nothing to run for an empty command
+    if (!j->valid) {
+        free_single_job(j);
+        subst_status = 0;
+        return true;
+    }
+
+    size_t start = out_len;
+    int status = 0;
+    unsigned char sep = SEP_SEQ;
+    while (j) {
+        job *next = j->next;
+        j->next = NULL;
+        bool run = sep == SEP_SEQ || (sep == SEP_AND) == !status;
+        sep = j->sep;
+        if (!run) {
+            free_single_job(j);
+        } else if (!capture(j, &status)) {
+            Cleanup(next, free_job_list);
+            out_len = start;
+            return false;
+        }
+        j = next;
+    }
+    subst_status = status;
+    trim_output(start, split);
+    return true;
+}
+
+// Expand the characters from s to end into out
+static bool expand_range(char const *s, char const *end)
+{
+    while (s != end) {
+        char const *dollar = s;
+        while (dollar != end && *dollar != '$' && *dollar != CTL_ESC
+                && *dollar != CTL_QUOTED) {
+            dollar++;
+        }
+        put(s, dollar - s);
+        s = dollar;
+        if (s == end) {
+            break;
+        }
+        if (*s == CTL_QUOTED) {
+            in_quotes = !in_quotes;
+            s++;
+            continue;
+        }
+        if (*s == CTL_ESC) {
+            if (s + 1 != end) {
+                put(s + 1, 1);
+                s++;
+            }
+            s++;
+            continue;
+        }
+
+        s++;
+        if (s != end && *s == '(') {
+            // The lexer found its end the same way
+            char const *close = subst_end(s - 1);
+            if (!close || close > end) {
+                Err_msg("$(%.*s: missing )", (int) (end - s - 1), s + 1);
+                return false;
+            }
+            if (!substitute(s + 1, close - s - 2)) {
+                return false;
+            }
+            s = close;
+            continue;
+        }
+        if (s != end && *s == '{') {
+            char const *close = closing_brace(s + 1, end);
+            if (!close) {
+                Err_msg("${%.*s: missing }", (int) (end - s - 1), s + 1);
+                return false;
+            }
+            if (!expand_braces(s + 1, close)) {
+                return false;
+            }
+            s = close + 1;
+            continue;
+        }
+        size_t len = name_len(s, end);
+        if (!len) {
+            // Not an expansion, just a dollar sign
+            put("$", 1);
+            continue;
+        }
+        char num[24];
+        char const *value;
+        size_t value_len;
+        if (param(s, len, num, &value, &value_len)) {
+            put(value, value_len);
+        }
+        s += len;
+    }
+    return true;
+}
+
+// Expand the word *dst if it holds a '$'. Its new value goes into out and is
+// only written to *dst by expand_job. Returns false on error
+static bool expand_word(char **dst)
+{
+    char const *w = *dst;
+    if (!strchr(w, '$')) {
+        return true;
+    }
+    size_t off = out_len;
+    in_quotes = false;
+    if (!expand_range(w, w + strlen(w))) {
+        return false;
+    }
+    put("", 1);
+    pending pnd = {.dst = dst, .off = off};
+    vec_append(&pnd, sizeof pnd, (vec *) &pendings);
+    return true;
+}
+
+static void add_arg(char *word, size_t off)
+{
+    arg a = {.word = word, .off = off};
+    vec_append(&a, sizeof a, (vec *) &args);
+}
+
+// Expand the argument w onto the arguments of the proc being expanded, as
+// many as there are fields once it is split (none if it has no quotes and
+// expands to nothing). Returns false on error
+static bool expand_arg(char *w)
+{
+    if (!strchr(w, '$')) {
+        add_arg(w, NO_OFF);
+        return true;
+    }
+    size_t off = out_len;
+    bool quoted = strchr(w, CTL_QUOTED);
+    split_fields = true;
+    in_quotes = false;
+    bool ret = expand_range(w, w + strlen(w));
+    split_fields = false;
+    if (!ret) {
+        return false;
+    }
+    put("", 1);
+    // A quoted argument that isn't split is kept even if it is empty
+    if (quoted && strlen(out + off) == out_len - off - 1) {
+        add_arg(NULL, off);
+        return true;
+    }
+    // Fields were split by NULs
+    while (off != out_len) {
+        size_t len = strlen(out + off);
+        if (len) {
+            add_arg(NULL, off);
+        }
+        off += len + 1;
+    }
+    return true;
+}
+
+// Expand the words of j into out and args
+static bool expand_words(job *j)
+{
+    size_t n_procs = vec_len(j->procs);
+    for (size_t i = 0; i < n_procs; i++) {
+        proc *p = j->procs[i];
+        size_t n_args = vec_len(p->argv);
+        for (size_t k = 0; k < n_args; k++) {
+            // Commands with assignments alone have no argv[0]
+            if (p->argv[k] && !expand_arg(p->argv[k])) {
+                return false;
+            }
+        }
+        add_arg(NULL, NO_OFF);
+
+        size_t n_env = vec_len(p->env);
+        for (size_t k = 0; k < n_env; k++) {
+            if (!expand_word(&p->env[k])) {
+                return false;
+            }
+        }
+    }
+    for (size_t i = 0; i < Arr_len(j->io); i++) {
+        if (j->io[i].path && !expand_word(&j->io[i].path)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Point the words of j at their expansions, from out_base in out, copied into
+// its arena
+static void store_words(job *j, size_t out_base, size_t pending_base,
+                        size_t arg_base)
+{
+    char *words = NULL;
+    if (out_len != out_base) {
+        words = arena_alloc(out_len - out_base, j->mem);
+        memcpy(words, out + out_base, out_len - out_base);
+    }
+    size_t n_pending = vec_len(pendings);
+    for (size_t i = pending_base; i < n_pending; i++) {
+        *pendings[i].dst = words + (pendings[i].off - out_base);
+    }
+
+    size_t n_procs = vec_len(j->procs);
+    arg *a = args + arg_base;
+    for (size_t i = 0; i < n_procs; i++, a++) {
+        proc *p = j->procs[i];
+        vec_setlen(0, p->argv);
+        for (; a->word || a->off != NO_OFF; a++) {
+            char *w = a->word ? a->word : words + (a->off - out_base);
+            vec_append(&w, sizeof w, (vec *) &p->argv);
+        }
+        // A pipeline stage with no command does nothing, like in other shells
+        if (!vec_len(p->argv) && n_procs > 1) {
+            static char true_cmd[] = "true";
+            char *w = true_cmd;
+            vec_append(&w, sizeof w, (vec *) &p->argv);
+        }
+        p->argv[vec_len(p->argv)] = NULL;
+    }
+}
+
+// Expand the arguments, assignments and redirections of j, in place.
+// Returns false (with an error printed) if an expansion is malformed or a
+// command substitution fails
+bool expand_job(job *j)
+{
+    if (!pendings) {
+        pendings = vec_alloc(PENDING_INIT_SIZE * sizeof *pendings);
+        args = vec_alloc(ARGS_INIT_SIZE * sizeof *args);
+    }
+    // Where the job whose $(...) j is the command of left off, if any
+    size_t out_base = out_len;
+    size_t pending_base = vec_len(pendings);
+    size_t arg_base = vec_len(args);
+    bool split = split_fields;
+    bool quoted = in_quotes;
+    split_fields = false;
+    subst_status = 0;
+
+    bool ret = expand_words(j);
+    if (ret) {
+        store_words(j, out_base, pending_base, arg_base);
+    }
+    out_len = out_base;
+    vec_setlen(pending_base, pendings);
+    vec_setlen(arg_base, args);
+    split_fields = split;
+    in_quotes = quoted;
+    return ret;
+}
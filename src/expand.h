@@ -0,0 +1,35 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MARCEL_EXPAND_H
+#define MARCEL_EXPAND_H
+
+#include <stdbool.h>
+#include "ds/proc.h" // job
+
+// Marks the lexer leaves in words holding a '$' for expand_job
+// The next character is literal (a quoted or escaped '$')
+#define CTL_ESC '\001'
+// Around each quoted part of a word, whose expansions aren't split
+#define CTL_QUOTED '\002'
+
+extern int subst_status;
+
+bool expand_job(job *j);
+
+#endif
@@ -0,0 +1,260 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Runs the jobs parsed from a line. Compound commands are run by walking the
+// tree the parser built for them: their jobs are templates, each copied,
+// expanded and launched when its turn comes, so that the body of a loop is
+// only parsed once however many times it runs
+
+#include <fnmatch.h> // fnmatch
+#include <signal.h> // raise, SIGINT
+#include <string.h> // strchr
+
+#include "ds/proc.h" // job, compound, copy_job, free_single_job, SEP_*...
+#include "ds/vec.h" // vec_len
+#include "expand.h" // expand_job, subst_status
+#include "interp.h"
+#include "jobs.h" // interactive, fg_interrupted, register_job...
+#include "macros.h" // Cleanup
+#include "marcel.h" // exit_code, M_SIGINT
+#include "scheduler.h" // schedule_job, run_waiting_jobs
+#include "signals.h" // interrupt_pending, sig_default
+#include "variables.h" // assign_vars, set_var
+
+static void run_compound(compound const *c);
+
+// ^C cancels the rest of the line in an interactive shell. It reaches the
+// shell itself, rather than a job, while builtins run in it. A script is
+// killed by it instead, as sh is, whether it reached the shell or only the
+// job it was waiting for
+static inline bool cancelled(void)
+{
+    if (!interactive && (interrupt_pending() || fg_interrupted)) {
+        sig_default(SIGINT);
+        raise(SIGINT);
+    }
+    if (interactive && interrupt_pending()) {
+        exit_code = M_SIGINT;
+    }
+    return interactive && exit_code == M_SIGINT;
+}
+
+// Whether the job after one ended by sep runs, given the last exit code
+static inline bool runs_after(unsigned char sep)
+{
+    return sep == SEP_SEQ || (sep == SEP_AND) == !exit_code;
+}
+
+// Run the pipeline j, which is freed (or kept by the job table)
+static void run_pipeline(job *j)
+{
+    bool expanded = expand_job(j);
+    bool assigned = expanded && !j->procs[0]->argv[0];
+    if (assigned) {
+        // Assignments alone, nothing to run
+        assign_vars(j->procs[0]);
+        Cleanup(j, free_single_job);
+    } else if (expanded) {
+        register_job(j);
+        schedule_job(j);
+    } else {
+        Cleanup(j, free_single_job);
+    }
+
+    exit_code = report_job_status();
+    if (!expanded) {
+        exit_code = 1;
+    } else if (assigned) {
+        // Which is the status of their last $(...), as in sh
+        exit_code = subst_status;
+    }
+    run_waiting_jobs();
+}
+
+// Run the job templates of list one after the other
+static void run_list(job const *list)
+{
+    unsigned char sep = SEP_SEQ;
+    for (job const *j = list; j; j = j->next) {
+        if (runs_after(sep)) {
+            if (j->cmd) {
+                run_compound(j->cmd);
+            } else {
+                run_pipeline(copy_job(j));
+            }
+            if (cancelled()) {
+                return;
+            }
+        }
+        sep = j->sep;
+    }
+}
+
+// Words of the template j (a single command whose arguments they are), with
+// their number in *n. They are expanded into *expanded if they need to be,
+// which is NULL otherwise. Returns NULL if an expansion fails
+static char **expand_words(job const *j, size_t *n, job **expanded)
+{
+    *expanded = NULL;
+    char **words = j->procs[0]->argv;
+    *n = vec_len(words);
+    for (size_t i = 0; i < *n; i++) {
+        if (strchr(words[i], '$')) {
+            *expanded = copy_job(j);
+            if (!expand_job(*expanded)) {
+                Cleanup(*expanded, free_single_job);
+                return NULL;
+            }
+            words = (*expanded)->procs[0]->argv;
+            *n = vec_len(words);
+            return words;
+        }
+    }
+    return words;
+}
+
+static void run_if(compound const *c)
+{
+    run_list(c->cond);
+    if (cancelled()) {
+        return;
+    }
+    if (!exit_code) {
+        run_list(c->body);
+    } else if (c->alt) {
+        run_list(c->alt);
+    } else {
+        exit_code = 0;
+    }
+}
+
+// The status of a loop is that of the last job of its body to run, 0 if the
+// body never ran
+static void run_while(compound const *c)
+{
+    int status = 0;
+    while (run_list(c->cond), !exit_code) {
+        run_list(c->body);
+        status = exit_code;
+        if (cancelled()) {
+            return;
+        }
+    }
+    if (!cancelled()) {
+        exit_code = status;
+    }
+}
+
+static void run_for(compound const *c)
+{
+    job *expanded;
+    size_t n;
+    char **words = expand_words(c->words, &n, &expanded);
+    if (!words) {
+        exit_code = 1;
+        return;
+    }
+    exit_code = 0;
+    for (size_t i = 0; i < n; i++) {
+        set_var(c->var, words[i], false);
+        run_list(c->body);
+        if (cancelled()) {
+            break;
+        }
+    }
+    Cleanup(expanded, free_single_job);
+}
+
+// Run the body of the first branch with a pattern matching the word
+static void run_case(compound const *c)
+{
+    job *expanded;
+    size_t n;
+    char **word = expand_words(c->words, &n, &expanded);
+    if (!word) {
+        exit_code = 1;
+        return;
+    }
+    // A word that expands to nothing is empty
+    char const *subject = n ? *word : "";
+    exit_code = 0;
+    size_t n_items = vec_len(c->items);
+    for (size_t i = 0; i < n_items; i++) {
+        job *expanded_patterns;
+        size_t n_patterns;
+        char **patterns = expand_words(c->items[i]->patterns, &n_patterns,
+                                       &expanded_patterns);
+        if (!patterns) {
+            exit_code = 1;
+            break;
+        }
+        bool match = false;
+        for (size_t k = 0; k < n_patterns && !match; k++) {
+            match = !fnmatch(patterns[k], subject, 0);
+        }
+        Cleanup(expanded_patterns, free_single_job);
+        if (match) {
+            run_list(c->items[i]->body);
+            break;
+        }
+    }
+    Cleanup(expanded, free_single_job);
+}
+
+static void run_compound(compound const *c)
+{
+    switch (c->type) {
+    case CMD_IF:
+        run_if(c);
+        break;
+    case CMD_WHILE:
+        run_while(c);
+        break;
+    case CMD_FOR:
+        run_for(c);
+        break;
+    case CMD_CASE:
+        run_case(c);
+        break;
+    }
+}
+
+// Run the jobs of j's line, starting with j. Each one is freed once run (or
+// kept by the job table)
+void run_jobs(job *j)
+{
+    unsigned char sep = SEP_SEQ;
+    while (j) {
+        job *next = j->next;
+        j->next = NULL;
+        bool run = runs_after(sep);
+        sep = j->sep;
+        if (run && !j->cmd) {
+            run_pipeline(j);
+        } else {
+            if (run) {
+                run_compound(j->cmd);
+            }
+            free_single_job(j);
+        }
+        j = next;
+        if (run && cancelled()) {
+            Cleanup(j, free_job_list);
+        }
+    }
+}
@@ -16,41 +16,100 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+// syscall
+#define _GNU_SOURCE
+
+#include <stdio.h> // dprintf
 #include <stdlib.h> // atexit
 #include <string.h> // strerror
 #include <errno.h> // errno
 
 #include <signal.h> // kill
+#include <sys/resource.h> // rusage
+#include <sys/syscall.h> // SYS_waitid
 #include <sys/types.h> // pid_t
-#include <sys/wait.h> // waitpid
+#include <sys/wait.h> // waitid
+#include <time.h> // clock_gettime
 #include <termios.h> // termios, TCSADRAIN
 #include <unistd.h> // getpgid, tcgetpgrp, tcsetpgrp, getpgrp...
 
+// glibc >= 2.36 wraps pidfd_open and knows P_PIDFD. Without it (or on kernels
+// older than 5.4) exits are found with a wildcard waitid instead
+#if defined(__GLIBC__) \
+    && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 36))
+#define HAVE_PIDFD
+#include <sys/epoll.h> // epoll_create1, epoll_ctl, epoll_wait
+#include <sys/pidfd.h> // pidfd_open
+#endif
+
+#include "ds/pid_table.h" // pid_table, pid_table_add, pid_table_find...
 #include "ds/proc.h" // job, free_single_job, proc
 #include "ds/vec.h" // dyn_arrray, vec_alloc
 #include "jobs.h" // function prototypes
-#include "signals.h" // sig_flags, WAITING_FOR_INPUT
-#include "macros.h" // Cleanup, Stopif, Err_msg
-
-#ifndef WAIT_ANY
-#define WAIT_ANY -1
-#endif
+#include "macros.h" // Cleanup, Stopif, Err_msg, Arr_len
+#include "scheduler.h" // release_job_slot, drop_waiting_job, run_waiting_jobs
+#include "signals.h" // interrupt_pending
 
 #define JOB_TABLE_INIT_SIZE 256
+// Exits taken from the epoll instance per epoll_wait
+#define EXIT_BATCH 64
+// Most pidfds open at once. Every fork copies the shell's fd table, so one
+// pidfd per child makes launching thousands of them quadratic. The procs
+// started past that are waited on by pid instead
+#define PIDFD_MAX 64
+// Completed background jobs remembered for wait when not interactive. Past
+// that the oldest half is forgotten
+#define KEPT_JOBS_MAX 1024
 
 bool interactive;
+// Pid of the last process of the last background job launched ($!)
+pid_t last_bkg_pid;
+// Whether a proc the shell waits for (of a job in the foreground, or started
+// by the shell for itself) was killed by SIGINT
+bool fg_interrupted;
+// Registered jobs indexed by job number - 1. Free slots are NULL
 static job **job_table;
+// Min-heap of free slots in job_table, new jobs get the lowest free number
+static size_t *free_slots;
+// Dense list of registered jobs, each job knows its position in it
+static job **live_jobs;
+// Jobs whose status may have changed since report_job_status last ran
+static job **changed_jobs;
+// Job and proc for the pid of every proc that hasn't completed
+static pid_table pid_index;
+// Number of jobs registered so far
+static size_t job_seq;
+// Number of completed jobs kept in the table for wait
+static size_t n_kept;
 static pid_t shell_pgid;
 static struct termios shell_tmodes;
+// Whether procs are tracked with pidfds
+static bool use_pidfd;
+// epoll instance holding the pidfd of every proc that hasn't been reaped. It
+// reports exactly the procs that exited, whatever the number of live ones
+static int exit_fd = -1;
+// Number of procs in it
+static size_t n_pidfds;
+// Procs in pid_index without a pidfd, which are reaped by pid
+static size_t n_untracked;
 
 static void cleanup_jobs(void);
+static void unregister_job(job *j);
+static void collect_job(job *j);
+static void initialize_pidfds(void);
 
-// Put shell in forground if interactive
+// Put shell in forground if interactive. Job control is only enabled if
+// allow_interactive is set and the shell is attached to a terminal
 // Returns true on success, false on failure
-bool initialize_job_control(void)
+bool initialize_job_control(bool allow_interactive)
 {
     job_table = vec_alloc(JOB_TABLE_INIT_SIZE * sizeof *job_table);
-    interactive = isatty(SHELL_TERM);
+    free_slots = vec_alloc(JOB_TABLE_INIT_SIZE * sizeof *free_slots);
+    live_jobs = vec_alloc(JOB_TABLE_INIT_SIZE * sizeof *live_jobs);
+    changed_jobs = vec_alloc(JOB_TABLE_INIT_SIZE * sizeof *changed_jobs);
+    pid_index = new_pid_table(PID_TABLE_INIT_SIZE);
+    initialize_pidfds();
+    interactive = allow_interactive && isatty(SHELL_TERM);
     if (interactive) {
         // Loop until in foreground
         while ((shell_pgid = getpgrp()) != tcgetpgrp(SHELL_TERM)) {
@@ -70,46 +129,102 @@ bool initialize_job_control(void)
     return true;
 }
 
+// Use pidfds if both pidfd_open and waitid(P_PIDFD) work
+static void initialize_pidfds(void)
+{
+#ifdef HAVE_PIDFD
+    int fd = pidfd_open(getpid(), 0);
+    if (fd == -1) {
+        return;
+    }
+    // We are not our own child, so a kernel that understands P_PIDFD says
+    // ECHILD. Older ones reject it with EINVAL
+    siginfo_t info;
+    bool works = waitid(P_PIDFD, fd, &info, WEXITED | WNOHANG) == -1
+                 && errno == ECHILD;
+    close(fd);
+    if (works) {
+        exit_fd = epoll_create1(EPOLL_CLOEXEC);
+        use_pidfd = exit_fd != -1;
+    }
+#endif
+}
+
+// Send sig to every process in j's group, or to each of its procs if it has
+// no group of its own (the shell is not interactive). Neither the group nor
+// the pids can have been recycled while the procs are still unreaped, so
+// procs that are done are left alone
+void signal_job(job *j, int sig)
+{
+    if (is_completed(j)) {
+        return;
+    }
+    if (j->pgid > 0) {
+        Stopif(kill(-j->pgid, sig) < 0, /* No action */,
+               "Error signaling job: %s", strerror(errno));
+        return;
+    }
+    proc **proc_end = j->procs + vec_len(j->procs);
+    for (proc **p_p = j->procs; p_p != proc_end; p_p++) {
+        if ((*p_p)->pid && !(*p_p)->completed) {
+            kill((*p_p)->pid, sig);
+        }
+    }
+}
+
 // Free job table and kill all background jobs
 static void cleanup_jobs(void)
 {
-    job **end = job_table + vec_len(job_table);
-    for (job **j_p = job_table; j_p != end; j_p++) {
+    job **end = live_jobs + vec_len(live_jobs);
+    for (job **j_p = live_jobs; j_p != end; j_p++) {
         job *j = *j_p;
-        if (!j) {
-            continue;
-        }
-
-        if (j->bkg) {
-            kill(j->pgid, SIGHUP);
-        } else {
+        if (!j->bkg) {
             wait_for_job(j);
+        } else if (j->pgid > 0) {
+            // Without job control, background jobs outlive the shell
+            signal_job(j, SIGHUP);
         }
 
         free_single_job(j);
     }
     vec_free(job_table);
+    vec_free(free_slots);
+    vec_free(live_jobs);
+    vec_free(changed_jobs);
+    free_pid_table(&pid_index);
+    if (exit_fd != -1) {
+        close(exit_fd);
+    }
 }
 
 // Put job in foreground, continuing if cont is true
 void send_to_foreground(job *j, bool cont)
 {
-    // Put job in foreground
+    give_terminal(j, cont);
+    wait_for_job(j);
+    take_terminal(j);
+}
+
+// Put the process group of j in the foreground of the terminal, restoring
+// its terminal modes and sending it SIGCONT if cont is true
+void give_terminal(job *j, bool cont)
+{
     tcsetpgrp(SHELL_TERM, j->pgid);
     // Send SIGCONT if necessary
     if (cont) {
         tcsetattr(SHELL_TERM, TCSADRAIN, &j->tmodes);
-        Stopif(kill(-j->pgid, SIGCONT) < 0, /* No action */,
-               "Error continuing process: %s", strerror(errno));
+        signal_job(j, SIGCONT);
     }
-    wait_for_job(j);
-    // Put shell in foreground
+}
+
+// Put the shell back in the foreground, saving the terminal modes of j
+void take_terminal(job *j)
+{
     tcsetpgrp(SHELL_TERM, shell_pgid);
 
     // Restore terminal modes
     tcgetattr(SHELL_TERM, &j->tmodes);
     tcsetattr(SHELL_TERM, TCSADRAIN, &shell_tmodes);
-
 }
 
 // Put job in background, send SIGCONT if cont is true
@@ -117,69 +232,216 @@ void send_to_background(job *j, bool cont)
 {
     // Send SIGCONT if necessary
     if (cont) {
-        Stopif(kill(-j->pgid, SIGCONT) < 0, /* No action */, "%s", strerror(errno));
+        signal_job(j, SIGCONT);
     }
 }
 
-// Find proc that corresponds with pid and mark it as stopped or completed as
-// apropriate.  Return true on success, false on failure
-// TODO: Extend to returning information about other kinds of signals
-bool mark_proc_status(pid_t pid, int status)
+// Queue j to be looked at by the next report_job_status
+static void queue_job(job *j)
 {
-    if (pid > 0) {
-        job **job_end = job_table + vec_len(job_table);
-        for (job **j_p = job_table; j_p != job_end; j_p++) {
-            job *j = *j_p;
-            if (!j) {
-                continue;
-            }
-            proc **proc_end = vec_len(j->procs) + j->procs;
-            for (proc **p_p = j->procs; p_p != proc_end; p_p++) {
-                proc *p = *p_p;
-                if (p->pid == pid) {
-                    if (WIFSTOPPED(status) || WIFCONTINUED(status)) {
-                        p->stopped = !p->stopped;
-                        j->notified = false;
-                    } else {
-                        p->exit_code = (WIFSIGNALED(status)) ? M_SIGINT : WEXITSTATUS(status);
-                        p->completed = true;
-                    }
-                    return true;
-                }
-            }
-        }
-        Err_msg("No child process %d", pid);
-        return false;
-    } else if (pid == 0 || errno == ECHILD) {
+    if (!j->queued) {
+        j->queued = true;
+        vec_append(&j, sizeof j, (vec *) &changed_jobs);
+    }
+}
+
+// Stop sharing the epoll set with the shell, in a child forked to run a
+// builtin. The set belongs to the open file, so the procs the child started
+// would otherwise show up in the shell's (and the other way around)
+void detach_job_table(void)
+{
+#ifdef HAVE_PIDFD
+    if (exit_fd != -1) {
+        close(exit_fd);
+        exit_fd = epoll_create1(EPOLL_CLOEXEC);
+        use_pidfd = exit_fd != -1;
+    }
+#endif
+}
+
+// Stop tracking p's pidfd
+static void release_pidfd(proc *p)
+{
+#ifdef HAVE_PIDFD
+    if (p->pidfd != -1) {
+        // Forked builtins share the fd, so closing it alone would not take it
+        // out of the epoll set
+        epoll_ctl(exit_fd, EPOLL_CTL_DEL, p->pidfd, NULL);
+        close(p->pidfd);
+        p->pidfd = -1;
+        n_pidfds--;
+    }
+#else
+    (void) p;
+#endif
+}
+
+// Stop tracking p, which was reaped or whose job is gone
+static void forget_proc(proc *p)
+{
+    if (p->pidfd == -1) {
+        n_untracked--;
+    }
+    release_pidfd(p);
+    pid_table_delete(p->pid, &pid_index);
+}
+
+// waitid that also returns the resources used by the child if it was reaped.
+// The system call takes a struct rusage that the glibc wrapper leaves out
+static int wait_child(idtype_t type, id_t id, siginfo_t *info, int options,
+                      struct rusage *usage)
+{
+    return syscall(SYS_waitid, type, id, info, options, usage);
+}
+
+// Record the change of state of a proc reported by waitid in info, along with
+// the resources it used if it completed
+// Return true on success, false if there was nothing to report
+bool mark_proc_status(siginfo_t const *info, struct rusage const *usage)
+{
+    if (info->si_pid <= 0) {
         // No processes available to report
         return false;
-    } else {
-        Err_msg("Error waiting on child process");
-        return false;
+    }
+    pid_entry *e = pid_table_find(info->si_pid, &pid_index);
+    Stopif(!e, return false, "No child process %d", info->si_pid);
+    job *j = e->job;
+    proc *p = e->proc;
+    switch (info->si_code) {
+    case CLD_STOPPED:
+    case CLD_TRAPPED:
+    case CLD_CONTINUED:
+        p->stopped = info->si_code != CLD_CONTINUED;
+        j->notified = false;
+        break;
+    default:
+        p->exit_code = info->si_code == CLD_EXITED ? info->si_status : M_SIGINT;
+        if (info->si_code != CLD_EXITED && info->si_status == SIGINT
+                && (!j->bkg || j->quiet)) {
+            fg_interrupted = true;
+        }
+        p->completed = true;
+        p->usage = *usage;
+        // Reaping is prompt in the foreground. Background procs may have
+        // exited a while before the shell got around to them
+        clock_gettime(CLOCK_MONOTONIC, &p->finished);
+        forget_proc(p);
+        if (j->slot != SLOT_NONE && is_completed(j)) {
+            release_job_slot(j);
+        }
+    }
+    queue_job(j);
+    return true;
+}
+
+// Reap whichever procs in the epoll set have exited (without blocking)
+static void reap_exited(void)
+{
+#ifdef HAVE_PIDFD
+    struct epoll_event events[EXIT_BATCH];
+    int n;
+    do {
+        n = epoll_wait(exit_fd, events, EXIT_BATCH, 0);
+        for (int i = 0; i < n; i++) {
+            pid_entry *e = pid_table_find(events[i].data.u64, &pid_index);
+            if (!e) continue;
+            siginfo_t info = {0};
+            struct rusage usage;
+            if (wait_child(P_PIDFD, e->proc->pidfd, &info, WEXITED | WNOHANG,
+                           &usage) == 0) {
+                mark_proc_status(&info, &usage);
+            }
+        }
+    } while (n == EXIT_BATCH);
+#endif
+}
+
+// Reap whichever children have exited (without blocking), each by its own
+// pid. A wildcard waitid only peeks at them, so a pid is never reaped before
+// it is known to belong to an exited child
+static void reap_by_pid(void)
+{
+    while (true) {
+        siginfo_t info = {0};
+        if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) == -1
+                || !info.si_pid) {
+            break;
+        }
+        pid_t pid = info.si_pid;
+        pid_entry *e = pid_table_find(pid, &pid_index);
+        struct rusage usage;
+        info = (siginfo_t) {0};
+        if (wait_child(P_PID, pid, &info, WEXITED | WNOHANG, &usage) == -1) {
+            Stopif(errno != ECHILD, /* No action */,
+                   "Error waiting on child process: %s", strerror(errno));
+            break;
+        }
+        // A child no job knows of anymore only needs to be reaped
+        if (e) {
+            mark_proc_status(&info, &usage);
+        }
     }
 }
 
 // Check for processes with statuses to report (without blocking)
 void check_job_status(void)
 {
-    int status = 0;
-    pid_t pid = 0;
+    // With pidfds, exits come from the epoll set, or by pid for procs
+    // without one, and only stops and continues are looked for with a
+    // wildcard, which reaps nothing
+    int flags = WSTOPPED | WCONTINUED | WNOHANG;
+    if (use_pidfd) {
+        reap_exited();
+        if (n_untracked) {
+            reap_by_pid();
+        }
+    } else {
+        flags |= WEXITED;
+    }
+    siginfo_t info;
+    struct rusage usage;
     do {
-        pid = waitpid(WAIT_ANY, &status, WUNTRACED | WNOHANG | WCONTINUED);
-    } while (mark_proc_status(pid, status));
+        // si_pid is only set if there was something to report
+        info.si_pid = 0;
+        if (wait_child(P_ALL, 0, &info, flags, &usage) == -1) {
+            Stopif(errno != ECHILD, /* No action */,
+                   "Error waiting on child process: %s", strerror(errno));
+            break;
+        }
+    } while (mark_proc_status(&info, &usage));
 }
 
-// Check for processes with statuses to report (blocking)
+// Block until every proc of j has stopped or completed. Each proc is waited
+// on by itself (through its pidfd if it has one), so nothing else is reaped.
+// Returns immediately if there is nothing left to wait for (e.g. every proc
+// was a builtin or failed to launch)
 void wait_for_job(job *j)
 {
-    int status;
-    pid_t pid;
-    do {
-        pid = waitpid(-j->pgid, &status, WUNTRACED | WCONTINUED);
-    } while (mark_proc_status(pid, status)
-             && !is_stopped(j)
-             && !is_completed(j));
-
+    proc **proc_end = j->procs + vec_len(j->procs);
+    for (proc **p_p = j->procs; p_p != proc_end; p_p++) {
+        proc *p = *p_p;
+        while (p->pid && !p->completed && !p->stopped) {
+            siginfo_t info = {0};
+            struct rusage usage;
+            int err;
+#ifdef HAVE_PIDFD
+            if (p->pidfd != -1) {
+                err = wait_child(P_PIDFD, p->pidfd, &info,
+                                 WEXITED | WSTOPPED | WCONTINUED, &usage);
+            } else
+#endif
+            {
+                err = wait_child(P_PID, p->pid, &info,
+                                 WEXITED | WSTOPPED | WCONTINUED, &usage);
+            }
+            if (err == -1 && errno == EINTR) {
+                continue;
+            }
+            Stopif(err == -1, return, "Error waiting on child process: %s",
+                   strerror(errno));
+            mark_proc_status(&info, &usage);
+        }
+    }
 }
 
 void format_job_info(job *j, char const *msg)
@@ -187,40 +449,186 @@ void format_job_info(job *j, char const *msg)
     fprintf(stderr, "[%zu] %d (%s): %s\n", j->index+1, j->pgid,  msg, j->name);
 }
 
-// Notify user of changes in job status, free job if completed
-// Return exit code of the completed job that was launched most recently
+static double ts_seconds(struct timespec ts)
+{
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double tv_seconds(struct timeval tv)
+{
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Seconds p ran for, up to now if it hasn't completed
+static double proc_real(proc const *p)
+{
+    struct timespec end = p->finished;
+    if (!p->completed) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+    }
+    return ts_seconds(end) - ts_seconds(p->started);
+}
+
+// Print the arguments of p separated by spaces
+static void print_argv(FILE *out, proc const *p)
+{
+    for (char **arg = p->argv; *arg; arg++) {
+        fprintf(out, arg == p->argv ? "%s" : " %s", *arg);
+    }
+}
+
+// Print the wall, user and sys time of every stage of the completed job j
+// (if it has more than one) and of the whole job, as requested by `time`
+static void report_times(job *j)
+{
+    size_t n_procs = vec_len(j->procs);
+    struct timespec first = j->procs[0]->started;
+    struct timespec last = j->procs[0]->finished;
+    double user = 0;
+    double sys = 0;
+    fprintf(stderr, "%9s %9s %9s\n", "real", "user", "sys");
+    for (size_t i = 0; i < n_procs; i++) {
+        proc const *p = j->procs[i];
+        double p_user = tv_seconds(p->usage.ru_utime);
+        double p_sys = tv_seconds(p->usage.ru_stime);
+        if (ts_seconds(p->started) < ts_seconds(first)) {
+            first = p->started;
+        }
+        if (ts_seconds(p->finished) > ts_seconds(last)) {
+            last = p->finished;
+        }
+        user += p_user;
+        sys += p_sys;
+        if (n_procs > 1) {
+            fprintf(stderr, "%9.3f %9.3f %9.3f  ", proc_real(p), p_user, p_sys);
+            print_argv(stderr, p);
+            fputc('\n', stderr);
+        }
+    }
+    fprintf(stderr, "%9.3f %9.3f %9.3f  ",
+            ts_seconds(last) - ts_seconds(first), user, sys);
+    if (n_procs > 1) {
+        fputs("total", stderr);
+    } else {
+        print_argv(stderr, j->procs[0]);
+    }
+    fputc('\n', stderr);
+}
+
+// Exit code of j, that of its last proc
+static int job_status(job const *j)
+{
+    return j->procs[vec_len(j->procs) - 1]->exit_code;
+}
+
+// Block until j has completed, then drop it from the table. A job that
+// stopped instead is left there for the user to deal with
+// Returns the exit code of j
+int reap_job(job *j)
+{
+    wait_for_job(j);
+    int ret = job_status(j);
+    if (is_completed(j)) {
+        collect_job(j);
+    } else {
+        j->quiet = false;
+    }
+    return ret;
+}
+
+static int compare_seq(void const *a, void const *b)
+{
+    job const *j_a = *(job * const *) a;
+    job const *j_b = *(job * const *) b;
+    return (j_a->seq > j_b->seq) - (j_a->seq < j_b->seq);
+}
+
+// Free the older half of the completed jobs kept for wait
+static void forget_kept_jobs(void)
+{
+    job **kept = malloc(n_kept * sizeof *kept);
+    Assert_alloc(kept);
+    size_t n = 0;
+    size_t n_live = vec_len(live_jobs);
+    for (size_t i = 0; i < n_live; i++) {
+        if (live_jobs[i]->kept) {
+            kept[n++] = live_jobs[i];
+        }
+    }
+    qsort(kept, n, sizeof *kept, compare_seq);
+    for (size_t i = 0; i < n / 2; i++) {
+        unregister_job(kept[i]);
+        free_single_job(kept[i]);
+    }
+    n_kept -= n / 2;
+    free(kept);
+}
+
+// Keep the completed background job j in the table until wait collects it
+static void keep_job(job *j)
+{
+    j->kept = true;
+    if (++n_kept > KEPT_JOBS_MAX) {
+        forget_kept_jobs();
+    }
+}
+
+// Drop the completed job j from the table now that wait collected it. Jobs
+// still queued are freed by report_job_status instead
+static void collect_job(job *j)
+{
+    if (j->queued) {
+        j->waited = true;
+        return;
+    }
+    if (j->kept) {
+        n_kept--;
+    }
+    unregister_job(j);
+    free_single_job(j);
+}
+
+// Notify user of changes in job status, free job if completed. Only jobs
+// whose status changed since the last call are looked at. Without job
+// control, completed background jobs stay in the table until wait collects
+// them
+// Return exit code of the completed foreground job that was launched most
+// recently, 0 if there is none
 int report_job_status(void)
 {
     check_job_status();
     int ret = 0;
-    job **job_end = job_table + vec_len(job_table);
-    for (job **j_p = job_table; j_p != job_end; j_p++) {
-        job *j = *j_p;
-        if (!j) {
-            continue;
-        }
+    size_t latest = 0;
+    size_t n_changed = vec_len(changed_jobs);
+    for (size_t i = 0; i < n_changed; i++) {
+        job *j = changed_jobs[i];
+        j->queued = false;
         // If all procs have completed, job is completed
         if (is_completed(j)) {
-            // Only notify about background jobs
-            if (j->bkg) {
+            // Only notify about background jobs nobody waited for
+            if (j->bkg && interactive && !j->waited && !j->quiet) {
                 format_job_info(j, "completed");
             }
+            if (j->timed) {
+                report_times(j);
+            }
             // Get exit code from last process in
-            ret = j->procs[vec_len(j->procs) - 1]->exit_code;
-
-            // We are removing last job, calculate new last job index
-            if (j_p + 1 >= job_end) {
-                job **j_crawl = j_p - 1;
-                for (; j_crawl >= job_table && !*j_crawl; j_crawl--);
-                vec_setlen(j_crawl - job_table + 1, job_table);
+            if (!j->bkg && j->seq >= latest) {
+                ret = job_status(j);
+                latest = j->seq;
+            }
+            if (j->bkg && !interactive && !j->waited) {
+                keep_job(j);
+            } else {
+                unregister_job(j);
+                free_single_job(j);
             }
-            free_single_job(j);
-            *j_p = NULL;
         } else if (is_stopped(j) && !j->notified) {
             format_job_info(j, "stopped");
             j->notified = true;
         }
     }
+    vec_setlen(0, changed_jobs);
     return ret;
 
 }
@@ -271,38 +679,382 @@ bool is_completed(job *j)
     return true;
 }
 
-// Add job to global job list, return false if job table needs to expand, but
-// expansion failed or if job table has not been initialized
+static void push_free_slot(size_t slot)
+{
+    vec_append(&slot, sizeof slot, (vec *) &free_slots);
+    // Sift up
+    for (size_t i = vec_len(free_slots) - 1; i > 0; ) {
+        size_t parent = (i - 1) / 2;
+        if (free_slots[parent] <= free_slots[i]) {
+            break;
+        }
+        free_slots[i] = free_slots[parent];
+        free_slots[parent] = slot;
+        i = parent;
+    }
+}
+
+static size_t pop_free_slot(void)
+{
+    size_t ret = free_slots[0];
+    size_t len = vec_len(free_slots) - 1;
+    size_t slot = free_slots[len];
+    vec_setlen(len, free_slots);
+    // Sift down the last slot from the root
+    size_t i = 0;
+    while (true) {
+        size_t child = 2 * i + 1;
+        if (child >= len) {
+            break;
+        }
+        if (child + 1 < len && free_slots[child + 1] < free_slots[child]) {
+            child++;
+        }
+        if (slot <= free_slots[child]) {
+            break;
+        }
+        free_slots[i] = free_slots[child];
+        i = child;
+    }
+    if (len) {
+        free_slots[i] = slot;
+    }
+    return ret;
+}
+
+// Add job to global job list, return false if job table has not been
+// initialized. The job's status is checked by the next report_job_status,
+// so jobs that complete without any child processes are freed as well
 bool register_job(job *j)
 {
     if (!job_table) {
         return false;
     }
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wincompatible-pointer-types"
-    size_t job_cap = vec_capacity(job_table) / sizeof *job_table;
-    // Grow job table if necessary
-    if (vec_len(job_table) + 1 >= job_cap
-            && vec_grow(&job_table) != 0) {
-        return false;
+
+    if (vec_len(free_slots)) {
+        j->index = pop_free_slot();
+        job_table[j->index] = j;
+    } else {
+        j->index = vec_len(job_table);
+        vec_append(&j, sizeof j, (vec *) &job_table);
     }
-#pragma GCC diagnostic pop
-
-    // Find empty slot in table to place job
-    job **job_end = job_table + job_cap;
-    for (job **j_p = job_table; j_p != job_end; j_p++) {
-        if (!*j_p) {
-            *j_p = j;
-            size_t i = j_p - job_table;
-            j->index = i;
-            if (i >= vec_len(job_table)) {
-                vec_setlen(vec_len(job_table) + 1, job_table);
+    j->seq = job_seq++;
+    j->live_index = vec_len(live_jobs);
+    vec_append(&j, sizeof j, (vec *) &live_jobs);
+    queue_job(j);
+    return true;
+}
+
+// Make p's pid known to the job table. Must be called for every proc of a
+// registered job that runs in a child process
+void register_proc(job *j, proc *p)
+{
+    pid_table_add(p->pid, j, p, &pid_index);
+#ifdef HAVE_PIDFD
+    if (use_pidfd && n_pidfds < PIDFD_MAX) {
+        // The child cannot have been reaped yet, so this is the right process
+        // even if it already exited
+        p->pidfd = pidfd_open(p->pid, 0);
+        struct epoll_event ev = {.events = EPOLLIN, .data.u64 = p->pid};
+        if (p->pidfd != -1) {
+            n_pidfds++;
+            if (epoll_ctl(exit_fd, EPOLL_CTL_ADD, p->pidfd, &ev) == -1) {
+                release_pidfd(p);
             }
-            return true;
         }
+    }
+#endif
+    if (p->pidfd == -1) {
+        // Out of pidfds (or fds), reap_by_pid picks it up
+        n_untracked++;
+    }
+}
+
+// Remove job from global job list
+static void unregister_job(job *j)
+{
+    job_table[j->index] = NULL;
+    push_free_slot(j->index);
+
+    size_t last = vec_len(live_jobs) - 1;
+    job *moved = live_jobs[last];
+    live_jobs[j->live_index] = moved;
+    moved->live_index = j->live_index;
+    vec_setlen(last, live_jobs);
+    release_job_slot(j);
+    drop_waiting_job(j);
 
+    // Procs that never got reaped shouldn't be found anymore
+    proc **proc_end = j->procs + vec_len(j->procs);
+    for (proc **p_p = j->procs; p_p != proc_end; p_p++) {
+        if ((*p_p)->pid && !(*p_p)->completed) {
+            forget_proc(*p_p);
+        }
     }
+}
 
+// Whether p is one of the procs of j
+static bool job_has_proc(job const *j, proc const *p)
+{
+    proc **proc_end = j->procs + vec_len(j->procs);
+    for (proc **p_p = j->procs; p_p != proc_end; p_p++) {
+        if (*p_p == p) {
+            return true;
+        }
+    }
     return false;
+}
 
+// Print one line for proc p of a job for `jobs -l`
+static void print_proc_usage(FILE *out, proc const *p)
+{
+    char status[16];
+    if (p->completed) {
+        snprintf(status, sizeof status, "exit %d", p->exit_code);
+    } else {
+        snprintf(status, sizeof status, p->stopped ? "stopped" : "running");
+    }
+    fprintf(out, "%8d %-8s %8.3f", p->pid, status, proc_real(p));
+    if (p->completed) {
+        struct rusage const *u = &p->usage;
+        fprintf(out, " %8.3f %8.3f %8ld %6ld %6ld %6ld %6ld  ",
+                tv_seconds(u->ru_utime), tv_seconds(u->ru_stime),
+                u->ru_maxrss, u->ru_nvcsw, u->ru_nivcsw,
+                u->ru_inblock, u->ru_oublock);
+    } else {
+        // Nothing is known about usage until the proc has been reaped
+        fprintf(out, " %8s %8s %8s %6s %6s %6s %6s  ",
+                "-", "-", "-", "-", "-", "-", "-");
+    }
+    print_argv(out, p);
+    fputc('\n', out);
+}
+
+// jobs -j [N]: print or set the max number of background jobs running at
+// once (0 for no limit)
+static int job_limit_cmd(proc const *p)
+{
+    char const *arg = p->argv[2];
+    if (!arg) {
+        dprintf(p->fds[1], "%zu\n", get_job_limit());
+        return 0;
+    }
+    char *end;
+    errno = 0;
+    unsigned long n = strtoul(arg, &end, 10);
+    Stopif(*end || end == arg || *arg == '-' || errno || p->argv[3], return 2,
+           "usage: jobs -j [N]");
+    return set_job_limit(n) ? 0 : 1;
+}
+
+// jobs: list the jobs that haven't been reported as completed yet
+// jobs -l: also show every proc with the time and resources it used
+int m_jobs(proc const *p)
+{
+    bool long_fmt = false;
+    char **args = p->argv + 1;
+    if (*args && strcmp(*args, "-j") == 0) {
+        return job_limit_cmd(p);
+    }
+    if (*args && strcmp(*args, "-l") == 0) {
+        long_fmt = true;
+        args++;
+    }
+    Stopif(*args, return 2, "usage: jobs [-l] | jobs -j [N]");
+
+    // Write through stdio so the table is not one syscall per field
+    int fd = dup(p->fds[1]);
+    Stopif(fd == -1, return 1, "jobs: %s", strerror(errno));
+    FILE *out = fdopen(fd, "w");
+    Stopif(!out, close(fd); return 1, "jobs: %s", strerror(errno));
+
+    if (long_fmt) {
+        fprintf(out, "%8s %-8s %8s %8s %8s %8s %6s %6s %6s %6s  %s\n",
+                "PID", "STATUS", "REAL", "USER", "SYS", "MAXRSS",
+                "VCSW", "IVCSW", "INBLK", "OUTBLK", "COMMAND");
+    }
+    size_t n_jobs = vec_len(job_table);
+    for (size_t i = 0; i < n_jobs; i++) {
+        job *j = job_table[i];
+        // Skip free slots and the job running this builtin
+        if (!j || job_has_proc(j, p)) {
+            continue;
+        }
+        char const *state = is_completed(j) ? "completed"
+                            : j->waiting ? "queued"
+                            : is_stopped(j) ? "stopped" : "running";
+        fprintf(out, "[%zu] %d (%s): %s\n", j->index + 1, j->pgid, state,
+                j->name);
+        if (long_fmt) {
+            proc **proc_end = j->procs + vec_len(j->procs);
+            for (proc **p_p = j->procs; p_p != proc_end; p_p++) {
+                print_proc_usage(out, *p_p);
+            }
+        }
+    }
+    return fclose(out) == 0 ? 0 : 1;
+}
+
+// Launch the jobs that were waiting for a slot if there are slots now, then
+// block until a child changes state and record what happened
+// Returns false if interrupted or if there are no children left
+bool wait_for_change(void)
+{
+    run_waiting_jobs();
+    while (true) {
+        int err;
+#ifdef HAVE_PIDFD
+        if (use_pidfd && !n_untracked) {
+            struct epoll_event ev;
+            err = epoll_wait(exit_fd, &ev, 1, -1) == -1 ? -1 : 0;
+        } else
+#endif
+        {
+            // Only peek, check_job_status does the reaping
+            siginfo_t info;
+            err = waitid(P_ALL, 0, &info, WEXITED | WNOWAIT);
+        }
+        if (err == -1 && errno == EINTR && !interrupt_pending()) {
+            continue;
+        }
+        if (err == -1) {
+            return false;
+        }
+        check_job_status();
+        return true;
+    }
+}
+
+// Find the job numbered by spec ("%N") or the job and proc with the pid spec
+// Returns NULL if there is none (or it is the job of proc self)
+static job *find_wait_target(char const *spec, proc const *self, proc **p_out)
+{
+    char *end;
+    bool is_job = *spec == '%';
+    unsigned long n = strtoul(spec + is_job, &end, 10);
+    if (*end || end == spec + is_job) {
+        return NULL;
+    }
+    job *ret = NULL;
+    if (is_job) {
+        if (n >= 1 && n <= vec_len(job_table)) {
+            ret = job_table[n - 1];
+        }
+    } else {
+        size_t n_live = vec_len(live_jobs);
+        for (size_t i = 0; i < n_live && !ret; i++) {
+            job *j = live_jobs[i];
+            proc **proc_end = j->procs + vec_len(j->procs);
+            for (proc **p_p = j->procs; p_p != proc_end; p_p++) {
+                if ((*p_p)->pid && (*p_p)->pid == (pid_t) n) {
+                    *p_out = *p_p;
+                    ret = j;
+                    break;
+                }
+            }
+        }
+    }
+    return ret && !job_has_proc(ret, self) ? ret : NULL;
+}
+
+// wait for the job or proc given by spec, see find_wait_target
+static int wait_for_target(char const *spec, proc const *self)
+{
+    proc *p = NULL;
+    job *j = find_wait_target(spec, self, &p);
+    Stopif(!j, return 127, "wait: %s: no such job or child process", spec);
+    check_job_status();
+    while (p ? !p->completed : !is_completed(j)) {
+        if (!wait_for_change()) {
+            return M_SIGINT;
+        }
+    }
+    int ret = p ? p->exit_code : job_status(j);
+    if (is_completed(j)) {
+        collect_job(j);
+    }
+    return ret;
+}
+
+// wait -n: wait for the next job to complete, or take one that completed
+// without being waited for. Returns 127 if there are no jobs
+static int wait_for_any(proc const *self)
+{
+    check_job_status();
+    while (true) {
+        job *done = NULL;
+        bool running = false;
+        size_t n_live = vec_len(live_jobs);
+        for (size_t i = 0; i < n_live; i++) {
+            job *j = live_jobs[i];
+            if (j->waited || job_has_proc(j, self)) {
+                continue;
+            }
+            if (!is_completed(j)) {
+                running = true;
+            } else if (!done || j->seq < done->seq) {
+                done = j;
+            }
+        }
+        if (done) {
+            int ret = job_status(done);
+            collect_job(done);
+            return ret;
+        }
+        if (!running) {
+            return 127;
+        }
+        if (!wait_for_change()) {
+            return M_SIGINT;
+        }
+    }
+}
+
+// wait for every job to complete
+static int wait_for_all(proc const *self)
+{
+    check_job_status();
+    while (true) {
+        bool running = false;
+        size_t n_live = vec_len(live_jobs);
+        for (size_t i = 0; i < n_live && !running; i++) {
+            job *j = live_jobs[i];
+            running = !is_completed(j) && !job_has_proc(j, self);
+        }
+        if (!running) {
+            break;
+        }
+        if (!wait_for_change()) {
+            return M_SIGINT;
+        }
+    }
+    // Backwards, since collecting a job moves the last one into its place
+    for (size_t i = vec_len(live_jobs); i-- > 0; ) {
+        job *j = live_jobs[i];
+        if (!j->waited && !job_has_proc(j, self)) {
+            collect_job(j);
+        }
+    }
+    return 0;
+}
+
+// wait: wait for every job, return 0
+// wait -n: wait for the next job to complete, return its exit code
+// wait ID...: wait for each process PID or job %N, return the exit code of
+// the last one (127 if it is unknown)
+int m_wait(proc const *p)
+{
+    char **args = p->argv + 1;
+    if (*args && strcmp(*args, "-n") == 0) {
+        Stopif(args[1], return 2, "usage: wait [-n] [PID|%%JOB...]");
+        return wait_for_any(p);
+    }
+    if (!*args) {
+        return wait_for_all(p);
+    }
+    int ret = 0;
+    for (; *args; args++) {
+        ret = wait_for_target(*args, p);
+    }
+    return ret;
 }
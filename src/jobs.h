@@ -19,19 +19,29 @@
 #ifndef M_JOB_CTRL
 #define M_JOB_CTRL
 
+#include <signal.h> // siginfo_t
 #include <stdbool.h>
+#include <sys/resource.h> // rusage
 #include "ds/proc.h" // job
 
 #define SHELL_TERM STDIN_FILENO
 
 extern bool interactive;
+extern pid_t last_bkg_pid;
+extern bool fg_interrupted;
 
 
-bool initialize_job_control(void);
+bool initialize_job_control(bool allow_interactive);
 void send_to_foreground(job *j, bool cont);
 void send_to_background(job *j, bool cont);
-bool mark_proc_status(pid_t pid, int status);
+void give_terminal(job *j, bool cont);
+void take_terminal(job *j);
+bool mark_proc_status(siginfo_t const *info, struct rusage const *usage);
 void check_job_status(void);
+bool wait_for_change(void);
+int reap_job(job *j);
+void signal_job(job *j, int sig);
+void detach_job_table(void);
 void wait_for_job(job *j);
 void format_job_info(job *j, char const *msg);
 int report_job_status(void);
@@ -40,4 +50,7 @@ job *find_job(pid_t pgid, job const *crawler);
 bool is_stopped(job *j);
 bool is_completed(job *j);
 bool register_job(job *j);
+void register_proc(job *j, proc *p);
+int m_jobs(proc const *p);
+int m_wait(proc const *p);
 #endif
@@ -16,133 +16,313 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#include <stdio.h> // readline
-#include <stdlib.h> // calloc, getenv
-#include <string.h> // strerror, strcmp
+#include <errno.h> // errno
+#include <stdio.h> // readline, getline, fmemopen
+#include <stdlib.h> // calloc, realloc
+#include <string.h> // strerror, strcmp, strcpy, strdup, strlen
 
-#include <unistd.h> // getcwd
+#include <fcntl.h> // fcntl, FD_CLOEXEC
+#include <poll.h> // poll
+#include <unistd.h> // getcwd, getopt, isatty, lseek
 
-#include <readline/readline.h> // readline, rl_complete
+#include <readline/readline.h> // rl_callback_*, rl_complete
 #include <readline/history.h> // add_history
 
-#include "signals.h" // initialize_signal_handling, sig_flags...
+#include "signals.h" // initialize_signal_handling, signal_fd, take_signal...
 #include "ds/proc.h" // proc, job etc.
-#include "execute.h" // launch_job, initialize_builtins
+#include "execute.h" // initialize_builtins
+#include "interp.h" // run_jobs
 #include "jobs.h" // initialize_job_control, report_job_status
-#include "lexer.h" // YY_BUFFER_STATE, yy_delete_buffer, yy_scan_string
-#include "macros.h" // Stopif, Free
-#include "parser.h" // yyparse
+#include "macros.h" // Stopif, Err_msg, Assert_alloc, Cleanup, Free
+#include "parse_cache.h" // initialize_parse_cache, parse_line
+#include "scheduler.h" // join_jobserver, initialize_scheduler...
+#include "variables.h" // initialize_variables, get_var
 
 #define MAX_PROMPT_LEN 1024
 #define HIST_FILE ".marcel.hist"
+// Buffer size for scripts read from their own file descriptor
+#define SCRIPT_BUF_SIZE (64 * 1024)
 int exit_code;
+// Lines read so far of a compound command or quote that isn't finished
+static char *pending;
 
-static char *saved_line;
-static int saved_point;
-static inline int restore_buffer(void);
+// Set by handle_line when the user ends input
+static bool input_done;
+static inline void prepare_for_input(void);
 static inline void prepare_for_processing(void);
 static inline void gen_prompt(char *buf);
-static inline char *path_concat(char *dir, char *file);
-static inline char *get_input(void);
-
-// This has to ba a macro because sigsetjmp is picky about the its stack frame
-// it returns into
-// Turns on asynchronous handling for SIGCHLD and is the destination for the
-// sigsetjmp calls in the handler. When returning from longjmp, ensures
-// readline's temporary variables are cleaned up. Additionally, informs signal
-// handler that it should longjmp out
-#define prepare_for_input()                                             \
-    do {                                                                \
-        sig_handle(SIGCHLD);                                            \
-        /* siglongjmp from signal handler returns here */               \
-        while (sigsetjmp(sigbuf, 1)) {                                  \
-            sig_flags &= ~WAITING_FOR_INPUT;                            \
-            if (!(sig_flags & NO_RESTORE)) {                            \
-                saved_line  = rl_copy_text(0, rl_end);                  \
-                saved_point = rl_point;                                 \
-                rl_pre_input_hook = restore_buffer;                     \
-                rl_replace_line("",0);                                  \
-                rl_redisplay();                                         \
-            }                                                           \
-            putchar('\n');                                              \
-            sig_flags &= ~NO_RESTORE;                                   \
-        }                                                               \
-        run_queued_signals();                                           \
-        sig_flags |= WAITING_FOR_INPUT;                                 \
-    } while (false)
-
-int main(void)
+static inline char *path_concat(char const *dir, char const *file);
+static void handle_line(char *line);
+static void handle_signals(void);
+static void run_line(char *line);
+static void end_input(void);
+static void run_interactive(void);
+static void run_script(FILE *in);
+
+int main(int argc, char *argv[])
 {
+    // Before anything is opened in place of the jobserver's descriptors
+    join_jobserver();
+
+    char *cmd_str = NULL;
+    bool parse_stats = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:s")) != -1) {
+        switch (opt) {
+        case 'c':
+            cmd_str = optarg;
+            break;
+        case 's':
+            // Show how the cache of parsed lines did on exit
+            parse_stats = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-s] [-c STRING | FILE]\n", NAME);
+            return M_FAILED_INIT;
+        }
+    }
+
+    // Anything other than a terminal on stdin is read as a script
+    FILE *script = NULL;
+    if (cmd_str) {
+        // fmemopen can't open an empty buffer, so there is nothing to run
+        if (!*cmd_str) {
+            return M_SUCCESS;
+        }
+        script = fmemopen(cmd_str, strlen(cmd_str), "r");
+        Stopif(!script, return M_FAILED_IO, "%s", strerror(errno));
+    } else if (optind < argc) {
+        script = fopen(argv[optind], "r");
+        Stopif(!script, return M_FAILED_IO, "%s: %s", argv[optind],
+               strerror(errno));
+        // Don't leak the script into the commands it runs
+        fcntl(fileno(script), F_SETFD, FD_CLOEXEC);
+    } else if (!isatty(STDIN_FILENO)) {
+        script = stdin;
+    }
+
     Stopif(!initialize_builtins(), return M_FAILED_INIT,
            "Could not initialize builtin commands");
-    Stopif(!initialize_job_control(), return M_FAILED_INIT,
+    initialize_variables();
+    Stopif(!initialize_job_control(!script), return M_FAILED_INIT,
            "Could not initialize job control");
     initialize_signal_handling();
+    initialize_scheduler();
+    Stopif(!initialize_parse_cache(parse_stats), return M_FAILED_INIT,
+           "Could not initialize the parser");
 
+    if (script) {
+        run_script(script);
+        if (script != stdin) {
+            fclose(script);
+        }
+        // Every job of the script gets to start, even past its end
+        flush_waiting_jobs();
+    } else {
+        run_interactive();
+    }
+    return exit_code;
+}
+
+// Parse and launch a single line of input. A line ending inside a compound
+// command or a quote is kept until the lines after it complete it
+static void run_line(char *line)
+{
+    char *text = line;
+    if (pending) {
+        size_t len = strlen(pending);
+        text = realloc(pending, len + strlen(line) + 2);
+        Assert_alloc(text);
+        text[len] = '\n';
+        strcpy(text + len + 1, line);
+        pending = NULL;
+    }
+
+    bool more = false;
+    job *j = parse_line(text, &more);
+    if (more) {
+        pending = text == line ? strdup(line) : text;
+        Assert_alloc(pending);
+        return;
+    }
+    if (text != line) {
+        Free(text);
+    }
+    if (!j || !j->valid) {
+        Cleanup(j, free_single_job);
+        exit_code = report_job_status();
+        run_waiting_jobs();
+        return;
+    }
+    run_jobs(j);
+}
+
+// Report a compound command or quote left unfinished at the end of input
+static void end_input(void)
+{
+    if (pending) {
+        job *j = parse_line(pending, NULL);
+        Cleanup(j, free_job_list);
+        Free(pending);
+        exit_code = 2;
+    }
+}
+
+// Read-eval loop for terminals: an event loop waiting on both the terminal
+// (fed to readline's callback interface) and the signal pipe, so that job
+// notifications are printed above the line being edited without disturbing it
+static void run_interactive(void)
+{
     // Use tab for shell completion
     rl_bind_key('\t', rl_complete);
-    rl_set_signals();
+    // Signals are ours to handle (readline still tracks the window size)
+    rl_catch_signals = 0;
 
     // Setup history
-    char *home = getenv("HOME");
+    char const *home = get_var("HOME");
     char *hist_path = path_concat(home, HIST_FILE);
     read_history(hist_path);
 
-    // buffer for stdin
-    char *line = NULL;
-
     prepare_for_input();
-    while ((line = get_input())) {
-        prepare_for_processing();
-
-        job *j = new_job();
-        j->name = strdup(line);
-        Assert_alloc(j->name);
-
-        add_history(line);
-        YY_BUFFER_STATE b = yy_scan_string(line);
-
-        if (!yyparse(j) && j->valid) {
-            register_job(j);
-            launch_job(j);
-        } else {
-            Cleanup(j, free_single_job);
+    struct pollfd fds[] = {
+        {.fd = STDIN_FILENO, .events = POLLIN},
+        {.fd = signal_fd(), .events = POLLIN},
+    };
+    while (!input_done) {
+        if (poll(fds, Arr_len(fds), -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            Err_msg("poll: %s", strerror(errno));
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            handle_signals();
+        }
+        if (fds[0].revents) {
+            rl_callback_read_char();
         }
-
-        Cleanup(b, yy_delete_buffer);
-        Free(line);
-        exit_code = report_job_status();
-        prepare_for_input();
     }
 
     write_history(hist_path);
-    free(hist_path);
-    return exit_code;
+    Free(hist_path);
 }
 
+// Called by readline with each line entered, NULL on EOF
+static void handle_line(char *line)
+{
+    if (!line) {
+        rl_callback_handler_remove();
+        end_input();
+        input_done = true;
+        return;
+    }
+    prepare_for_processing();
+    add_history(line);
+    run_line(line);
+    Free(line);
+    prepare_for_input();
+}
 
-// For symmetry with prepare_for_input. Turns off async handling for SIGCHLD
-// and informs signal handler that it shouldn't longjmp out
-static inline void prepare_for_processing(void)
+// Deal with the signals that arrived while waiting for input
+static void handle_signals(void)
 {
-    sig_flags &= ~WAITING_FOR_INPUT;
-    sig_default(SIGCHLD);
+    drain_signal_fd();
+    char prompt_buf[MAX_PROMPT_LEN] = {0};
+    if (take_signal(SIGINT)) {
+        // Throw the line away and start over on a new one
+        rl_free_line_state();
+        rl_callback_sigcleanup();
+        rl_replace_line("", 0);
+        rl_crlf();
+        rl_on_new_line();
+        Free(pending);
+        exit_code = M_SIGINT;
+        gen_prompt(prompt_buf);
+        rl_set_prompt(prompt_buf);
+        rl_redisplay();
+    }
+    if (take_signal(SIGCHLD)) {
+        // Print notifications where the prompt was and redraw it, along with
+        // whatever has been typed so far, below them
+        int saved_point = rl_point;
+        rl_clear_visible_line();
+        fflush(rl_outstream);
+        // Background jobs don't change $?
+        report_job_status();
+        run_waiting_jobs();
+        gen_prompt(prompt_buf);
+        rl_set_prompt(prompt_buf);
+        rl_point = saved_point;
+        rl_forced_update_display();
+    }
+}
+// Read-eval loop for scripts. Lines are read straight from a buffered stream
+// with no prompt, history or signal juggling in between
+static void run_script(FILE *in)
+{
+    // Commands run from a script on stdin share our read offset, so we can't
+    // buffer past the current line when they run. Unseekable input has to be
+    // read unbuffered, seekable input is rewound to the line end before each
+    // command (which glibc's fflush does for input streams)
+    bool shared = fileno(in) == STDIN_FILENO;
+    bool seekable = lseek(fileno(in), 0, SEEK_CUR) != -1;
+    if (shared && !seekable) {
+        setvbuf(in, NULL, _IONBF, 0);
+    } else if (!shared) {
+        setvbuf(in, NULL, _IOFBF, SCRIPT_BUF_SIZE);
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, in)) != -1) {
+        if (len && line[len - 1] == '\n') {
+            line[len - 1] = '\0';
+        }
+        if (shared && seekable) {
+            fflush(in);
+        }
+        run_line(line);
+    }
+    Free(line);
+    end_input();
 }
 
 
-// Prints prompt and returns line entered by user. Returned string must be
-// freed. Returns NULL on EOF
-static inline char *get_input(void)
+// Turns on asynchronous handling for SIGCHLD and prints the prompt. A SIGINT
+// that arrived while the last line ran is only reflected in the exit code
+static inline void prepare_for_input(void)
 {
+    drain_signal_fd();
+    if (take_signal(SIGINT)) {
+        exit_code = M_SIGINT;
+    }
+    sig_handle(SIGCHLD);
+
     char prompt_buf[MAX_PROMPT_LEN] = {0};
     gen_prompt(prompt_buf);
-    return readline(prompt_buf);
+    rl_callback_handler_install(prompt_buf, handle_line);
+}
+
+// Gives the terminal back to the job about to run and turns off async
+// handling for SIGCHLD (run_line reports on jobs itself)
+static inline void prepare_for_processing(void)
+{
+    rl_callback_handler_remove();
+    sig_default(SIGCHLD);
+    take_signal(SIGCHLD);
 }
 
 // Creates shell prompt based on username and current directory
 static inline void gen_prompt(char *buf)
 {
-    char *user = getenv("USER");
+    // The lines after the first of a compound command
+    if (pending) {
+        snprintf(buf, MAX_PROMPT_LEN, "> ");
+        return;
+    }
+    char const *user = get_var("USER");
     char *dir = getcwd(NULL, 1024);
     char sym = (strcmp(user, "root")) ? '$' : '#';
     snprintf(buf, MAX_PROMPT_LEN, "%-3d [%s:%s] %c ", (unsigned char) exit_code,
@@ -150,25 +330,7 @@ static inline void gen_prompt(char *buf)
     Free(dir);
 }
 
-// Restores the user's input to readline's buffer
-static inline int restore_buffer(void)
-{
-    // Temporarily block signals;
-    sigset_t new;
-    sigfillset(&new);
-    sigset_t old = sig_block(new);
-    rl_replace_line(saved_line, 0);
-    rl_point = saved_point;
-    rl_redisplay();
-    saved_point = 0;
-    Free(saved_line);
-    rl_pre_input_hook = NULL;
-    // Restore signal mask
-    sig_setmask(old);
-    return 0;
-}
-
-static inline char *path_concat(char *dir, char *file)
+static inline char *path_concat(char const *dir, char const *file)
 {
     size_t dlen = strlen(dir);
     size_t len = dlen + strlen(file) + 2;
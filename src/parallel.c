@@ -0,0 +1,749 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// parallel: run a command template once per input with up to N jobs at a
+// time. Every run is a background job of its own in the job table, launched
+// with try_launch_job and reaped with reap_job, so job control and the job
+// limit apply to it like to any other job. Their output goes through a pipe
+// each, so that it can be written out whole when the job completes (or a
+// line at a time)
+//
+// xargs: run a command with as many inputs as arguments as the system takes,
+// as few times as possible. Batches are launched as soon as they are full,
+// while the rest of the input is still being read
+
+// pipe2, F_DUPFD_CLOEXEC
+#define _GNU_SOURCE
+
+#include <errno.h> // errno
+#include <limits.h> // _POSIX_ARG_MAX
+#include <stdio.h> // fdopen, getline, dprintf
+#include <stdlib.h> // calloc, realloc, strtoul
+#include <string.h> // strcmp, strstr, strerror
+
+#include <fcntl.h> // fcntl, O_CLOEXEC
+#include <poll.h> // poll
+#include <unistd.h> // pipe2, read, write, close, sysconf
+
+#include "ds/arena.h" // arena_alloc
+#include "ds/proc.h" // proc, job, new_job, new_proc
+#include "ds/vec.h" // vec_append
+#include "jobs.h" // reap_job, signal_job, is_completed, wait_for_change
+#include "macros.h" // Stopif, Assert_alloc, Free
+#include "marcel.h" // M_SIGINT, M_FAILED_EXEC
+#include "parallel.h" // m_parallel, m_xargs
+#include "scheduler.h" // try_launch_job
+#include "signals.h" // interrupt_pending
+#include "variables.h" // get_envp
+
+#define READ_CHUNK (1 << 16)
+// Exit status is the number of failed jobs, up to this (like GNU parallel)
+#define FAILED_MAX 101
+// Room left in argument lists for what exec and the loader add to the stack
+#define ARG_HEADROOM 2048
+// Linux's limit on the length of a single argument (MAX_ARG_STRLEN)
+#define ARG_STRLEN_MAX (32 * 4096)
+
+// A slot running one job
+typedef struct worker {
+    job *j; // Job running in the slot, NULL if it is free
+    int out; // Read end of the job's stdout
+    char *buf; // Output of the job not written out yet
+    size_t len;
+    size_t cap;
+} worker;
+
+// Where the inputs come from: the arguments after ::: or lines of a stream
+typedef struct inputs {
+    char **args;
+    FILE *in;
+    char *line;
+    size_t cap;
+} inputs;
+
+typedef struct failure {
+    char *name; // Command line of the job
+    int status;
+} failure;
+
+// Return the next input, NULL when there are no more
+static char const *next_input(inputs *in)
+{
+    if (!in->in) {
+        return *in->args ? *in->args++ : NULL;
+    }
+    ssize_t len = getline(&in->line, &in->cap, in->in);
+    if (len == -1) {
+        return NULL;
+    }
+    if (len && in->line[len - 1] == '\n') {
+        in->line[len - 1] = '\0';
+    }
+    return in->line;
+}
+
+// Copy tmpl into a, with every {} replaced by input
+static char *expand_arg(char const *tmpl, char const *input, arena *a)
+{
+    size_t n_braces = 0;
+    for (char const *s = tmpl; (s = strstr(s, "{}")); s += 2) {
+        n_braces++;
+    }
+    size_t input_len = strlen(input);
+    char *ret = arena_alloc(strlen(tmpl) + n_braces * input_len + 1, a);
+    char *dst = ret;
+    for (char const *s = tmpl; *s; ) {
+        if (s[0] == '{' && s[1] == '}') {
+            memcpy(dst, input, input_len);
+            dst += input_len;
+            s += 2;
+        } else {
+            *dst++ = *s++;
+        }
+    }
+    *dst = '\0';
+    return ret;
+}
+
+// Return a descriptor for a job to use in place of fd, which the job owns.
+// Returns 0 (no redirection) if fd is the standard descriptor std already
+static int job_fd(int fd, int std)
+{
+    if (fd == std) {
+        return 0;
+    }
+    int ret = fcntl(fd, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+    return ret == -1 ? 0 : ret;
+}
+
+// Build a background job of a single proc with no arguments yet, reading
+// /dev/null and writing to out and err (see job_fd)
+static job *new_run_job(int out, int err)
+{
+    job *j = new_job();
+    proc *p = new_proc(j->mem);
+    vec_append(&p, sizeof p, (vec *) &j->procs);
+    j->bkg = true;
+    j->quiet = true;
+    j->io[STDIN_FILENO] = (proc_io) {.path = "/dev/null", .oflag = O_RDONLY};
+    j->io[STDOUT_FILENO].fd = out;
+    j->io[STDERR_FILENO].fd = err;
+    return j;
+}
+
+// Name j after the arguments of its proc so far, followed by suffix
+static void name_job(job *j, char const *suffix)
+{
+    char **argv = j->procs[0]->argv;
+    size_t name_len = strlen(suffix) + 1;
+    for (char **arg = argv; *arg; arg++) {
+        name_len += strlen(*arg) + 1;
+    }
+    j->name = arena_alloc(name_len, j->mem);
+    char *dst = j->name;
+    for (char **arg = argv; *arg; arg++) {
+        size_t len = strlen(*arg);
+        memcpy(dst, *arg, len);
+        dst += len;
+        *dst++ = ' ';
+    }
+    if (dst != j->name) {
+        dst--;
+    }
+    strcpy(dst, suffix);
+}
+
+// Free j, which was never launched, along with the descriptors it owns
+static void discard_job(job *j)
+{
+    for (size_t i = 0; i < Arr_len(j->io); i++) {
+        if (!j->io[i].path && j->io[i].fd) {
+            close(j->io[i].fd);
+        }
+    }
+    free_single_job(j);
+}
+
+// Build the job running tmpl for input, with its stdout going to out and its
+// stderr to err. The input is appended to the arguments if tmpl has no {}
+static job *new_input_job(char **tmpl, size_t n_tmpl, bool braces,
+                          char const *input, int out, int err)
+{
+    job *j = new_run_job(out, err);
+    proc *p = j->procs[0];
+    for (size_t i = 0; i < n_tmpl; i++) {
+        char *arg = expand_arg(tmpl[i], input, j->mem);
+        vec_append(&arg, sizeof arg, (vec *) &p->argv);
+    }
+    if (!braces) {
+        char *arg = arena_strdup(input, j->mem);
+        vec_append(&arg, sizeof arg, (vec *) &p->argv);
+    }
+    name_job(j, "");
+    return j;
+}
+
+static int write_all(int fd, char const *s, size_t n)
+{
+    while (n) {
+        ssize_t w = write(fd, s, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        s += w;
+        n -= w;
+    }
+    return 0;
+}
+
+// Write out the buffered output of w, only up to its last complete line
+// unless all is set
+static void flush_output(worker *w, int fd, bool all)
+{
+    size_t n = w->len;
+    if (!all) {
+        while (n && w->buf[n - 1] != '\n') {
+            n--;
+        }
+    }
+    if (!n) {
+        return;
+    }
+    write_all(fd, w->buf, n);
+    memmove(w->buf, w->buf + n, w->len - n);
+    w->len -= n;
+}
+
+// Read what the job of w wrote. Returns false once it closed its stdout
+static bool read_output(worker *w)
+{
+    if (w->cap - w->len < READ_CHUNK) {
+        w->cap = w->len + READ_CHUNK;
+        w->buf = realloc(w->buf, w->cap);
+        Assert_alloc(w->buf);
+    }
+    ssize_t n = read(w->out, w->buf + w->len, READ_CHUNK);
+    if (n < 0 && errno == EINTR) {
+        return true;
+    }
+    if (n <= 0) {
+        return false;
+    }
+    w->len += n;
+    return true;
+}
+
+// parallel [-j N] [--line-buffer] CMD [ARG...] [::: INPUT...]
+// Run CMD once per INPUT (or line of stdin), with every {} in its arguments
+// replaced by the input (or the input as last argument if there is no {}),
+// N at a time (default: one per CPU). The output of each job is written out
+// when it completes, or line by line with --line-buffer. Returns the number
+// of jobs that failed
+int m_parallel(proc const *p)
+{
+    size_t n_workers = 0;
+    bool line_buffer = false;
+    char **args = p->argv + 1;
+    for (; *args && **args == '-'; args++) {
+        char const *n = NULL;
+        if (strcmp(*args, "-j") == 0) {
+            n = *++args;
+        } else if (strncmp(*args, "-j", 2) == 0) {
+            n = *args + 2;
+        } else if (strcmp(*args, "--line-buffer") == 0) {
+            line_buffer = true;
+            continue;
+        } else if (strcmp(*args, "--") == 0) {
+            args++;
+            break;
+        }
+        char *end = NULL;
+        if (n) {
+            n_workers = strtoul(n, &end, 10);
+        }
+        Stopif(!n || *end || end == n || !n_workers, return 2,
+               "usage: parallel [-j N] [--line-buffer] CMD [ARG...] "
+               "[::: INPUT...]");
+    }
+
+    char **tmpl = args;
+    size_t n_tmpl = 0;
+    bool braces = false;
+    for (; tmpl[n_tmpl] && strcmp(tmpl[n_tmpl], ":::") != 0; n_tmpl++) {
+        braces |= strstr(tmpl[n_tmpl], "{}") != NULL;
+    }
+    Stopif(!n_tmpl, return 2, "parallel: no command given");
+
+    inputs in = {0};
+    if (tmpl[n_tmpl]) {
+        in.args = tmpl + n_tmpl + 1;
+    } else {
+        int fd = dup(p->fds[0]);
+        in.in = fd == -1 ? NULL : fdopen(fd, "r");
+        Stopif(!in.in, return 1, "parallel: %s", strerror(errno));
+    }
+    if (!n_workers) {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_workers = n_cpus > 0 ? n_cpus : 1;
+    }
+
+    worker *workers = calloc(n_workers, sizeof *workers);
+    struct pollfd *fds = calloc(n_workers, sizeof *fds);
+    size_t *polled = calloc(n_workers, sizeof *polled);
+    failure *failed = vec_alloc(sizeof *failed);
+    Assert_alloc(workers && fds && polled);
+
+    size_t n_running = 0;
+    size_t n_jobs = 0;
+    bool inputs_done = false;
+    bool interrupted = false;
+    // Job for the next input, built but waiting for a slot, and its stdout
+    job *pending = NULL;
+    int pending_out = -1;
+    while (true) {
+        // Keep every worker busy, as far as the job limit allows
+        for (size_t i = 0; i < n_workers && !interrupted; i++) {
+            if (workers[i].j) {
+                continue;
+            }
+            char const *input = pending || inputs_done ? NULL : next_input(&in);
+            if (input) {
+                int pipe_fd[2];
+                if (pipe2(pipe_fd, O_CLOEXEC) == -1) {
+                    Err_msg("parallel: %s", strerror(errno));
+                    inputs_done = true;
+                    break;
+                }
+                // The job owns (and closes) its descriptors
+                pending = new_input_job(tmpl, n_tmpl, braces, input,
+                                        pipe_fd[1], job_fd(p->fds[2], 2));
+                pending_out = pipe_fd[0];
+            } else if (!pending) {
+                inputs_done = true;
+                break;
+            }
+            if (!try_launch_job(pending)) {
+                break;
+            }
+            workers[i].j = pending;
+            workers[i].out = pending_out;
+            pending = NULL;
+            n_running++;
+            n_jobs++;
+        }
+        if (!n_running) {
+            // Every slot may be taken by jobs that aren't ours
+            if (pending && !interrupted) {
+                interrupted = !wait_for_change();
+                continue;
+            }
+            break;
+        }
+
+        size_t n_fds = 0;
+        for (size_t i = 0; i < n_workers; i++) {
+            if (workers[i].j) {
+                fds[n_fds] = (struct pollfd) {.fd = workers[i].out,
+                                              .events = POLLIN};
+                polled[n_fds++] = i;
+            }
+        }
+        if (poll(fds, n_fds, -1) == -1) {
+            if (errno == EINTR && interrupt_pending() && !interrupted) {
+                // Stop starting jobs and pass ^C on to the running ones
+                interrupted = true;
+                for (size_t i = 0; i < n_workers; i++) {
+                    if (workers[i].j) {
+                        signal_job(workers[i].j, SIGINT);
+                    }
+                }
+            }
+            continue;
+        }
+
+        for (size_t i = 0; i < n_fds; i++) {
+            worker *w = &workers[polled[i]];
+            if (!fds[i].revents) {
+                continue;
+            }
+            if (read_output(w)) {
+                if (line_buffer) {
+                    flush_output(w, p->fds[1], false);
+                }
+                continue;
+            }
+            // The job closed its stdout, it should be exiting
+            close(w->out);
+            failure f = {.name = strdup(w->j->name)};
+            Assert_alloc(f.name);
+            f.status = reap_job(w->j);
+            flush_output(w, p->fds[1], true);
+            if (f.status) {
+                vec_append(&f, sizeof f, (vec *) &failed);
+            } else {
+                Free(f.name);
+            }
+            w->j = NULL;
+            n_running--;
+        }
+    }
+
+    if (pending) {
+        close(pending_out);
+        discard_job(pending);
+    }
+
+    size_t n_failed = vec_len(failed);
+    for (size_t i = 0; i < n_failed; i++) {
+        dprintf(p->fds[2], "parallel: exit %d: %s\n", failed[i].status,
+                failed[i].name);
+        Free(failed[i].name);
+    }
+    if (n_failed) {
+        dprintf(p->fds[2], "parallel: %zu of %zu jobs failed\n", n_failed,
+                n_jobs);
+    }
+
+    for (size_t i = 0; i < n_workers; i++) {
+        Free(workers[i].buf);
+    }
+    Free(workers);
+    Free(fds);
+    Free(polled);
+    vec_free(failed);
+    if (in.in) {
+        fclose(in.in);
+        Free(in.line);
+    }
+    if (interrupted) {
+        return M_SIGINT;
+    }
+    return n_failed < FAILED_MAX ? (int) n_failed : FAILED_MAX;
+}
+
+// An input item of xargs, read into a buffer reused from one to the next
+typedef struct item {
+    char *s;
+    size_t len;
+    size_t cap;
+} item;
+
+// Batches of xargs running in the background
+typedef struct batches {
+    job **running;
+    size_t max_running; // 0 if there is no limit
+    int status; // Exit status of xargs so far
+    bool stop; // Whether to stop launching batches
+} batches;
+
+static void push_char(item *it, char c)
+{
+    if (it->len + 1 >= it->cap) {
+        it->cap = it->cap ? 2 * it->cap : 64;
+        it->s = realloc(it->s, it->cap);
+        Assert_alloc(it->s);
+    }
+    it->s[it->len++] = c;
+}
+
+// Read the next item from in into it. Items are separated by NULs if nul is
+// set, otherwise by blanks and newlines, with quotes and backslashes as in
+// POSIX xargs. Returns 1 for an item, 0 at the end of the input, -1 on error
+static int next_item(FILE *in, bool nul, item *it)
+{
+    it->len = 0;
+    int c = getc(in);
+    if (nul) {
+        if (c == EOF) {
+            return 0;
+        }
+        for (; c != EOF && c != '\0'; c = getc(in)) {
+            push_char(it, c);
+        }
+        push_char(it, '\0');
+        it->len--;
+        return 1;
+    }
+
+    while (c == ' ' || c == '\t' || c == '\n') {
+        c = getc(in);
+    }
+    if (c == EOF) {
+        return 0;
+    }
+    int quote = 0;
+    for (; c != EOF; c = getc(in)) {
+        if (quote && c == quote) {
+            quote = 0;
+        } else if (quote) {
+            Stopif(c == '\n', return -1, "xargs: unmatched %s quote",
+                   quote == '\'' ? "single" : "double");
+            push_char(it, c);
+        } else if (c == '\'' || c == '"') {
+            quote = c;
+        } else if (c == '\\') {
+            c = getc(in);
+            if (c == EOF) {
+                break;
+            }
+            push_char(it, c);
+        } else if (c == ' ' || c == '\t' || c == '\n') {
+            break;
+        } else {
+            push_char(it, c);
+        }
+    }
+    Stopif(quote, return -1, "xargs: unmatched %s quote",
+           quote == '\'' ? "single" : "double");
+    push_char(it, '\0');
+    it->len--;
+    return 1;
+}
+
+// Bytes an argument takes up in the argument list of exec: the string and
+// its pointer
+static size_t arg_cost(size_t len)
+{
+    return len + 1 + sizeof(char *);
+}
+
+// Bytes left for the arguments of a command, out of what exec takes for
+// arguments and environment together. Capped at max_size if it is not 0
+static size_t arg_budget(size_t max_size)
+{
+    long arg_max = sysconf(_SC_ARG_MAX);
+    size_t ret = arg_max > 0 ? (size_t) arg_max : _POSIX_ARG_MAX;
+    size_t used = ARG_HEADROOM + sizeof(char *);
+    for (char **e = get_envp(); *e; e++) {
+        used += arg_cost(strlen(*e));
+    }
+    ret = ret > used ? ret - used : 0;
+    return max_size && max_size < ret ? max_size : ret;
+}
+
+// Exit status of xargs for a command that returned status
+static int xargs_status(int status)
+{
+    if (!status) {
+        return 0;
+    }
+    if (status == M_FAILED_EXEC) {
+        return 127;
+    }
+    if (status == M_SIGINT) {
+        return 125;
+    }
+    return status == 255 ? 124 : 123;
+}
+
+// Reap the batches that completed, folding their status into that of xargs.
+// A batch exiting 255, killed by a signal or that could not be run stops
+// xargs, like in POSIX
+static void reap_batches(batches *b)
+{
+    size_t n_running = vec_len(b->running);
+    for (size_t i = 0; i < n_running; ) {
+        job *j = b->running[i];
+        if (!is_completed(j)) {
+            i++;
+            continue;
+        }
+        int status = xargs_status(reap_job(j));
+        if (status > b->status) {
+            b->status = status;
+        }
+        b->stop |= status == 124 || status == 125 || status == 127;
+        b->running[i] = b->running[--n_running];
+    }
+    vec_setlen(n_running, b->running);
+}
+
+// Wait for a job to change state and reap the batches that completed. On ^C,
+// pass it on to the running batches and stop launching new ones
+static void wait_batches(batches *b)
+{
+    // Batches that could not be started are done without a child to wait on
+    size_t n_running = vec_len(b->running);
+    reap_batches(b);
+    if (vec_len(b->running) < n_running) {
+        return;
+    }
+    if (!wait_for_change() && interrupt_pending() && !b->stop) {
+        b->stop = true;
+        b->status = M_SIGINT;
+        size_t n_running = vec_len(b->running);
+        for (size_t i = 0; i < n_running; i++) {
+            signal_job(b->running[i], SIGINT);
+        }
+    }
+    reap_batches(b);
+}
+
+// Launch j once fewer than the max number of batches are running and the
+// job layer has a slot for it. j is discarded if xargs stops before that
+static void launch_batch(job *j, batches *b)
+{
+    reap_batches(b);
+    while (!b->stop) {
+        bool room = !b->max_running || vec_len(b->running) < b->max_running;
+        if (room && try_launch_job(j)) {
+            vec_append(&j, sizeof j, (vec *) &b->running);
+            return;
+        }
+        wait_batches(b);
+    }
+    discard_job(j);
+}
+
+// Build a batch job running the command tmpl, with no inputs yet
+static job *new_batch_job(char **tmpl, proc const *p)
+{
+    job *j = new_run_job(job_fd(p->fds[1], 1), job_fd(p->fds[2], 2));
+    proc *batch = j->procs[0];
+    for (char **arg = tmpl; *arg; arg++) {
+        char *copy = arena_strdup(*arg, j->mem);
+        vec_append(&copy, sizeof copy, (vec *) &batch->argv);
+    }
+    name_job(j, " ...");
+    return j;
+}
+
+// Parse the number following option opt (e.g. "-n") in *args, either in the
+// same argument or the next one. Returns false if it isn't one
+static bool option_number(char ***args, char const *opt, size_t *n)
+{
+    char const *s = **args + strlen(opt);
+    if (!*s) {
+        s = *++*args;
+    }
+    char *end;
+    if (!s || !*s) {
+        return false;
+    }
+    *n = strtoul(s, &end, 10);
+    return !*end;
+}
+
+// xargs [-0] [-r] [-n MAX] [-P N] [-s SIZE] [CMD [ARG...]]
+// Run CMD (default: echo) with ARGs and as many items read from stdin as
+// arguments as fit in the limit of the system (or SIZE bytes), or MAX items,
+// N commands at a time (default 1, 0 for no limit). Items are separated by
+// blanks and newlines, or by NULs with -0. CMD runs once even with no items
+// unless -r is given. Returns 123 if a command failed, 124 if one returned
+// 255, 125 if one was killed and 127 if one could not be run
+int m_xargs(proc const *p)
+{
+    bool nul = false;
+    bool no_empty = false;
+    size_t max_items = 0;
+    size_t max_size = 0;
+    batches b = {.max_running = 1};
+    char **args = p->argv + 1;
+    for (; *args && **args == '-'; args++) {
+        bool ok = true;
+        if (strcmp(*args, "-0") == 0) {
+            nul = true;
+        } else if (strcmp(*args, "-r") == 0) {
+            no_empty = true;
+        } else if (strncmp(*args, "-n", 2) == 0) {
+            ok = option_number(&args, "-n", &max_items) && max_items;
+        } else if (strncmp(*args, "-P", 2) == 0) {
+            ok = option_number(&args, "-P", &b.max_running);
+        } else if (strncmp(*args, "-s", 2) == 0) {
+            ok = option_number(&args, "-s", &max_size) && max_size;
+        } else if (strcmp(*args, "--") == 0) {
+            args++;
+            break;
+        } else {
+            ok = false;
+        }
+        Stopif(!ok, return 1, "usage: xargs [-0] [-r] [-n MAX] [-P N] "
+               "[-s SIZE] [CMD [ARG...]]");
+    }
+    static char *default_cmd[] = {"echo", NULL};
+    char **tmpl = *args ? args : default_cmd;
+
+    size_t budget = arg_budget(max_size);
+    for (char **arg = tmpl; *arg; arg++) {
+        size_t cost = arg_cost(strlen(*arg));
+        budget = budget > cost ? budget - cost : 0;
+    }
+    Stopif(!budget, return 1, "xargs: command too long");
+
+    int fd = dup(p->fds[0]);
+    FILE *in = fd == -1 ? NULL : fdopen(fd, "r");
+    Stopif(!in, return 1, "xargs: %s", strerror(errno));
+
+    b.running = vec_alloc(sizeof *b.running);
+    item it = {0};
+    job *batch = NULL;
+    size_t n_items = 0;
+    size_t left = 0;
+    bool any_items = false;
+    int got = 0;
+    while (!b.stop && (got = next_item(in, nul, &it)) == 1) {
+        size_t cost = arg_cost(it.len);
+        if (cost > budget || it.len >= ARG_STRLEN_MAX) {
+            Err_msg("xargs: argument too long");
+            got = -1;
+            break;
+        }
+        if (batch && cost > left) {
+            launch_batch(batch, &b);
+            batch = NULL;
+        }
+        if (!batch) {
+            batch = new_batch_job(tmpl, p);
+            n_items = 0;
+            left = budget;
+        }
+        // The items go straight into the argument list of the batch
+        proc *batch_proc = batch->procs[0];
+        char *arg = arena_alloc(it.len + 1, batch->mem);
+        memcpy(arg, it.s, it.len + 1);
+        vec_append(&arg, sizeof arg, (vec *) &batch_proc->argv);
+        left -= cost;
+        if (max_items && ++n_items == max_items) {
+            launch_batch(batch, &b);
+            batch = NULL;
+        }
+        any_items = true;
+    }
+
+    if (got == -1) {
+        b.stop = true;
+        b.status = 1;
+    }
+    if (!batch && !any_items && !no_empty && !b.stop) {
+        batch = new_batch_job(tmpl, p);
+    }
+    if (batch && !b.stop) {
+        launch_batch(batch, &b);
+    } else if (batch) {
+        discard_job(batch);
+    }
+    while (vec_len(b.running)) {
+        wait_batches(&b);
+    }
+
+    vec_free(b.running);
+    Free(it.s);
+    fclose(in);
+    return b.status;
+}
@@ -0,0 +1,282 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Turns lines of input into jobs. The jobs parsed from the last few lines are
+// kept as templates, so that a line seen again (a repeated command, a line
+// recalled from history, the same $(...) run over and over) is copied rather
+// than lexed and parsed again. Lines are keyed without the blanks around them,
+// which don't change what they parse to unless escaped, and the least
+// recently used one makes room for a new one once the cache is full
+
+#define _GNU_SOURCE // strdup
+
+#include <stdbool.h>
+#include <stdio.h> // dprintf
+#include <stdlib.h> // malloc, atexit
+#include <string.h> // strdup, strlen, strspn, memcpy
+
+#include <time.h> // clock_gettime
+#include <unistd.h> // STDERR_FILENO
+
+#include "ds/hash_table.h" // new_table, add_node, find_node, delete_node
+#include "ds/proc.h" // job, new_job, copy_job_list, name_job_text, SEP_*...
+#include "macros.h" // Assert_alloc, Cleanup, Err_msg, Free
+// parser.h first, lexer.h needs YYSTYPE
+#include "parser.h" // yyparse, parse_state
+#include "lexer.h" // yylex_init, yylex_destroy
+#include "parse_cache.h"
+#include "tokenizer.h" // tokenizer, start_tokenizer, stop_tokenizer
+
+// Number of lines kept
+#define CACHE_SIZE 128
+// Longest line kept. Longer ones are rare, and would take up more memory
+// than the time parsing them again costs
+#define CACHED_LINE_MAX 4096
+
+typedef struct cached_line {
+    char *key; // Line without the blanks around it
+    job *tmpl; // Jobs parsed from it, never expanded or launched
+    long parse_ns; // Time it took to parse
+    struct cached_line *newer;
+    struct cached_line *older;
+} cached_line;
+
+static tokenizer lex;
+static hash_table lines;
+static cached_line *newest;
+static cached_line *oldest;
+static size_t n_cached;
+
+static struct {
+    size_t parsed; // Lines turned into jobs, through the cache or not
+    size_t hits;
+    long parse_ns; // Time spent parsing
+    long saved_ns; // Parse time of the hits, minus the time spent copying
+} stats;
+static bool report_stats;
+
+static void cleanup_parse_cache(void);
+
+// If report is set, how well the cache did is printed to stderr on exit.
+// Returns true on success, false on failure
+bool initialize_parse_cache(bool report)
+{
+    report_stats = report;
+#ifdef USE_FLEX
+    if (yylex_init(&lex.flex)) {
+        return false;
+    }
+#endif
+    lines = new_table(0);
+    return !atexit(cleanup_parse_cache);
+}
+
+static void unlink_line(cached_line *c)
+{
+    if (c->newer) {
+        c->newer->older = c->older;
+    } else {
+        newest = c->older;
+    }
+    if (c->older) {
+        c->older->newer = c->newer;
+    } else {
+        oldest = c->newer;
+    }
+}
+
+static void push_line(cached_line *c)
+{
+    c->newer = NULL;
+    c->older = newest;
+    if (newest) {
+        newest->newer = c;
+    } else {
+        oldest = c;
+    }
+    newest = c;
+}
+
+static void forget_line(cached_line *c)
+{
+    unlink_line(c);
+    delete_node(c->key, NULL, NULL, lines);
+    free_job_list(c->tmpl);
+    Free(c->key);
+    Free(c);
+    n_cached--;
+}
+
+// Print how well the cache does to fd
+static void print_parse_stats(int fd)
+{
+    double hit_rate = stats.parsed ? 100.0 * stats.hits / stats.parsed : 0;
+    dprintf(fd, "lines\t%zu\n", stats.parsed);
+    dprintf(fd, "hits\t%zu (%.1f%%)\n", stats.hits, hit_rate);
+    dprintf(fd, "cached\t%zu/%d\n", n_cached, CACHE_SIZE);
+    dprintf(fd, "parsing\t%.3f ms\n", stats.parse_ns / 1e6);
+    dprintf(fd, "saved\t%.3f ms\n", stats.saved_ns / 1e6);
+}
+
+static void cleanup_parse_cache(void)
+{
+    if (report_stats) {
+        print_parse_stats(STDERR_FILENO);
+    }
+    while (oldest) {
+        forget_line(oldest);
+    }
+    free_table(lines, NULL);
+    if (lex.flex) {
+        yylex_destroy(lex.flex);
+    }
+}
+
+static long now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+// Parse line into its jobs, each linked to the next. Returns NULL on a syntax
+// error, and a job that isn't valid if there is no command. If more is set, a
+// line ending inside a compound command or a quote isn't an error but sets
+// *more instead
+static job *parse(char const *line, bool *more)
+{
+    job *head = NULL;
+    job **tail = &head;
+    unsigned char sep = SEP_SEQ;
+    start_tokenizer(line, &lex);
+    while (sep != SEP_END) {
+        char const *start = lex.cur;
+        job *j = new_job();
+        parse_state ps = {.job = j, .more = more != NULL};
+        if (yyparse(&ps, &lex)) {
+            if (ps.incomplete) {
+                *more = true;
+            }
+            free_single_job(j);
+            Cleanup(head, free_job_list);
+            break;
+        }
+        if (!j->valid) {
+            if (!head) {
+                head = j;
+            } else {
+                free_single_job(j);
+            }
+            // A trailing ';' or '&' is fine, not so a trailing '&&' or '||'
+            if (sep != SEP_SEQ) {
+                Err_msg("syntax error, unexpected end of line after %s",
+                        sep == SEP_AND ? "&&" : "||");
+                Cleanup(head, free_job_list);
+            }
+            break;
+        }
+        // Jobs are named after their part of the line
+        if (j->bkg || j->sep == SEP_END) {
+            name_job_text(j, start, lex.cur);
+        } else {
+            name_job_text(j, start, lex.token);
+        }
+        *tail = j;
+        tail = &j->next;
+        sep = j->sep;
+    }
+    stop_tokenizer(&lex);
+    return head;
+}
+
+// Copy the jobs parsed from key, parsing and caching them if they aren't
+static job *parse_cached(char const *key, bool *more)
+{
+    long start = now_ns();
+    cached_line *c = find_node(key, NULL, lines);
+    if (c) {
+        job *j = copy_job_list(c->tmpl);
+        stats.hits++;
+        stats.saved_ns += c->parse_ns - (now_ns() - start);
+        unlink_line(c);
+        push_line(c);
+        return j;
+    }
+
+    job *tmpl = parse(key, more);
+    long parse_ns = now_ns() - start;
+    stats.parse_ns += parse_ns;
+    // Lines without a command are parsed in no time, and lines that don't
+    // parse must report their error every time
+    if (!tmpl || !tmpl->valid) {
+        return tmpl;
+    }
+    if (n_cached == CACHE_SIZE) {
+        forget_line(oldest);
+    }
+    c = malloc(sizeof *c);
+    Assert_alloc(c);
+    c->key = strdup(key);
+    Assert_alloc(c->key);
+    c->tmpl = tmpl;
+    c->parse_ns = parse_ns;
+    add_node(c->key, c, lines);
+    push_line(c);
+    n_cached++;
+
+    start = now_ns();
+    job *j = copy_job_list(tmpl);
+    stats.saved_ns -= now_ns() - start;
+    return j;
+}
+
+// Parse line into its jobs, each linked to the next and named after its part
+// of the line. Returns NULL on a syntax error (with an error printed), and a
+// job that isn't valid if there is no command. If more isn't NULL, a line
+// ending inside a compound command or a quote sets *more rather than being an
+// error, for the caller to add the next line to it
+job *parse_line(char const *line, bool *more)
+{
+    stats.parsed++;
+    char const *start = line + strspn(line, " \t");
+    size_t len = strlen(start);
+    while (len && (start[len - 1] == ' ' || start[len - 1] == '\t')) {
+        // A blank escaped by the backslashes before it is part of a word
+        size_t bs = 0;
+        while (bs < len - 1 && start[len - 2 - bs] == '\\') {
+            bs++;
+        }
+        if (bs % 2) {
+            break;
+        }
+        len--;
+    }
+
+    job *j;
+    if (len && len <= CACHED_LINE_MAX) {
+        char key[CACHED_LINE_MAX + 1];
+        memcpy(key, start, len);
+        key[len] = '\0';
+        j = parse_cached(key, more);
+    } else {
+        long parse_start = now_ns();
+        j = parse(line, more);
+        stats.parse_ns += now_ns() - parse_start;
+    }
+    return j;
+}
@@ -24,28 +24,26 @@
 #include <unistd.h> // pipe
 
 #include "execute.h" // builtin, lookup_table
+#include "ds/arena.h" // arena
 #include "ds/proc.h" // proc, job
 #include "ds/vec.h" // vec_append
-#include "lexer.h" // yylex (in bison generated code)
 #include "macros.h" // Stopif, Free
 
 #define P_TRUNCATE (O_WRONLY | O_TRUNC | O_CREAT)
 #define P_APPEND (O_WRONLY | O_APPEND | O_CREAT)
-#define P_LAST (p_job->procs[vec_len(p_job->procs)-1])
+#define P_LAST (ps->cur->procs[vec_len(ps->cur->procs)-1])
 
 // I hate to use a macro for this but the lack of code duplication is worth it
 #define Add_io_mod(PATH, FD, OFLAG)                                                                 \
     do {                                                                                            \
-        if (!p_job->io[FD].path) {                                                                  \
-            p_job->io[FD] = (proc_io) {.path = PATH, .oflag = OFLAG};                               \
+        if (!ps->cur->io[FD].path) {                                                                \
+            ps->cur->io[FD] = (proc_io) {.path = PATH, .oflag = OFLAG};                             \
         } else {                                                                                    \
             Err_msg("Taking/sending IO to/from more than one source not supported. "                \
                     "Skipping \"%s\"", PATH);                                                       \
-            Free(PATH);                                                                             \
         }                                                                                           \
     } while (0)
 
-int yyerror (job *w, char const *s);
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wincompatible-pointer-types"
 
@@ -54,50 +52,200 @@ int yyerror (job *w, char const *s);
 // Include marcel.h in .c file as well as header
 %code requires {
     #include "ds/proc.h"
+    #include "tokenizer.h" // tokenizer
+
+    // What a call to yyparse works on: the next job of the line, which may be
+    // a compound command. Everything parsed for it, the jobs inside it
+    // included, is allocated from its arena
+    typedef struct parse_state {
+        job *job; // Job being parsed
+        job *cur; // Job of the pipeline being parsed
+        char const *start; // Start of the pipeline being parsed
+        size_t depth; // Compound commands open
+        bool more; // Whether a line ending inside a compound command can be
+                   // continued with the next one rather than be an error
+        bool incomplete; // Set if it ended there and more is set
+    } parse_state;
+
+    // Jobs of a list, linked through next
+    typedef struct job_list {
+        job *head;
+        job *tail;
+    } job_list;
+}
+
+%code {
+    // Tokens come from the tokenizer, which hands them over to the flex
+    // scanner if it has one
+    #define yylex next_token
+
+    int yyerror (parse_state *ps, tokenizer *lex, char const *s);
+
+    // Start the pipeline the parser is looking at, in the job being parsed at
+    // the top of the line and in a job of its own inside a compound command
+    static void start_pipeline(parse_state *ps, tokenizer const *lex)
+    {
+        ps->cur = ps->depth ? new_inner_job(ps->job) : ps->job;
+        ps->start = lex->token;
+    }
+
+    // Name the job of the pipeline just parsed, inside a compound command,
+    // after its part of the line (parse_line names the others)
+    static void name_pipeline(parse_state *ps, tokenizer const *lex)
+    {
+        if (!ps->depth) {
+            return;
+        }
+        name_job_text(ps->cur, ps->start, lex->token);
+    }
+
+    // End j with the separator sep (the token). Returns false, with an error
+    // printed, if it can't be
+    static bool end_job(job *j, int sep)
+    {
+        j->sep = sep == AND ? SEP_AND : sep == OR ? SEP_OR : SEP_SEQ;
+        j->bkg = sep == BKG;
+        Stopif(j->bkg && j->cmd, return false,
+               "syntax error, compound commands can't run in the background");
+        return true;
+    }
+
+    static compound *new_compound(int type, parse_state *ps)
+    {
+        compound *c = arena_alloc(sizeof *c, ps->job->mem);
+        *c = (compound) {.type = type};
+        return c;
+    }
+
+    // Job of a compound command whose arguments are words it works with
+    static job *new_words(parse_state *ps)
+    {
+        job *j = new_inner_job(ps->job);
+        proc *p = new_proc(j->mem);
+        vec_append(&p, sizeof (proc *), &(j->procs));
+        return j;
+    }
+
+    // Job running the compound command c, at the top of the line or inside
+    // another compound command
+    static job *compound_job(compound *c, parse_state *ps)
+    {
+        job *j = ps->depth ? new_inner_job(ps->job) : ps->job;
+        j->cmd = c;
+        j->valid = true;
+        return j;
+    }
+
+    // Add a branch to the case command c
+    static compound *add_case_item(compound *c, job *patterns, job *body,
+                                   parse_state *ps)
+    {
+        case_item *item = arena_alloc(sizeof *item, ps->job->mem);
+        *item = (case_item) {.patterns = patterns, .body = body};
+        vec_append(&item, sizeof item, &(c->items));
+        return c;
+    }
+
+    static bool is_name(char const *s)
+    {
+        if (!((*s >= 'a' && *s <= 'z') || (*s >= 'A' && *s <= 'Z') || *s == '_')) {
+            return false;
+        }
+        while ((*s >= 'a' && *s <= 'z') || (*s >= 'A' && *s <= 'Z') || *s == '_'
+               || (*s >= '0' && *s <= '9')) {
+            s++;
+        }
+        return !*s;
+    }
 }
 
 %union {
     char *str;
+    int token;
+    job *job;
+    job_list list;
+    compound *cmd;
 }
 
-%token <str> WORD ASSIGN 
+%token <str> WORD ASSIGN TIME
+%token <str> KW_IF "if" KW_THEN "then" KW_ELSE "else" KW_ELIF "elif" KW_FI "fi"
+%token <str> KW_WHILE "while" KW_DO "do" KW_DONE "done" KW_FOR "for" KW_IN "in"
+%token <str> KW_CASE "case" KW_ESAC "esac"
 %token OUT_T OUT_ERR_T OUT_A OUT_ERR_A ERR_T ERR_A IN 
-%token NL PIPE BKG
+%token NL PIPE BKG SEMI AND OR DSEMI RPAREN
+// A quote the line ends inside of, which no rule takes
+%token UNCLOSED "unterminated quote"
 
-%type <str> real_arg
+%type <str> real_arg word keyword
+%type <token> sep end_sep
+%type <job> command pipeline compound_job else_part words patterns
+%type <list> list case_list jobs and_or
+%type <cmd> compound if_clause while_clause for_clause case_clause case_items
+%type <cmd> case_branches
 
 %define parse.error verbose
-%parse-param {job *p_job}
+%define api.pure full
+%parse-param {parse_state *ps} {tokenizer *lex}
+%lex-param {tokenizer *lex}
+
+// Everything parsed for a job, down to the strings, is owned by its arena,
+// which the lexer allocates token strings from
+%initial-action {
+    lex->mem = ps->job->mem;
+    ps->cur = ps->job;
+    ps->depth = 0;
+    ps->incomplete = false;
+}
 
 %%
 
-/*full_line:*/
-    /*envs pipes_line {*/
-        /*// Process has variables set but no command, meaning that its just an assigment*/
-        /*if (!p_job->procs[0]->argv[0]) {*/
-            /*size_t env_len = vec_len(p_job->procs[0]->env);*/
-            /*for (size_t i = 0; i < env_len; i++) {*/
-                /*builtin *b = malloc(sizeof *b);*/
-                /*Assert_alloc(b);*/
-                /*b->type = VAR;*/
-                /*b->var =  p_job->procs[0]->env[i] + strlen(p_job->procs[0]->env[i]) + 1;*/
-                /*add_node(p_job->procs[0]->env[i], b, lookup_table);*/
-                /*Err_msg("Warning: accessing local variables unimplemented");*/
-            /*}*/
-        /*}*/
-    /*}*/
-    /*;*/
-
-pipes_line:
-    pipes io_mods bkg {p_job->valid = true;}
-    | 
+// One job of the line. Parsing stops after what ends it (without looking at
+// the token after that), so the next call picks up the next job
+line:
+    command end
+    |
     ;
 
-bkg:
-    BKG {
-        p_job->bkg = true;
+end:
+    end_sep {
+        if (!end_job(ps->job, $1)) {
+            YYABORT;
+        }
+        YYACCEPT;
     }
-    | 
+    |
+    ;
+
+end_sep:
+    BKG {$$ = BKG;}
+    | SEMI {$$ = SEMI;}
+    | AND {$$ = AND;}
+    | OR {$$ = OR;}
+    ;
+
+command:
+    pipeline
+    | compound_job
+    ;
+
+pipeline:
+    start time pipes io_mods {
+        ps->cur->valid = true;
+        name_pipeline(ps, lex);
+        $$ = ps->cur;
+    }
+    ;
+
+start:
+    {start_pipeline(ps, lex);}
+    ;
+
+// Keyword only in front of a pipeline, anywhere else it is a plain word
+time:
+    TIME {
+        ps->cur->timed = true;
+    }
+    |
     ;
 
 io_mods:
@@ -138,6 +286,8 @@ pipes:
 
 cmd:
    envs WORD args {P_LAST->argv[0] = $2;}
+   // Assignments alone set shell variables (argv[0] stays NULL)
+   | envs ASSIGN {vec_append(&($2), sizeof (char*), &(P_LAST->env));}
    ;
 
 envs:
@@ -145,8 +295,8 @@ envs:
     | { // this is reached only before the first arg of each pipe 
         // e.g. the command:  var=val a b | c d | var2=val2 e f
         //                   ^             ^     ^    <-- reached in those places
-        proc *p = new_proc();
-        vec_append(&p, sizeof (proc *), &(p_job->procs));
+        proc *p = new_proc(ps->cur->mem);
+        vec_append(&p, sizeof (proc *), &(ps->cur->procs));
         char *null = NULL;
         vec_append(&null, sizeof (char *), &(P_LAST->argv));
     }
@@ -157,14 +307,192 @@ args:
     | {}
     ;
 
-// Make things like `echo VAR=VAL` work as expected
-real_arg: WORD {$$ = $1;} | ASSIGN {$$ = $1;}
+// Compound commands, whose jobs end with a separator (a newline among them)
+// before the keyword closing them. Their jobs are parsed once, and the tree
+// they make up is walked each time the command runs (see interp.c)
+compound_job:
+    compound {$$ = compound_job($1, ps);}
+    ;
+
+compound:
+    if_clause
+    | while_clause
+    | for_clause
+    | case_clause
+    ;
+
+open:
+    {ps->depth++;}
+    ;
+
+close:
+    {ps->depth--;}
+    ;
+
+if_clause:
+    KW_IF open list KW_THEN list else_part KW_FI close {
+        $$ = new_compound(CMD_IF, ps);
+        $$->cond = $3.head;
+        $$->body = $5.head;
+        $$->alt = $6;
+    }
+    ;
+
+else_part:
+    KW_ELIF list KW_THEN list else_part {
+        compound *c = new_compound(CMD_IF, ps);
+        c->cond = $2.head;
+        c->body = $4.head;
+        c->alt = $5;
+        $$ = compound_job(c, ps);
+    }
+    | KW_ELSE list {$$ = $2.head;}
+    | {$$ = NULL;}
+    ;
+
+while_clause:
+    KW_WHILE open list KW_DO list KW_DONE close {
+        $$ = new_compound(CMD_WHILE, ps);
+        $$->cond = $3.head;
+        $$->body = $5.head;
+    }
+    ;
+
+for_clause:
+    KW_FOR open WORD linebreak KW_IN words sep linebreak KW_DO list KW_DONE close {
+        Stopif(!is_name($3), YYABORT, "for: %s: not a valid name", $3);
+        $$ = new_compound(CMD_FOR, ps);
+        $$->var = $3;
+        $$->words = $6;
+        $$->body = $10.head;
+    }
+    ;
+
+words:
+    {$$ = new_words(ps);}
+    | words real_arg {
+        vec_append(&($2), sizeof (char*), &($1->procs[0]->argv));
+        $$ = $1;
+    }
+    ;
+
+case_clause:
+    KW_CASE open real_arg linebreak KW_IN linebreak case_items KW_ESAC close {
+        $$ = $7;
+        $$->words = new_words(ps);
+        vec_append(&($3), sizeof (char*), &($$->words->procs[0]->argv));
+    }
+    ;
+
+// The last branch needs no ;; before esac
+case_items:
+    case_branches
+    | case_branches patterns RPAREN linebreak {
+        $$ = add_case_item($1, $2, NULL, ps);
+    }
+    | case_branches patterns RPAREN list {
+        $$ = add_case_item($1, $2, $4.head, ps);
+    }
+    ;
+
+case_branches:
+    {
+        $$ = new_compound(CMD_CASE, ps);
+        $$->items = vec_arena_alloc(4 * sizeof *$$->items, ps->job->mem);
+    }
+    | case_branches patterns RPAREN case_list DSEMI linebreak {
+        $$ = add_case_item($1, $2, $4.head, ps);
+    }
+    ;
+
+// Patterns can't be keywords (unless quoted), esac would be one
+patterns:
+    word {
+        $$ = new_words(ps);
+        vec_append(&($1), sizeof (char*), &($$->procs[0]->argv));
+    }
+    | patterns PIPE word {
+        vec_append(&($3), sizeof (char*), &($1->procs[0]->argv));
+        $$ = $1;
+    }
+    ;
+
+// Jobs of a case branch, the last of which needs no separator before ;;
+case_list:
+    linebreak {$$ = (job_list) {NULL, NULL};}
+    | linebreak jobs {$$ = $2;}
+    | linebreak and_or {$$ = $2;}
+    | linebreak jobs and_or {
+        $2.tail->next = $3.head;
+        $$ = (job_list) {$2.head, $3.tail};
+    }
+    ;
+
+// Jobs of a compound command, each ended by a separator
+list:
+    linebreak jobs {$$ = $2;}
+    ;
+
+jobs:
+    and_or sep linebreak {
+        if (!end_job($1.tail, $2)) {
+            YYABORT;
+        }
+    }
+    | jobs and_or sep linebreak {
+        if (!end_job($2.tail, $3)) {
+            YYABORT;
+        }
+        $1.tail->next = $2.head;
+        $$ = (job_list) {$1.head, $2.tail};
+    }
+    ;
+
+and_or:
+    command {$$ = (job_list) {$1, $1};}
+    | and_or AND linebreak command {
+        $1.tail->sep = SEP_AND;
+        $1.tail->next = $4;
+        $$ = (job_list) {$1.head, $4};
+    }
+    | and_or OR linebreak command {
+        $1.tail->sep = SEP_OR;
+        $1.tail->next = $4;
+        $$ = (job_list) {$1.head, $4};
+    }
+    ;
+
+sep:
+    SEMI {$$ = SEMI;}
+    | BKG {$$ = BKG;}
+    | NL {$$ = NL;}
+    ;
+
+linebreak:
+    linebreak NL
+    |
+    ;
+
+word: WORD | ASSIGN | TIME ;
+
+keyword:
+    KW_IF | KW_THEN | KW_ELSE | KW_ELIF | KW_FI | KW_WHILE | KW_DO | KW_DONE
+    | KW_FOR | KW_IN | KW_CASE | KW_ESAC
+    ;
+
+// Make things like `echo VAR=VAL` or `echo done` work as expected
+real_arg: word | keyword ;
 
 %%
 
-int yyerror (job *w, char const *s)
+// A line that ends inside a compound command or a quote isn't complete yet.
+// If it may be continued, the error is only recorded for the caller
+int yyerror (parse_state *ps, tokenizer *lex, char const *s)
 {
-    (void) w;
+    if (ps->more && ((ps->depth && lex->done) || lex->unclosed)) {
+        ps->incomplete = true;
+        return 0;
+    }
     Err_msg("%s", s);
     return 0;
 }
@@ -0,0 +1,354 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Limits the number of background jobs running at once. Jobs past the limit
+// wait in a queue and are launched as running ones complete.
+//
+// The shell also takes part in GNU make's jobserver protocol: a pipe or fifo
+// holding one byte (token) per free slot, named in MAKEFLAGS. When started
+// by make (or by another marcel) with a jobserver, every background job past
+// the first needs a token, so the fan-out shares make's budget. `jobs -j N`
+// with no jobserver around creates one, so that makes run by the shell share
+// its budget in turn
+
+#include <errno.h> // errno
+#include <stdio.h> // snprintf
+#include <stdlib.h> // atexit, getenv
+#include <string.h> // strstr, strerror
+
+#include <fcntl.h> // open, O_*
+#include <unistd.h> // pipe, read, write, close
+#include <sys/stat.h> // fstat, S_ISFIFO
+#include <linux/limits.h> // PATH_MAX
+
+#include "ds/proc.h" // job
+#include "ds/vec.h" // vec_alloc, vec_append, vec_len
+#include "execute.h" // launch_job
+#include "jobs.h" // interactive, format_job_info, is_completed...
+#include "macros.h" // Stopif, Err_msg, Free, Arr_len
+#include "scheduler.h" // SLOT_*
+#include "variables.h" // get_var, set_var
+
+#define WAITING_INIT_SIZE 64
+#define TOKENS_INIT_SIZE 64
+// make reads "+" tokens, anything else it reads as an error marker
+#define TOKEN '+'
+
+// Max number of background jobs running at once, 0 if there is no limit
+static size_t limit;
+// Background jobs holding a slot
+static size_t n_running;
+// Jobs held back until a slot frees up, oldest first from waiting_head.
+// Entries of jobs that went away are NULL
+static job **waiting;
+static size_t waiting_head;
+
+// Jobserver descriptors, -1 if there is none. Reads never block
+static int js_read = -1;
+static int js_write = -1;
+// Whether a job runs on the slot we were given by whoever started us
+static bool implicit_taken;
+// Tokens read from the jobserver that haven't been written back yet
+static unsigned char *tokens;
+
+static void cleanup_scheduler(void);
+static int reopen_nonblocking(int fd);
+
+void initialize_scheduler(void)
+{
+    waiting = vec_alloc(WAITING_INIT_SIZE * sizeof *waiting);
+    tokens = vec_alloc(TOKENS_INIT_SIZE * sizeof *tokens);
+    atexit(cleanup_scheduler);
+}
+
+// Give back every token still held. Background jobs still running at exit
+// are left to themselves
+static void cleanup_scheduler(void)
+{
+    size_t n_tokens = vec_len(tokens);
+    if (n_tokens) {
+        write(js_write, tokens, n_tokens);
+    }
+    vec_free(tokens);
+    vec_free(waiting);
+}
+
+// Whether fd is open and a pipe or fifo
+static bool is_fifo(int fd)
+{
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+// Use the jobserver named by the last --jobserver-auth (or the older
+// --jobserver-fds) option in MAKEFLAGS. Fifos are opened by path, pipes are
+// reopened through /proc so reads can be made non-blocking without changing
+// the pipe make itself reads from. Called before the shell opens anything,
+// so that descriptors make didn't pass on can't be mistaken for the pipe
+void join_jobserver(void)
+{
+    char const *makeflags = getenv("MAKEFLAGS");
+    if (!makeflags) {
+        return;
+    }
+    char const *auth = NULL;
+    char const *options[] = {"--jobserver-auth=", "--jobserver-fds="};
+    for (size_t i = 0; i < Arr_len(options) && !auth; i++) {
+        for (char const *s = makeflags; (s = strstr(s, options[i])); s++) {
+            auth = s + strlen(options[i]);
+        }
+    }
+    if (!auth) {
+        return;
+    }
+
+    int r, w;
+    if (strncmp(auth, "fifo:", sizeof "fifo:" - 1) == 0) {
+        auth += sizeof "fifo:" - 1;
+        char path[PATH_MAX];
+        size_t len = strcspn(auth, " ");
+        if (len >= sizeof path) {
+            return;
+        }
+        memcpy(path, auth, len);
+        path[len] = '\0';
+        js_read = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (js_read != -1 && !is_fifo(js_read)) {
+            close(js_read);
+            js_read = -1;
+        }
+        js_write = js_read;
+    } else if (sscanf(auth, "%d,%d", &r, &w) == 2) {
+        // make only passes the descriptors on to commands it thinks are
+        // recursive makes, the others find them closed (or opened as
+        // something else since)
+        if (!is_fifo(r) || !is_fifo(w)) {
+            return;
+        }
+        js_read = reopen_nonblocking(r);
+        js_write = w;
+    }
+    if (js_read == -1) {
+        js_write = -1;
+    }
+}
+
+// Open the read end of a jobserver pipe again, non-blocking. Changing the
+// flags of fd itself would change them for everyone sharing the pipe
+static int reopen_nonblocking(int fd)
+{
+    char path[sizeof "/proc/self/fd/" + 3 * sizeof fd];
+    snprintf(path, sizeof path, "/proc/self/fd/%d", fd);
+    return open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+}
+
+// Create a jobserver with n slots and advertise it to our children through
+// MAKEFLAGS. It is a pipe rather than a fifo since every make version
+// understands those; its descriptors are inherited by every command we run.
+// Returns false on failure
+static bool create_jobserver(size_t n)
+{
+    int fds[2];
+    Stopif(pipe(fds) == -1, return false, "jobs: %s", strerror(errno));
+    js_read = reopen_nonblocking(fds[0]);
+    if (js_read == -1) {
+        Err_msg("jobs: %s", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    js_write = fds[1];
+    // We hold the first slot ourselves
+    for (size_t i = 1; i < n; i++) {
+        char token = TOKEN;
+        write(js_write, &token, 1);
+    }
+
+    char const *old = get_var("MAKEFLAGS");
+    char const *fmt = "%s -j%zu --jobserver-auth=%d,%d";
+    int len = snprintf(NULL, 0, fmt, old ? old : "", n, fds[0], fds[1]);
+    char *makeflags = malloc(len + 1);
+    Assert_alloc(makeflags);
+    snprintf(makeflags, len + 1, fmt, old ? old : "", n, fds[0], fds[1]);
+    set_var("MAKEFLAGS", makeflags, true);
+    Free(makeflags);
+    return true;
+}
+
+// Set the max number of background jobs running at once, 0 for no limit.
+// The first limit over 1 set without a jobserver around creates one with
+// that many slots. Returns false on failure
+bool set_job_limit(size_t n)
+{
+    limit = n;
+    bool ret = true;
+    if (n > 1 && js_read == -1) {
+        ret = create_jobserver(n);
+    }
+    run_waiting_jobs();
+    return ret;
+}
+
+size_t get_job_limit(void)
+{
+    return limit;
+}
+
+// Claim a slot for j if one is free
+static bool take_slot(job *j)
+{
+    if (limit && n_running >= limit) {
+        return false;
+    }
+    if (js_read == -1) {
+        j->slot = SLOT_LOCAL;
+    } else if (!implicit_taken) {
+        implicit_taken = true;
+        j->slot = SLOT_IMPLICIT;
+    } else {
+        unsigned char token;
+        if (read(js_read, &token, 1) != 1) {
+            return false;
+        }
+        vec_append(&token, sizeof token, (vec *) &tokens);
+        j->slot = SLOT_TOKEN;
+    }
+    n_running++;
+    return true;
+}
+
+// Free the slot of j, which has completed (or is going away)
+void release_job_slot(job *j)
+{
+    switch (j->slot) {
+    case SLOT_NONE:
+        return;
+    case SLOT_IMPLICIT:
+        implicit_taken = false;
+        break;
+    case SLOT_TOKEN: {
+        // Tokens are interchangeable, hand back the last one read
+        size_t n_tokens = vec_len(tokens) - 1;
+        write(js_write, &tokens[n_tokens], 1);
+        vec_setlen(n_tokens, tokens);
+        break;
+    }
+    }
+    j->slot = SLOT_NONE;
+    n_running--;
+}
+
+// Launch j, which holds a slot
+static int launch_in_slot(job *j)
+{
+    int ret = launch_job(j);
+    // Jobs that could not be started are already done
+    if (is_completed(j)) {
+        release_job_slot(j);
+    }
+    return ret;
+}
+
+// Launch j now, unless it goes in the background and there is no slot free
+// for it, in which case it waits for run_waiting_jobs
+// Takes a job and returns the exit status of its last process, 0 if it waits
+int schedule_job(job *j)
+{
+    if (!j->bkg || (!limit && js_read == -1)) {
+        return launch_job(j);
+    }
+    if (waiting_head == vec_len(waiting) && take_slot(j)) {
+        return launch_in_slot(j);
+    }
+    j->waiting = true;
+    vec_append(&j, sizeof j, (vec *) &waiting);
+    if (interactive) {
+        format_job_info(j, "queued");
+    }
+    return 0;
+}
+
+// Register and launch the background job j if there is a slot free for it,
+// for builtins that start jobs of their own (and keep their own queue)
+// Returns false, leaving j alone, if there is none
+bool try_launch_job(job *j)
+{
+    bool limited = limit || js_read != -1;
+    if (limited && (waiting_head != vec_len(waiting) || !take_slot(j))) {
+        return false;
+    }
+    register_job(j);
+    launch_in_slot(j);
+    return true;
+}
+
+// Forget the slots of the shell's jobs and its queue, in a child forked to
+// run a builtin. The child runs on the slot of its own job, so like any other
+// process started with a jobserver its first job needs no token
+void detach_scheduler(void)
+{
+    n_running = 0;
+    implicit_taken = false;
+    waiting_head = 0;
+    vec_setlen(0, waiting);
+    vec_setlen(0, tokens);
+}
+
+// Launch waiting jobs, oldest first, for as long as there are free slots
+void run_waiting_jobs(void)
+{
+    while (waiting_head < vec_len(waiting)) {
+        job *j = waiting[waiting_head];
+        if (j && !take_slot(j)) {
+            break;
+        }
+        waiting_head++;
+        if (j) {
+            j->waiting = false;
+            launch_in_slot(j);
+        }
+    }
+    if (waiting_head == vec_len(waiting)) {
+        waiting_head = 0;
+        vec_setlen(0, waiting);
+    }
+}
+
+// Launch every waiting job, blocking until there are slots for them
+void flush_waiting_jobs(void)
+{
+    run_waiting_jobs();
+    while (vec_len(waiting) && wait_for_change()) {
+        run_waiting_jobs();
+    }
+}
+
+// Forget j, which is going away, if it is waiting
+void drop_waiting_job(job *j)
+{
+    if (!j->waiting) {
+        return;
+    }
+    size_t n_waiting = vec_len(waiting);
+    for (size_t i = waiting_head; i < n_waiting; i++) {
+        if (waiting[i] == j) {
+            waiting[i] = NULL;
+        }
+    }
+    j->waiting = false;
+}
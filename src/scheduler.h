@@ -0,0 +1,46 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MARCEL_SCHEDULER_H
+#define MARCEL_SCHEDULER_H
+
+#include <stdbool.h>
+#include <stddef.h> // size_t
+#include "ds/proc.h" // job
+
+// Kind of slot a running background job holds (job.slot)
+enum {
+    SLOT_NONE, // Not counted against any limit
+    SLOT_LOCAL, // Counted against the shell's own limit only
+    SLOT_IMPLICIT, // Runs on the jobserver slot the shell was started with
+    SLOT_TOKEN, // Holds a token read from the jobserver
+};
+
+void join_jobserver(void);
+void initialize_scheduler(void);
+int schedule_job(job *j);
+bool try_launch_job(job *j);
+void run_waiting_jobs(void);
+void flush_waiting_jobs(void);
+void release_job_slot(job *j);
+void drop_waiting_job(job *j);
+void detach_scheduler(void);
+bool set_job_limit(size_t limit);
+size_t get_job_limit(void);
+
+#endif
@@ -16,42 +16,31 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-// NOTE: Much of the below was inspired by the signal handling found in Z Shell
-// (particularly the helper functions and signal queue)
+// Signals are delivered to the interactive loop through a self-pipe: the
+// handler only marks the signal as pending and writes a byte to the pipe,
+// which the loop polls alongside the terminal. Any number of deliveries of
+// a signal before the loop gets to it count as one
 
+#include <errno.h> // errno
 #include <stdio.h>
 #include <stdint.h>
 
+#include <fcntl.h> // fcntl, O_NONBLOCK, FD_CLOEXEC
 #include <signal.h>
+#include <unistd.h> // pipe, read, write
 
 #include "jobs.h"
 #include "macros.h"
 #include "signals.h"
 
-// SIG_ATOMIC_MAX is only guaranteed to be at least 127
-#if ((SIG_ATOMIC_MAX - 1) < 1024)
-#define MAX_QUEUE_SIZE ((size_t) SIG_ATOMIC_MAX)
-#else
-#define MAX_QUEUE_SIZE ((size_t) 1024)
-#endif
-
-typedef struct sigstate {
-    int sig;
-    sigset_t mask;
-    sig_atomic_t flags;
-} sigstate;
-
-static void handler_sync(sigstate state);
 static void handler_async(int signo);
 
-// Buffer to allow jumps out of signal handler
-sigjmp_buf sigbuf;
+// Signals that get a handler, and whether each is waiting to be taken
+static int const handled_signals[] = {SIGINT, SIGCHLD};
+static sig_atomic_t volatile pending[Arr_len(handled_signals)];
 
-sig_atomic_t volatile queue_front, queue_back;
-sigstate volatile signal_queue[MAX_QUEUE_SIZE];
-
-// Bitmask passed to signal handler
-sig_atomic_t volatile sig_flags;
+// Read and write ends of the self-pipe
+static int sig_pipe[2] = {-1, -1};
 
 void sig_handle(int sig)
 {
@@ -71,16 +60,6 @@ sigset_t sig_block(sigset_t new)
     return old;
 }
 
-// Remove signals in `new` from signal mask and return previous signal mask
-sigset_t sig_unblock(sigset_t new)
-{
-    sigset_t old;
-    // Just in case sigprocmask fails
-    sigemptyset(&old);
-    sigprocmask(SIG_UNBLOCK, &new, &old);
-    return old;
-}
-
 // Set signal mask, return previous signal mask
 sigset_t sig_setmask(sigset_t new)
 {
@@ -92,7 +71,7 @@ sigset_t sig_setmask(sigset_t new)
 }
 
 // Ignore signal
-void sig_ignore(int sig)
+static void sig_ignore(int sig)
 {
     signal(sig, SIG_IGN);
 }
@@ -103,58 +82,52 @@ void sig_default(int sig)
     signal(sig, SIG_DFL);
 }
 
-// Signal queueing
-void run_queued_signals(void)
+static void handler_async(int signo)
 {
-    while (queue_front != queue_back) {
-        queue_front = (queue_front + 1) % MAX_QUEUE_SIZE;
-        handler_sync(signal_queue[queue_front]);
+    int saved_errno = errno;
+    for (size_t i = 0; i < Arr_len(handled_signals); i++) {
+        if (handled_signals[i] == signo && !pending[i]) {
+            pending[i] = 1;
+            // The pipe is non-blocking; if it is somehow full the loop will
+            // wake up anyway
+            write(sig_pipe[1], "", 1);
+        }
     }
+    errno = saved_errno;
 }
 
-static void handler_async(int signo)
+// File descriptor that becomes readable when a handled signal arrives, -1 if
+// no signals are handled (the shell is not interactive)
+int signal_fd(void)
 {
-    // Block all signals while we see about queueing
-    sigset_t new;
-    sigfillset(&new);
-    sigset_t old = sig_block(new);
-
-    sig_atomic_t temp = ++queue_back % MAX_QUEUE_SIZE;
-    if (temp != queue_front) {
-        queue_back = temp;
-        signal_queue[queue_back] = (sigstate) {
-            .sig = signo, .mask = old, .flags = sig_flags,
-        };
-    } else {
-        // This really shouldn't ever happen
-        sig_flags |= QUEUE_FULL;
-    }
+    return sig_pipe[0];
+}
 
-    if (sig_flags & WAITING_FOR_INPUT) {
-        if (signo == SIGINT) {
-            sig_flags |= NO_RESTORE;
+// Empty the self-pipe. The signals it announced stay pending until taken
+void drain_signal_fd(void)
+{
+    char buf[64];
+    while (read(sig_pipe[0], buf, sizeof buf) > 0);
+}
+
+// Return whether sig arrived since it was last taken and mark it as handled
+bool take_signal(int sig)
+{
+    for (size_t i = 0; i < Arr_len(handled_signals); i++) {
+        if (handled_signals[i] == sig && pending[i]) {
+            pending[i] = 0;
+            return true;
         }
-        siglongjmp(sigbuf, 1);
     }
-    // Process automatically restores mask when handler returns
-    // sig_setmask(old);
-
+    return false;
 }
 
-static void handler_sync(sigstate state)
+// Whether the user asked to interrupt what the shell is doing. Lets long
+// running builtins notice ^C and stop early
+bool interrupt_pending(void)
 {
-    sigset_t old = sig_setmask(state.mask);
-    Stopif(sig_flags & QUEUE_FULL, sig_flags &= ~QUEUE_FULL,
-           "At least one signal was not handled because signal queue was full");
-    switch (state.sig) {
-    case SIGINT:
-        exit_code = M_SIGINT;
-        break;
-    case SIGCHLD:
-        exit_code = report_job_status();
-        break;
-    }
-    sig_setmask(old);
+    // SIGINT is first in handled_signals
+    return pending[0];
 }
 
 static int ignored_signals[] = {SIGTTOU, SIGTTIN, SIGTSTP};
@@ -166,15 +139,37 @@ void initialize_signal_handling(void)
             sig_ignore(ignored_signals[i]);
         }
 
+        Stopif(pipe(sig_pipe) == -1, return, "Could not create signal pipe: %s",
+               strerror(errno));
+        for (size_t i = 0; i < Arr_len(sig_pipe); i++) {
+            fcntl(sig_pipe[i], F_SETFD, FD_CLOEXEC);
+            fcntl(sig_pipe[i], F_SETFL, O_NONBLOCK);
+        }
         sig_handle(SIGINT);
     }
 }
 
+// Restore the signals ignored by the shell to their default actions. Meant
+// to be called in a child before it execs
 void reset_ignored_signals(void)
 {
     if (interactive) {
         for (size_t i = 0; i < Arr_len(ignored_signals); i++) {
-            sig_ignore(ignored_signals[i]);
+            sig_default(ignored_signals[i]);
+        }
+    }
+}
+
+// Set of signals that reset_ignored_signals restores, for use with
+// posix_spawnattr_setsigdefault
+sigset_t ignored_signal_set(void)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    if (interactive) {
+        for (size_t i = 0; i < Arr_len(ignored_signals); i++) {
+            sigaddset(&set, ignored_signals[i]);
         }
     }
+    return set;
 }
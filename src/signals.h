@@ -20,24 +20,17 @@
 #define MARCEL_SIG_H
 
 #include <signal.h>
-#include <setjmp.h>
-
-// This variable is only accessed via the two macros below
-extern sigjmp_buf sigbuf;
-
-extern sig_atomic_t volatile sig_flags;
-enum {
-    WAITING_FOR_INPUT = (1 << 0), // Process was waiting for input when it recieved signal
-    QUEUE_FULL = (1 << 1),
-    NO_RESTORE = (1 << 2), // Don't restore readline prompt when jumping
-    // To be continued...
-};
+#include <stdbool.h>
 
 void initialize_signal_handling(void);
 void reset_ignored_signals(void);
+sigset_t ignored_signal_set(void);
 void sig_default(int sig);
 void sig_handle(int sig);
 sigset_t sig_block(sigset_t old);
 sigset_t sig_setmask(sigset_t old);
-void run_queued_signals(void);
+int signal_fd(void);
+void drain_signal_fd(void);
+bool take_signal(int sig);
+bool interrupt_pending(void);
 #endif
@@ -0,0 +1,444 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Hand-written tokenizer, giving the parser the same tokens as the flex rules
+// in lexer.l without copying the line first. Words are found by skipping the
+// bytes that can't end them or need a closer look, 16 at a time with SSE2.
+// A word without quotes, escapes or command substitutions is then copied as it
+// is, the others go through word_strdup like the ones flex finds
+
+#include <limits.h> // UCHAR_MAX
+#include <string.h> // memchr, memcmp, memcpy, strchr, strlen
+
+#ifdef __SSE2__
+#include <emmintrin.h> // _mm_*
+#endif
+
+#include "ds/arena.h" // arena_alloc, arena_strndup
+#include "expand.h" // CTL_ESC, CTL_QUOTED
+// parser.h first, lexer.h needs YYSTYPE
+#include "parser.h" // WORD, ASSIGN, TIME, KW_*, NL, PIPE..., YYSTYPE
+#include "lexer.h" // yylex, yyset_extra, yy_scan_string, yy_delete_buffer
+#include "tokenizer.h"
+
+// What a byte is to a word (L_WORD in lexer.l)
+enum {
+    PLAIN = 0, // Part of it
+    BREAK, // Ends it
+    BACKSLASH, // Escapes the next byte, unless that's a newline
+    DOLLAR, // May start a command substitution
+    QUOTE, // Starts a quoted part, if it is closed
+};
+
+static unsigned char const word_bytes[UCHAR_MAX + 1] = {
+    ['\0'] = BREAK, [' '] = BREAK, ['\t'] = BREAK, ['\n'] = BREAK,
+    ['<'] = BREAK, ['>'] = BREAK, ['|'] = BREAK, ['&'] = BREAK, [';'] = BREAK,
+    [')'] = BREAK,
+    ['\\'] = BACKSLASH, ['$'] = DOLLAR, ['"'] = QUOTE, ['\''] = QUOTE,
+};
+
+// Hand the line to t->flex instead if it is set, which keeps t->cur and
+// t->token up to date as it goes
+void start_tokenizer(char const *line, tokenizer *t)
+{
+    t->done = false;
+    t->unclosed = false;
+    t->cur = line;
+    t->end = line + strlen(line);
+    if (t->flex) {
+        yyset_extra(t, t->flex);
+        t->flex_buf = yy_scan_string(line, t->flex);
+    }
+}
+
+void stop_tokenizer(tokenizer *t)
+{
+    if (t->flex) {
+        yy_delete_buffer(t->flex_buf, t->flex);
+        t->flex_buf = NULL;
+    }
+}
+
+// Skip the bytes from s that are PLAIN, up to end
+static char const *skip_plain(char const *s, char const *end)
+{
+#ifdef __SSE2__
+    // Pairs of special bytes one bit apart are compared at once with that bit
+    // set: ' ' and '"', '<' and '>', '&' and '$', '\\' and '|'
+    __m128i const space = _mm_set1_epi8('"');
+    __m128i const quote = _mm_set1_epi8('\'');
+    __m128i const tab = _mm_set1_epi8('\t');
+    __m128i const newline = _mm_set1_epi8('\n');
+    __m128i const redirect = _mm_set1_epi8('>');
+    __m128i const amp = _mm_set1_epi8('&');
+    __m128i const pipe = _mm_set1_epi8('|');
+    __m128i const semicolon = _mm_set1_epi8(';');
+    __m128i const paren = _mm_set1_epi8(')');
+    __m128i const bit1 = _mm_set1_epi8(0x02);
+    __m128i const bit5 = _mm_set1_epi8(0x20);
+    while (end - s >= 16) {
+        __m128i v = _mm_loadu_si128((__m128i const *) s);
+        __m128i v1 = _mm_or_si128(v, bit1);
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v1, space), _mm_cmpeq_epi8(v, tab)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, newline),
+                         _mm_cmpeq_epi8(v1, redirect)));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v1, amp),
+                         _mm_cmpeq_epi8(_mm_or_si128(v, bit5), pipe)));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, semicolon),
+                                         _mm_cmpeq_epi8(v, paren)));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, quote));
+        int mask = _mm_movemask_epi8(m);
+        if (mask) {
+            return s + __builtin_ctz(mask);
+        }
+        s += 16;
+    }
+#else
+    (void) end;
+#endif
+    while (word_bytes[(unsigned char) *s] == PLAIN) {
+        s++;
+    }
+    return s;
+}
+
+static char const *nested_subst_end(char const *s, int levels);
+
+// End of the quoted part starting at s (SQ and DQ in lexer.l), or NULL if it
+// isn't closed. Inside double quotes a backslash escapes any character, and
+// a "$(" starts a command substitution with quotes of its own: the quote
+// isn't closed without its end, or if levels doesn't allow one
+static char const *quote_end(char const *s, int levels)
+{
+    if (*s == '\'') {
+        s = strchr(s + 1, '\'');
+        return s ? s + 1 : NULL;
+    }
+    for (s++; *s != '"'; ) {
+        if (*s == '$' && s[1] == '(') {
+            s = levels ? nested_subst_end(s, levels) : NULL;
+            if (!s) {
+                return NULL;
+            }
+        } else if (!*s || (*s == '\\' && !*++s)) {
+            return NULL;
+        } else {
+            s++;
+        }
+    }
+    return s + 1;
+}
+
+// End of the command substitution starting at s, holding up to levels - 1
+// more (SUBST1 and SUBST2 in lexer.l), or NULL if there is none. Quoted and
+// escaped parentheses don't count
+static char const *nested_subst_end(char const *s, int levels)
+{
+    for (s += 2; *s != ')'; ) {
+        if (*s == '$' && s[1] == '(') {
+            s = levels > 1 ? nested_subst_end(s, levels - 1) : NULL;
+        } else if (*s == '"' || *s == '\'') {
+            s = quote_end(s, levels - 1);
+        } else if (*s == '\\' && s[1]) {
+            s += 2;
+        } else if (!*s || *s == '(' || *s == '\\') {
+            return NULL;
+        } else {
+            s++;
+        }
+        if (!s) {
+            return NULL;
+        }
+    }
+    return s + 1;
+}
+
+// End of the command substitution starting at s, or NULL if there is none,
+// for the lexer and expand_job to agree on
+char const *subst_end(char const *s)
+{
+    return nested_subst_end(s, SUBST_LEVELS);
+}
+
+// Length of the word at s, which ends before a quote that isn't closed. Sets
+// *escaped if it has quotes, escapes or command substitutions for word_strdup
+// to handle
+static size_t word_len(char const *s, char const *end, bool *escaped)
+{
+    char const *p = s;
+    for (;;) {
+        p = skip_plain(p, end);
+        switch (word_bytes[(unsigned char) *p]) {
+        case BACKSLASH:
+            if (!p[1] || p[1] == '\n') {
+                return p - s;
+            }
+            *escaped = true;
+            p += 2;
+            break;
+        case DOLLAR:
+            if (p[1] == '(') {
+                char const *subst = subst_end(p);
+                if (subst) {
+                    *escaped = true;
+                    p = subst;
+                    break;
+                }
+            }
+            p++;
+            break;
+        case QUOTE: {
+            char const *quote = quote_end(p, SUBST_LEVELS);
+            if (!quote) {
+                return p - s;
+            }
+            *escaped = true;
+            p = quote;
+            break;
+        }
+        default:
+            return p - s;
+        }
+    }
+}
+
+// Returns the next token of the line (0 at its end), with its string in val
+// for words. Token strings are allocated from t->mem
+int next_token(YYSTYPE *val, tokenizer *t)
+{
+    if (t->flex) {
+        int token = yylex(val, t->flex);
+        if (!token) {
+            t->token = t->cur;
+        }
+        t->done = !token;
+        t->unclosed = token == UNCLOSED;
+        return token;
+    }
+
+    char const *s = t->cur;
+    for (;; s++) {
+        while (*s == ' ' || *s == '\t') {
+            s++;
+        }
+        // A backslash ending the line or before a newline isn't part of any
+        // token (flex skips it too), anything else at least starts a word
+        if (*s != '\\' || (s[1] && s[1] != '\n')) {
+            break;
+        }
+    }
+
+    t->token = s;
+    int token = 0;
+    size_t len = 1;
+    switch (*s) {
+    case '\0':
+        len = 0;
+        break;
+    case '\n':
+        token = NL;
+        break;
+    case '<':
+        token = IN;
+        break;
+    case ';':
+        token = SEMI;
+        if (s[1] == ';') {
+            token = DSEMI;
+            len = 2;
+        }
+        break;
+    case ')':
+        token = RPAREN;
+        break;
+    case '|':
+        token = PIPE;
+        if (s[1] == '|') {
+            token = OR;
+            len = 2;
+        }
+        break;
+    case '>':
+        token = OUT_T;
+        if (s[1] == '>') {
+            token = OUT_A;
+            len = 2;
+        }
+        break;
+    case '&':
+        token = BKG;
+        if (s[1] == '&') {
+            token = AND;
+            len = 2;
+        } else if (s[1] == '>') {
+            token = s[2] == '>' ? OUT_ERR_A : OUT_ERR_T;
+            len = s[2] == '>' ? 3 : 2;
+        }
+        break;
+    case '2':
+        if (s[1] == '>') {
+            token = s[2] == '>' ? ERR_A : ERR_T;
+            len = s[2] == '>' ? 3 : 2;
+        }
+        break;
+    }
+    if (token || !len) {
+        t->cur = s + len;
+        t->done = !token;
+        return token;
+    }
+
+    bool escaped = false;
+    len = word_len(s, t->end, &escaped);
+    if (!len) {
+        // Only a quote that isn't closed can't start a word
+        t->cur = s + 1;
+        t->unclosed = true;
+        return UNCLOSED;
+    }
+
+    if (escaped) {
+        val->str = word_strdup(s, len, t->mem);
+    } else {
+        val->str = arena_alloc(len + 1, t->mem);
+        memcpy(val->str, s, len);
+        val->str[len] = '\0';
+    }
+    t->cur = s + len;
+
+    // Reserved words can't have quotes or escapes, or they'd differ from s
+    int word = reserved_word(s, len);
+    if (word != WORD) {
+        return word;
+    }
+    size_t name = 0;
+    while ((s[name] >= 'a' && s[name] <= 'z') || (s[name] >= 'A' && s[name] <= 'Z')
+           || s[name] == '_') {
+        name++;
+    }
+    // The value of an assignment may be empty
+    return name && s[name] == '=' ? ASSIGN : WORD;
+}
+
+#define Is_word(W) (len == sizeof W - 1 && !memcmp(s, W, len))
+
+// Token for the reserved word of len characters at s, WORD if it isn't one.
+// They are keywords in front of a command (or where the grammar expects
+// them), anywhere else the parser takes them as plain words
+int reserved_word(char const *s, size_t len)
+{
+    switch (*s) {
+    case 'c':
+        return Is_word("case") ? KW_CASE : WORD;
+    case 'd':
+        return Is_word("do") ? KW_DO : Is_word("done") ? KW_DONE : WORD;
+    case 'e':
+        return Is_word("else") ? KW_ELSE : Is_word("elif") ? KW_ELIF
+               : Is_word("esac") ? KW_ESAC : WORD;
+    case 'f':
+        return Is_word("fi") ? KW_FI : Is_word("for") ? KW_FOR : WORD;
+    case 'i':
+        return Is_word("if") ? KW_IF : Is_word("in") ? KW_IN : WORD;
+    case 't':
+        return Is_word("then") ? KW_THEN : Is_word("time") ? TIME : WORD;
+    case 'w':
+        return Is_word("while") ? KW_WHILE : WORD;
+    default:
+        return WORD;
+    }
+}
+
+#undef Is_word
+
+// Copy the first len characters of str, a word, into arena a, removing its
+// quotes and escapes. In a word holding a '$', each quoted part is put
+// between CTL_QUOTED for expand_job, and a '$' that is escaped or inside
+// single quotes is marked with CTL_ESC. Command substitutions are copied as
+// they are, their quotes and escapes are for when the command is parsed
+char *word_strdup(char const *str, size_t len, arena *a)
+{
+    // Every character at most gets a mark, and quotes are replaced by theirs
+    char *ret = arena_alloc((2 * len + 1) * sizeof *ret, a);
+    char const *end = str + len;
+    size_t j = 0;
+    bool quoted = false;
+    while (str != end) {
+        char const *subst;
+        if (*str == '\\') {
+            if (*++str == '$') {
+                ret[j++] = CTL_ESC;
+            }
+            ret[j++] = *str++;
+        } else if (*str == '$' && str[1] == '(' && (subst = subst_end(str))) {
+            memcpy(ret + j, str, subst - str);
+            j += subst - str;
+            str = subst;
+        } else if (*str == '\'') {
+            quoted = true;
+            ret[j++] = CTL_QUOTED;
+            for (str++; *str != '\''; str++) {
+                if (*str == '$') {
+                    ret[j++] = CTL_ESC;
+                }
+                ret[j++] = *str;
+            }
+            ret[j++] = CTL_QUOTED;
+            str++;
+        } else if (*str == '"') {
+            quoted = true;
+            ret[j++] = CTL_QUOTED;
+            for (str++; *str != '"'; str++) {
+                // Inside double quotes a backslash only escapes what would
+                // be special there, and joins lines
+                if (*str == '\\' && str[1] && strchr("$`\"\\\n", str[1])) {
+                    if (*++str == '\n') {
+                        continue;
+                    }
+                    if (*str == '$') {
+                        ret[j++] = CTL_ESC;
+                    }
+                } else if (*str == '$' && str[1] == '('
+                           && (subst = subst_end(str))) {
+                    memcpy(ret + j, str, subst - str);
+                    j += subst - str;
+                    str = subst - 1;
+                    continue;
+                }
+                ret[j++] = *str;
+            }
+            ret[j++] = CTL_QUOTED;
+            str++;
+        } else {
+            ret[j++] = *str++;
+        }
+    }
+    ret[j] = '\0';
+
+    // Only expand_job needs the quotes, and only looks at words with a '$'
+    if (quoted && !memchr(ret, '$', j)) {
+        size_t k = 0;
+        for (size_t i = 0; i < j; i++) {
+            if (ret[i] != CTL_QUOTED) {
+                ret[k++] = ret[i];
+            }
+        }
+        ret[k] = '\0';
+    }
+    return ret;
+}
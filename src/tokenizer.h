@@ -0,0 +1,60 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MARCEL_TOKENIZER_H
+#define MARCEL_TOKENIZER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ds/arena.h" // arena
+
+// Handle on a flex scanner, also defined by lexer.h
+#ifndef YY_TYPEDEF_YY_SCANNER_T
+#define YY_TYPEDEF_YY_SCANNER_T
+typedef void *yyscan_t;
+#endif
+
+// Command substitutions deep that words may have, $(...) inside the first
+// one included (as many as lexer.l has rules for)
+#define SUBST_LEVELS 2
+
+// Token value, defined by parser.h
+union YYSTYPE;
+
+// Splits a line into tokens for the parser, with the same rules as the flex
+// scanner in lexer.l. The scanner is used instead if flex is set
+typedef struct tokenizer {
+    char const *cur; // Next character to scan
+    char const *end; // Terminating null of the line
+    char const *token; // Start of the last token returned
+    bool done; // Whether the end of the line was returned
+    bool unclosed; // Whether the last token was a quote left open
+    arena *mem; // Arena of the job being parsed, which token strings go to
+    yyscan_t flex; // Flex scanner to hand the line to, NULL for none
+    void *flex_buf; // Flex buffer holding the line
+} tokenizer;
+
+void start_tokenizer(char const *line, tokenizer *t);
+void stop_tokenizer(tokenizer *t);
+int next_token(union YYSTYPE *val, tokenizer *t);
+int reserved_word(char const *s, size_t len);
+char *word_strdup(char const *str, size_t len, arena *a);
+char const *subst_end(char const *s);
+
+#endif
@@ -0,0 +1,390 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Shell variables, kept in lookup_table as VAR nodes holding "NAME=VALUE".
+// The exported ones make up the environment of the commands the shell runs:
+// their entries are gathered into an envp array that is only rebuilt once one
+// is added or removed, and commands with assignments of their own get a copy
+// of it with those laid over it. environ is only read at startup
+
+// environ
+#define _GNU_SOURCE
+
+#include <ctype.h> // isalpha, isalnum
+#include <stdio.h> // dprintf
+#include <stdlib.h> // malloc, realloc, free, qsort
+#include <string.h> // strlen, strchr, strcspn, memcpy, strcmp
+
+#include <unistd.h> // environ
+
+#include "ds/hash_table.h" // find_node, add_node, delete_node, next_node
+#include "ds/vec.h" // vec_len
+#include "execute.h" // builtin, lookup_table, VAR
+#include "macros.h" // Stopif, Assert_alloc, Free
+#include "variables.h" // get_var, set_var...
+
+#define ENVP_INIT_SIZE 64
+// Longest variable name looked up without an allocation
+#define NAME_BUF_SIZE 64
+
+// Entries of the exported variables that are set, NULL terminated. Indexed
+// by builtin.env_index, valid unless stale
+static char **envp;
+static size_t envp_len;
+static size_t envp_cap;
+static bool envp_stale = true;
+
+// Bumped whenever a variable is set or unset, so lookups can be cached
+size_t var_generation = 1;
+
+static void cleanup_variables(void);
+
+static inline bool filter_var(void *val)
+{
+    builtin *b = val;
+    return b->type == VAR;
+}
+
+static void var_destructor(node *n)
+{
+    builtin *b = n->value;
+    free((char *) n->key);
+    free(b->var);
+    free(b);
+}
+
+static bool valid_name(char const *name, size_t len)
+{
+    if (!len || !(isalpha((unsigned char) *name) || *name == '_')) {
+        return false;
+    }
+    for (size_t i = 1; i < len; i++) {
+        if (!isalnum((unsigned char) name[i]) && name[i] != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Return the variable named by the first len characters of name, NULL if
+// there is none
+static builtin *find_var(char const *name, size_t len)
+{
+    char buf[NAME_BUF_SIZE];
+    char *key = len < sizeof buf ? buf : malloc(len + 1);
+    Assert_alloc(key);
+    memcpy(key, name, len);
+    key[len] = '\0';
+    builtin *ret = find_node(key, filter_var, lookup_table);
+    if (key != buf) {
+        free(key);
+    }
+    return ret;
+}
+
+// Return the variable named by the first len characters of name, creating it
+// (unset and not exported) if there is none
+static builtin *add_var(char const *name, size_t len)
+{
+    builtin *b = find_var(name, len);
+    if (b) {
+        return b;
+    }
+    b = malloc(sizeof *b);
+    Assert_alloc(b);
+    *b = (builtin) {.type = VAR};
+    char *key = malloc(len + 1);
+    Assert_alloc(key);
+    memcpy(key, name, len);
+    key[len] = '\0';
+    add_node(key, b, lookup_table);
+    return b;
+}
+
+// Make entry ("NAME=VALUE", with a name_len long name) the value of its
+// variable, which takes ownership of it. An exported variable changing value
+// only needs its slot in envp updated
+static void store_var(char *entry, size_t name_len, bool export)
+{
+    builtin *b = add_var(entry, name_len);
+    bool in_envp = b->exported && b->var;
+    free(b->var);
+    var_generation++;
+    b->var = entry;
+    b->exported |= export;
+    if (in_envp && !envp_stale) {
+        envp[b->env_index] = entry;
+    } else if (b->exported) {
+        envp_stale = true;
+    }
+}
+
+// Take in the environment the shell was started with
+void initialize_variables(void)
+{
+    for (char **e = environ; *e; e++) {
+        char const *eq = strchr(*e, '=');
+        if (!eq) {
+            continue;
+        }
+        char *entry = strdup(*e);
+        Assert_alloc(entry);
+        store_var(entry, eq - *e, true);
+    }
+    atexit(cleanup_variables);
+}
+
+// The variables themselves go with lookup_table
+static void cleanup_variables(void)
+{
+    Free(envp);
+}
+
+// Return the value of the variable name, NULL if it is not set
+char const *get_var(char const *name)
+{
+    builtin *b = find_node(name, filter_var, lookup_table);
+    return b && b->var ? b->var + strlen(name) + 1 : NULL;
+}
+
+// Same as get_var with a name that is the first len characters of name
+char const *get_var_n(char const *name, size_t len)
+{
+    builtin *b = find_var(name, len);
+    return b && b->var ? b->var + len + 1 : NULL;
+}
+
+// Set the variable name to value, also exporting it if export is set.
+// Returns false if name is not a valid name
+bool set_var(char const *name, char const *value, bool export)
+{
+    size_t name_len = strlen(name);
+    if (!valid_name(name, name_len)) {
+        return false;
+    }
+    size_t value_len = strlen(value);
+    char *entry = malloc(name_len + value_len + 2);
+    Assert_alloc(entry);
+    memcpy(entry, name, name_len);
+    entry[name_len] = '=';
+    memcpy(entry + name_len + 1, value, value_len + 1);
+    store_var(entry, name_len, export);
+    return true;
+}
+
+// Set the variables assigned by p ("NAME=VALUE"), which runs no command
+void assign_vars(proc const *p)
+{
+    size_t n_assigns = vec_len(p->env);
+    for (size_t i = 0; i < n_assigns; i++) {
+        char *entry = strdup(p->env[i]);
+        Assert_alloc(entry);
+        store_var(entry, strcspn(entry, "="), false);
+    }
+}
+
+void unset_var(char const *name)
+{
+    builtin *b = find_node(name, filter_var, lookup_table);
+    if (!b) {
+        return;
+    }
+    if (b->exported) {
+        envp_stale = true;
+    }
+    var_generation++;
+    delete_node(name, filter_var, var_destructor, lookup_table);
+}
+
+// Return the environment of the shell's commands, rebuilding it if stale.
+// It is owned by this module and valid until a variable changes
+char **get_envp(void)
+{
+    if (!envp_stale) {
+        return envp;
+    }
+    envp_len = 0;
+    size_t pos = 0;
+    for (node *n; (n = next_node(&pos, filter_var, lookup_table));) {
+        builtin *b = n->value;
+        if (!b->exported || !b->var) {
+            continue;
+        }
+        if (envp_len + 1 >= envp_cap) {
+            envp_cap = envp_cap ? 2 * envp_cap : ENVP_INIT_SIZE;
+            envp = realloc(envp, envp_cap * sizeof *envp);
+            Assert_alloc(envp);
+        }
+        b->env_index = envp_len;
+        envp[envp_len++] = b->var;
+    }
+    if (!envp) {
+        envp_cap = ENVP_INIT_SIZE;
+        envp = malloc(envp_cap * sizeof *envp);
+        Assert_alloc(envp);
+    }
+    envp[envp_len] = NULL;
+    envp_stale = false;
+    return envp;
+}
+
+// Return the environment of p: the shell's, with p's own assignments laid
+// over it. That is the cached envp itself if p has none, otherwise a copy of
+// it pointing to p's assignments. Free with free_proc_envp
+char **proc_envp(proc const *p)
+{
+    char **base = get_envp();
+    size_t n_assigns = vec_len(p->env);
+    if (!n_assigns) {
+        return base;
+    }
+    char **ret = malloc((envp_len + n_assigns + 1) * sizeof *ret);
+    Assert_alloc(ret);
+    memcpy(ret, base, envp_len * sizeof *ret);
+    size_t len = envp_len;
+    for (size_t i = 0; i < n_assigns; i++) {
+        char *a = p->env[i];
+        size_t name_len = strcspn(a, "=");
+        builtin *b = find_var(a, name_len);
+        if (b && b->exported && b->var) {
+            ret[b->env_index] = a;
+            continue;
+        }
+        // The same name may be assigned more than once, the last one counts
+        size_t k = envp_len;
+        while (k < len && strncmp(ret[k], a, name_len + 1) != 0) {
+            k++;
+        }
+        ret[k] = a;
+        len += k == len;
+    }
+    ret[len] = NULL;
+    return ret;
+}
+
+void free_proc_envp(char **e)
+{
+    if (e != envp) {
+        free(e);
+    }
+}
+
+static int compare_keys(void const *a, void const *b)
+{
+    node const *n_a = *(node * const *) a;
+    node const *n_b = *(node * const *) b;
+    return strcmp(n_a->key, n_b->key);
+}
+
+// Write every exported variable to fd as an export command, sorted by name
+static int print_exports(int fd)
+{
+    node **exported = NULL;
+    size_t n_exported = 0;
+    size_t cap = 0;
+    size_t pos = 0;
+    for (node *n; (n = next_node(&pos, filter_var, lookup_table));) {
+        builtin *b = n->value;
+        if (!b->exported) {
+            continue;
+        }
+        if (n_exported == cap) {
+            cap = cap ? 2 * cap : ENVP_INIT_SIZE;
+            exported = realloc(exported, cap * sizeof *exported);
+            Assert_alloc(exported);
+        }
+        exported[n_exported++] = n;
+    }
+    qsort(exported, n_exported, sizeof *exported, compare_keys);
+
+    for (size_t i = 0; i < n_exported; i++) {
+        builtin *b = exported[i]->value;
+        char const *key = exported[i]->key;
+        if (!b->var) {
+            dprintf(fd, "export %s\n", key);
+            continue;
+        }
+        // Single quotes are closed around an escaped quote
+        dprintf(fd, "export %s='", key);
+        for (char const *s = b->var + strlen(key) + 1; *s; ) {
+            size_t len = strcspn(s, "'");
+            dprintf(fd, "%.*s", (int) len, s);
+            s += len;
+            if (*s) {
+                dprintf(fd, "'\\''");
+                s++;
+            }
+        }
+        dprintf(fd, "'\n");
+    }
+    Free(exported);
+    return 0;
+}
+
+// export [-p] [NAME[=VALUE]...]
+// Pass every NAME on to the commands the shell runs, set to VALUE if given.
+// With no NAME, list the exported variables
+int m_export(proc const *p)
+{
+    char **args = p->argv + 1;
+    if (*args && strcmp(*args, "-p") == 0) {
+        args++;
+    }
+    if (!*args) {
+        return print_exports(p->fds[1]);
+    }
+
+    int ret = 0;
+    for (; *args; args++) {
+        size_t name_len = strcspn(*args, "=");
+        if (!valid_name(*args, name_len)) {
+            Err_msg("export: %s: not a valid name", *args);
+            ret = 1;
+        } else if ((*args)[name_len]) {
+            char *entry = strdup(*args);
+            Assert_alloc(entry);
+            store_var(entry, name_len, true);
+        } else {
+            builtin *b = add_var(*args, name_len);
+            if (!b->exported) {
+                b->exported = true;
+                envp_stale = true;
+            }
+        }
+    }
+    return ret;
+}
+
+// unset [-v] NAME...
+int m_unset(proc const *p)
+{
+    char **args = p->argv + 1;
+    if (*args && strcmp(*args, "-v") == 0) {
+        args++;
+    }
+    int ret = 0;
+    for (; *args; args++) {
+        if (!valid_name(*args, strlen(*args))) {
+            Err_msg("unset: %s: not a valid name", *args);
+            ret = 1;
+        } else {
+            unset_var(*args);
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,40 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MARCEL_VARIABLES_H
+#define MARCEL_VARIABLES_H
+
+#include <stdbool.h>
+#include <stddef.h> // size_t
+#include "ds/proc.h" // proc
+
+extern size_t var_generation;
+
+void initialize_variables(void);
+char const *get_var(char const *name);
+char const *get_var_n(char const *name, size_t len);
+bool set_var(char const *name, char const *value, bool export);
+void assign_vars(proc const *p);
+void unset_var(char const *name);
+char **get_envp(void);
+char **proc_envp(proc const *p);
+void free_proc_envp(char **envp);
+int m_export(proc const *p);
+int m_unset(proc const *p);
+
+#endif
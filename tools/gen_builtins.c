@@ -0,0 +1,136 @@
+/*
+ * Marcel the Shell -- a shell written in C
+ * Copyright (C) 2016 Chad Sharp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Build step that generates a perfect hash for the builtins listed in
+// src/builtins.def and prints it as a C header.
+//
+// A name is hashed from its length and its first, second, middle and last
+// characters, each scaled by its own multiplier. The generator searches for
+// multipliers that send every builtin to a different slot of the smallest
+// power of 2 table it can find. Looking up a name is then a hash, a length
+// check and one string compare.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char const *names[] = {
+#define BUILTIN(NAME, FUNC) NAME,
+#include "builtins.def"
+#undef BUILTIN
+};
+
+#define N_NAMES (sizeof names / sizeof *names)
+#define MAX_TABLE_BITS 12
+#define TRIES_PER_SIZE 100000
+
+// Must match builtin_hash in the generated header
+static uint32_t hash(char const *s, uint32_t const k[5], unsigned bits)
+{
+    size_t len = strlen(s);
+    uint32_t h = len * k[0]
+                 + (unsigned char) s[0] * k[1]
+                 + (unsigned char) s[len > 1] * k[2]
+                 + (unsigned char) s[len / 2] * k[3]
+                 + (unsigned char) s[len - 1] * k[4];
+    return (h * 0x9E3779B1u) >> (32 - bits);
+}
+
+static uint32_t next_rand(uint32_t *state)
+{
+    // xorshift32
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+int main(void)
+{
+    static int slots[1 << MAX_TABLE_BITS];
+    uint32_t k[5];
+    uint32_t state = 2463534242u;
+    size_t min_len = SIZE_MAX, max_len = 0;
+    for (size_t i = 0; i < N_NAMES; i++) {
+        size_t len = strlen(names[i]);
+        if (!len) {
+            fprintf(stderr, "gen_builtins: empty builtin name\n");
+            return 1;
+        }
+        min_len = len < min_len ? len : min_len;
+        max_len = len > max_len ? len : max_len;
+    }
+
+    unsigned bits = 1;
+    while ((1u << bits) < N_NAMES) {
+        bits++;
+    }
+    for (; bits <= MAX_TABLE_BITS; bits++) {
+        for (size_t try = 0; try < TRIES_PER_SIZE; try++) {
+            for (size_t i = 0; i < 5; i++) {
+                k[i] = next_rand(&state) | 1;
+            }
+            memset(slots, -1, sizeof slots);
+            size_t i = 0;
+            for (; i < N_NAMES; i++) {
+                uint32_t h = hash(names[i], k, bits);
+                if (slots[h] != -1) {
+                    break;
+                }
+                slots[h] = i;
+            }
+            if (i == N_NAMES) {
+                goto found;
+            }
+        }
+    }
+    fprintf(stderr, "gen_builtins: no perfect hash found, builtin names may "
+                    "only differ in characters the hash doesn't look at\n");
+    return 1;
+
+found:
+    printf("// Generated by tools/gen_builtins from src/builtins.def. "
+           "Do not edit\n\n");
+    printf("#ifndef MARCEL_BUILTIN_HASH_H\n#define MARCEL_BUILTIN_HASH_H\n\n");
+    printf("#include <stddef.h>\n#include <stdint.h>\n\n");
+    printf("#define BUILTIN_MIN_LEN %zu\n", min_len);
+    printf("#define BUILTIN_MAX_LEN %zu\n\n", max_len);
+    printf("// Slot in builtin_slots for a name of length len "
+           "(BUILTIN_MIN_LEN <= len)\n");
+    printf("static inline uint32_t builtin_hash(char const *s, size_t len)\n"
+           "{\n");
+    printf("    uint32_t h = len * %#xu\n"
+           "                 + (unsigned char) s[0] * %#xu\n"
+           "                 + (unsigned char) s[len > 1] * %#xu\n"
+           "                 + (unsigned char) s[len / 2] * %#xu\n"
+           "                 + (unsigned char) s[len - 1] * %#xu;\n",
+           k[0], k[1], k[2], k[3], k[4]);
+    printf("    return (h * 0x9E3779B1u) >> %u;\n}\n\n", 32 - bits);
+    printf("// Index into the builtin tables for each slot, -1 if empty\n");
+    printf("static short const builtin_slots[%u] = {\n", 1u << bits);
+    for (size_t i = 0; i < (1u << bits); i++) {
+        printf("    %d,", slots[i]);
+        if (slots[i] != -1) {
+            printf(" // %s", names[slots[i]]);
+        }
+        printf("\n");
+    }
+    printf("};\n\n#endif\n");
+    return 0;
+}